@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include "addrorder.h"
+
+/*
+ * Store up to max of the IPv4 and IPv6 addresses of aitop in addrs, with
+ * the families alternating in the manner of RFC 8305.  The family of the
+ * first address goes first, and the addresses of one family keep their
+ * order.  Returns the number of addresses stored.
+ */
+int
+addrinfo_interleave(struct addrinfo *aitop, struct addrinfo **addrs, int max)
+{
+	struct addrinfo *ai;
+	int i, j, n, family;
+
+	for (n = 0, ai = aitop; ai != NULL && n < max; ai = ai->ai_next)
+		if (ai->ai_family == AF_INET || ai->ai_family == AF_INET6)
+			addrs[n++] = ai;
+	for (i = 1; i < n; i++) {
+		family = addrs[i - 1]->ai_family;
+		if (addrs[i]->ai_family != family)
+			continue;
+		for (j = i + 1; j < n && addrs[j]->ai_family == family; j++)
+			;
+		if (j == n)
+			break;
+		/* move the next address of the other family up */
+		ai = addrs[j];
+		memmove(&addrs[i + 1], &addrs[i], (j - i) * sizeof(*addrs));
+		addrs[i] = ai;
+	}
+	return (n);
+}
@@ -54,6 +54,8 @@ RCSID("$OpenBSD: channels.c,v 1.175 2002/06/10 22:28:41 markus Exp $");
 #include "key.h"
 #include "authfd.h"
 #include "pathnames.h"
+#include "atomicio.h"
+#include "addrorder.h"
 
 
 /* -- channel core */
@@ -70,12 +72,50 @@ static Channel **channels = NULL;
  */
 static int channels_alloc = 0;
 
+/*
+ * Stack of unused slots in the channel array.  Opening and closing a
+ * channel is O(1): the most recently freed id is reused first, so ids
+ * are not handed out lowest first.  Fresh slots from channel_grow() are
+ * pushed so that they come out in ascending order.
+ */
+static int *channel_slots = NULL;
+static int channel_nslots = 0;
+
+/*
+ * Live channels in order of creation.  Listeners are kept on their own
+ * list, so that the data paths do not have to skip them.
+ */
+TAILQ_HEAD(channel_list, Channel);
+static struct channel_list channel_lists[CHAN_NLISTS] = {
+	TAILQ_HEAD_INITIALIZER(channel_lists[CHAN_LIST_DATA]),
+	TAILQ_HEAD_INITIALIZER(channel_lists[CHAN_LIST_LISTEN]),
+};
+static int channels_live = 0;
+
 /*
  * Maximum file descriptor value used in any of the channels.  This is
  * updated in channel_new.
  */
 static int channel_max_fd = 0;
 
+/*
+ * Readiness backend used by channel_prepare_poll(), if any.  Channel
+ * descriptors are removed from it before they are closed.
+ */
+static Sshpoll *channel_poller = NULL;
+
+/*
+ * Windows grow up to this size.  The growth beyond the initial windows
+ * of all channels is kept below channel_window_max * CHAN_WINDOW_BUDGET,
+ * windows are shrunk when this is exceeded.
+ */
+static int channel_window_max = CHAN_WINDOW_MAX_DEFAULT;
+static u_int channel_window_total = 0;
+#define CHAN_WINDOW_BUDGET	4
+
+/* minimal interval for rate measurements, usec */
+#define CHAN_RATE_INTERVAL	10000
+
 
 /* -- tcp forwarding */
 
@@ -131,8 +171,65 @@ static u_int x11_fake_data_len;
 /* AF_UNSPEC or AF_INET or AF_INET6 */
 static int IPv4or6 = AF_UNSPEC;
 
+
+/* -- name resolution */
+
+/*
+ * Forwarded connections resolve their target in a subprocess, so that a
+ * slow resolver does not stall the other channels.  At most
+ * RESOLVE_MAX_ACTIVE of them run at a time; further lookups wait in
+ * state SSH_CHANNEL_CONNECTING until one finishes.  The answers are kept
+ * in a small direct mapped cache for a fixed time, since getaddrinfo()
+ * does not tell us the TTL of the records.
+ */
+#define RESOLVE_MAX_ACTIVE	8
+#define RESOLVE_MAX_ADDRS	8
+#define RESOLVE_CACHE_SIZE	64
+#define RESOLVE_TTL		60	/* seconds, for answers */
+#define RESOLVE_NEG_TTL		10	/* seconds, for unknown hosts */
+
+struct resolve_reply {
+	int	gaierr;
+	int	naddrs;
+	socklen_t addrlen[RESOLVE_MAX_ADDRS];
+	struct sockaddr_storage addr[RESOLVE_MAX_ADDRS];
+};
+
+static struct resolve_entry {
+	char	*host;
+	time_t	 expires;
+	struct resolve_reply r;
+} resolve_cache[RESOLVE_CACHE_SIZE];
+
+/* number of running resolver subprocesses */
+static int resolve_active = 0;
+
+/*
+ * Connecting channels try the addresses of the target in the manner of
+ * RFC 8305: if an attempt has not completed after CHAN_CONNECT_DELAY,
+ * the next address is raced against it in c->efd.
+ */
+#define CHAN_CONNECT_DELAY	250	/* ms */
+
+/* milliseconds until the next channel timer is due, or -1 */
+static int channel_timeout_ms = -1;
+
+/*
+ * Ids of the channels whose pre handler has to run before the next
+ * sshpoll_wait().  The other channels keep the interest they have
+ * registered with channel_poller.
+ */
+static int *channel_dirty = NULL;
+static int channel_ndirty = 0;
+static int channel_dirty_alloc = 0;
+
 /* helper */
 static void port_open_helper(Channel *c, char *rtype);
+static int channel_read_buffer(int, Buffer *);
+static void resolve_cache_store(const char *, struct resolve_reply *);
+static int resolve_start(const char *);
+static int connect_to_addr(struct resolve_reply *, int, u_short);
+static int connect_to_addrs(struct resolve_reply *, const char *, u_short);
 
 /* -- channel core */
 
@@ -150,9 +247,30 @@ channel_lookup(int id)
 		log("channel_lookup: %d: bad id: channel free", id);
 		return NULL;
 	}
+	/* the caller is about to change the channel */
+	channel_mark(c);
 	return c;
 }
 
+/*
+ * Queue a channel for channel_prepare_poll().  Everything that can change
+ * what a channel waits for calls this: protocol input, state transitions,
+ * post handlers, output to the peer and pending timers.
+ */
+void
+channel_mark(Channel *c)
+{
+	if (c->dirty)
+		return;
+	c->dirty = 1;
+	if (channel_ndirty >= channel_dirty_alloc) {
+		channel_dirty_alloc = MAX(channel_dirty_alloc * 2, 16);
+		channel_dirty = xrealloc(channel_dirty,
+		    channel_dirty_alloc * sizeof(int));
+	}
+	channel_dirty[channel_ndirty++] = c->self;
+}
+
 /*
  * Register filedescriptors for a channel, used when allocating a channel or
  * when the channel consumer/producer is ready, e.g. shell exec'd
@@ -169,6 +287,13 @@ channel_register_fds(Channel *c, int rfd, int wfd, int efd,
 
 	/* XXX set close-on-exec -markus */
 
+	/* descriptor numbers may be reused; forget any stale interest */
+	if (channel_poller != NULL) {
+		sshpoll_set(channel_poller, rfd, 0, -1);
+		sshpoll_set(channel_poller, wfd, 0, -1);
+		sshpoll_set(channel_poller, efd, 0, -1);
+	}
+
 	c->rfd = rfd;
 	c->wfd = wfd;
 	c->sock = (rfd == wfd) ? rfd : -1;
@@ -203,42 +328,57 @@ channel_register_fds(Channel *c, int rfd, int wfd, int efd,
  * remote_name to be freed.
  */
 
+/* Double the channel array and put the new slots on the free stack. */
+static void
+channel_grow(void)
+{
+	int i, n;
+
+	n = channels_alloc == 0 ? 16 : channels_alloc * 2;
+	debug2("channel: expanding %d", n);
+	channels = xrealloc(channels, n * sizeof(Channel *));
+	channel_slots = xrealloc(channel_slots, n * sizeof(int));
+	for (i = n - 1; i >= channels_alloc; i--) {
+		channels[i] = NULL;
+		channel_slots[channel_nslots++] = i;
+	}
+	channels_alloc = n;
+}
+
 Channel *
 channel_new(char *ctype, int type, int rfd, int wfd, int efd,
     int window, int maxpack, int extusage, char *remote_name, int nonblock)
 {
-	int i, found;
+	int found;
 	Channel *c;
 
 	/* Do initial allocation if this is the first call. */
-	if (channels_alloc == 0) {
-		channels_alloc = 10;
-		channels = xmalloc(channels_alloc * sizeof(Channel *));
-		for (i = 0; i < channels_alloc; i++)
-			channels[i] = NULL;
+	if (channels_alloc == 0)
 		fatal_add_cleanup((void (*) (void *)) channel_free_all, NULL);
-	}
-	/* Try to find a free slot where to put the new channel. */
-	for (found = -1, i = 0; i < channels_alloc; i++)
-		if (channels[i] == NULL) {
-			/* Found a free slot. */
-			found = i;
-			break;
-		}
-	if (found == -1) {
-		/* There are no free slots.  Take last+1 slot and expand the array.  */
-		found = channels_alloc;
-		channels_alloc += 10;
-		debug2("channel: expanding %d", channels_alloc);
-		channels = xrealloc(channels, channels_alloc * sizeof(Channel *));
-		for (i = found; i < channels_alloc; i++)
-			channels[i] = NULL;
-	}
+	if (channel_nslots == 0)
+		channel_grow();
+	found = channel_slots[--channel_nslots];
+
 	/* Initialize and return new channel. */
 	c = channels[found] = xmalloc(sizeof(Channel));
 	memset(c, 0, sizeof(Channel));
+	switch (type) {
+	case SSH_CHANNEL_X11_LISTENER:
+	case SSH_CHANNEL_PORT_LISTENER:
+	case SSH_CHANNEL_RPORT_LISTENER:
+	case SSH_CHANNEL_AUTH_SOCKET:
+	case SSH_CHANNEL_MUX_LISTENER:
+		c->list = CHAN_LIST_LISTEN;
+		break;
+	default:
+		c->list = CHAN_LIST_DATA;
+		break;
+	}
+	TAILQ_INSERT_TAIL(&channel_lists[c->list], c, next);
+	channels_live++;
 	buffer_init(&c->input);
 	buffer_init(&c->output);
+	chunkbuf_init(&c->outq);
 	buffer_init(&c->extended);
 	c->ostate = CHAN_OUTPUT_OPEN;
 	c->istate = CHAN_INPUT_OPEN;
@@ -249,6 +389,7 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	c->ctype = ctype;
 	c->local_window = window;
 	c->local_window_max = window;
+	c->local_window_base = window;
 	c->local_consumed = 0;
 	c->local_maxpacket = maxpack;
 	c->remote_id = -1;
@@ -260,6 +401,7 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 	c->detach_user = NULL;
 	c->confirm = NULL;
 	c->input_filter = NULL;
+	channel_mark(c);
 	debug("channel %d: new [%s]", found, remote_name);
 	return c;
 }
@@ -267,12 +409,11 @@ channel_new(char *ctype, int type, int rfd, int wfd, int efd,
 static int
 channel_find_maxfd(void)
 {
-	int i, max = 0;
+	int l, max = 0;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL) {
+	for (l = 0; l < CHAN_NLISTS; l++) {
+		TAILQ_FOREACH(c, &channel_lists[l], next) {
 			max = MAX(max, c->rfd);
 			max = MAX(max, c->wfd);
 			max = MAX(max, c->efd);
@@ -287,6 +428,8 @@ channel_close_fd(int *fdp)
 	int ret = 0, fd = *fdp;
 
 	if (fd != -1) {
+		if (channel_poller != NULL)
+			sshpoll_set(channel_poller, fd, 0, -1);
 		ret = close(fd);
 		*fdp = -1;
 		if (fd == channel_max_fd)
@@ -315,40 +458,47 @@ void
 channel_free(Channel *c)
 {
 	char *s;
-	int i, n;
 
-	for (n = 0, i = 0; i < channels_alloc; i++)
-		if (channels[i])
-			n++;
 	debug("channel_free: channel %d: %s, nchannels %d", c->self,
-	    c->remote_name ? c->remote_name : "???", n);
+	    c->remote_name ? c->remote_name : "???", channels_live);
 
 	s = channel_open_message();
 	debug3("channel_free: status: %s", s);
 	xfree(s);
 
+	if (c->resolving && c->sock != -1)
+		resolve_active--;
 	if (c->sock != -1)
 		shutdown(c->sock, SHUT_RDWR);
 	channel_close_fds(c);
 	buffer_free(&c->input);
 	buffer_free(&c->output);
+	chunkbuf_free(&c->outq);
 	buffer_free(&c->extended);
 	if (c->remote_name) {
 		xfree(c->remote_name);
 		c->remote_name = NULL;
 	}
+	if (c->connect_addrs)
+		xfree(c->connect_addrs);
+	channel_window_total -= c->local_window_max - c->local_window_base;
+	TAILQ_REMOVE(&channel_lists[c->list], c, next);
+	channels_live--;
 	channels[c->self] = NULL;
+	channel_slots[channel_nslots++] = c->self;
 	xfree(c);
 }
 
 void
 channel_free_all(void)
 {
-	int i;
+	int l;
+	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++)
-		if (channels[i] != NULL)
-			channel_free(channels[i]);
+	for (l = 0; l < CHAN_NLISTS; l++)
+		while ((c = TAILQ_FIRST(&channel_lists[l])) != NULL)
+			channel_free(c);
+	channel_poller = NULL;
 }
 
 /*
@@ -359,11 +509,12 @@ channel_free_all(void)
 void
 channel_close_all(void)
 {
-	int i;
+	int l;
+	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++)
-		if (channels[i] != NULL)
-			channel_close_fds(channels[i]);
+	for (l = 0; l < CHAN_NLISTS; l++)
+		TAILQ_FOREACH(c, &channel_lists[l], next)
+			channel_close_fds(c);
 }
 
 /*
@@ -373,22 +524,11 @@ channel_close_all(void)
 void
 channel_stop_listening(void)
 {
-	int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL) {
-			switch (c->type) {
-			case SSH_CHANNEL_AUTH_SOCKET:
-			case SSH_CHANNEL_PORT_LISTENER:
-			case SSH_CHANNEL_RPORT_LISTENER:
-			case SSH_CHANNEL_X11_LISTENER:
-				channel_close_fd(&c->sock);
-				channel_free(c);
-				break;
-			}
-		}
+	while ((c = TAILQ_FIRST(&channel_lists[CHAN_LIST_LISTEN])) != NULL) {
+		channel_close_fd(&c->sock);
+		channel_free(c);
 	}
 }
 
@@ -400,12 +540,10 @@ channel_stop_listening(void)
 int
 channel_not_very_much_buffered_data(void)
 {
-	u_int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c != NULL && c->type == SSH_CHANNEL_OPEN) {
+	TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_DATA], next) {
+		if (c->type == SSH_CHANNEL_OPEN) {
 #if 0
 			if (!compat20 &&
 			    buffer_len(&c->input) > packet_get_maxsize()) {
@@ -414,9 +552,9 @@ channel_not_very_much_buffered_data(void)
 				return 0;
 			}
 #endif
-			if (buffer_len(&c->output) > packet_get_maxsize()) {
+			if (CHANNEL_OUTPUT_LEN(c) > packet_get_maxsize()) {
 				debug("channel %d: big output buffer %d > %d",
-				    c->self, buffer_len(&c->output),
+				    c->self, CHANNEL_OUTPUT_LEN(c),
 				    packet_get_maxsize());
 				return 0;
 			}
@@ -430,13 +568,9 @@ channel_not_very_much_buffered_data(void)
 int
 channel_still_open(void)
 {
-	int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_DATA], next) {
 		switch (c->type) {
 		case SSH_CHANNEL_X11_LISTENER:
 		case SSH_CHANNEL_PORT_LISTENER:
@@ -446,6 +580,8 @@ channel_still_open(void)
 		case SSH_CHANNEL_DYNAMIC:
 		case SSH_CHANNEL_CONNECTING:
 		case SSH_CHANNEL_ZOMBIE:
+		case SSH_CHANNEL_MUX_LISTENER:
+		case SSH_CHANNEL_MUX_CLIENT:
 			continue;
 		case SSH_CHANNEL_LARVAL:
 			if (!compat20)
@@ -473,13 +609,9 @@ channel_still_open(void)
 int
 channel_find_open(void)
 {
-	int i;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_DATA], next) {
 		switch (c->type) {
 		case SSH_CHANNEL_CLOSED:
 		case SSH_CHANNEL_DYNAMIC:
@@ -489,22 +621,28 @@ channel_find_open(void)
 		case SSH_CHANNEL_OPENING:
 		case SSH_CHANNEL_CONNECTING:
 		case SSH_CHANNEL_ZOMBIE:
+		case SSH_CHANNEL_MUX_LISTENER:
+		case SSH_CHANNEL_MUX_CLIENT:
 			continue;
 		case SSH_CHANNEL_LARVAL:
 		case SSH_CHANNEL_AUTH_SOCKET:
 		case SSH_CHANNEL_OPEN:
 		case SSH_CHANNEL_X11_OPEN:
-			return i;
+			return c->self;
 		case SSH_CHANNEL_INPUT_DRAINING:
 		case SSH_CHANNEL_OUTPUT_DRAINING:
 			if (!compat13)
 				fatal("cannot happen: OUT_DRAIN");
-			return i;
+			return c->self;
 		default:
 			fatal("channel_find_open: bad channel type %d", c->type);
 			/* NOTREACHED */
 		}
 	}
+	/* the agent socket lives on the listener list but counts as open */
+	TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_LISTEN], next)
+		if (c->type == SSH_CHANNEL_AUTH_SOCKET)
+			return c->self;
 	return -1;
 }
 
@@ -521,15 +659,11 @@ channel_open_message(void)
 	Buffer buffer;
 	Channel *c;
 	char buf[1024], *cp;
-	int i;
 
 	buffer_init(&buffer);
 	snprintf(buf, sizeof buf, "The following connections are open:\r\n");
 	buffer_append(&buffer, buf, strlen(buf));
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
+	TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_DATA], next) {
 		switch (c->type) {
 		case SSH_CHANNEL_X11_LISTENER:
 		case SSH_CHANNEL_PORT_LISTENER:
@@ -537,6 +671,8 @@ channel_open_message(void)
 		case SSH_CHANNEL_CLOSED:
 		case SSH_CHANNEL_AUTH_SOCKET:
 		case SSH_CHANNEL_ZOMBIE:
+		case SSH_CHANNEL_MUX_LISTENER:
+		case SSH_CHANNEL_MUX_CLIENT:
 			continue;
 		case SSH_CHANNEL_LARVAL:
 		case SSH_CHANNEL_OPENING:
@@ -546,12 +682,14 @@ channel_open_message(void)
 		case SSH_CHANNEL_X11_OPEN:
 		case SSH_CHANNEL_INPUT_DRAINING:
 		case SSH_CHANNEL_OUTPUT_DRAINING:
-			snprintf(buf, sizeof buf, "  #%d %.300s (t%d r%d i%d/%d o%d/%d fd %d/%d)\r\n",
+			snprintf(buf, sizeof buf, "  #%d %.300s (t%d r%d i%d/%d o%d/%d fd %d/%d w%d/%d %uk/s)\r\n",
 			    c->self, c->remote_name,
 			    c->type, c->remote_id,
 			    c->istate, buffer_len(&c->input),
-			    c->ostate, buffer_len(&c->output),
-			    c->rfd, c->wfd);
+			    c->ostate, CHANNEL_OUTPUT_LEN(c),
+			    c->rfd, c->wfd,
+			    c->local_window, c->local_window_max,
+			    c->win_rate / 1024);
 			buffer_append(&buffer, buf, strlen(buf));
 			continue;
 		default:
@@ -637,6 +775,22 @@ channel_register_filter(int id, channel_filter_fn *fn)
 	c->input_filter = fn;
 }
 
+/*
+ * Move what was appended to c->output, e.g. by the escape handling of an
+ * input filter, behind the data already queued in c->outq.  Called
+ * before anything else is queued and before writing, which keeps the
+ * bytes in order.
+ */
+static void
+channel_output_flush(Channel *c)
+{
+	if (buffer_len(&c->output) == 0)
+		return;
+	chunkbuf_append(&c->outq, buffer_ptr(&c->output),
+	    buffer_len(&c->output));
+	buffer_clear(&c->output);
+}
+
 void
 channel_set_fds(int id, int rfd, int wfd, int efd,
     int extusage, int nonblock, u_int window_max)
@@ -646,7 +800,10 @@ channel_set_fds(int id, int rfd, int wfd, int efd,
 		fatal("channel_activate for non-larval channel %d.", id);
 	channel_register_fds(c, rfd, wfd, efd, extusage, nonblock);
 	c->type = SSH_CHANNEL_OPEN;
+	channel_window_total -= c->local_window_max - c->local_window_base;
 	c->local_window = c->local_window_max = window_max;
+	c->local_window_base = window_max;
+	c->local_window_delta = 0;
 	packet_start(SSH2_MSG_CHANNEL_WINDOW_ADJUST);
 	packet_put_int(c->remote_id);
 	packet_put_int(c->local_window);
@@ -661,45 +818,145 @@ channel_set_fds(int id, int rfd, int wfd, int efd,
  * 'channel_post*': perform any appropriate operations for channels which
  * have events pending.
  */
-typedef void chan_fn(Channel *c, fd_set * readset, fd_set * writeset);
+typedef void chan_fn(Channel *c);
 chan_fn *channel_pre[SSH_CHANNEL_MAX_TYPE];
 chan_fn *channel_post[SSH_CHANNEL_MAX_TYPE];
 
 static void
-channel_pre_listener(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_listener(Channel *c)
+{
+	c->io_want |= SSH_CHAN_IO_SOCK_R;
+}
+
+/* mux clients get their replies from c->output */
+static void
+channel_pre_mux_client(Channel *c)
+{
+	c->io_want |= SSH_CHAN_IO_SOCK_R;
+	if (buffer_len(&c->output) > 0)
+		c->io_want |= SSH_CHAN_IO_SOCK_W;
+}
+
+/* The multiplexing code does its own reading and writing; see mux.c. */
+static void
+channel_post_mux(Channel *c)
+{
+	if ((c->io_ready & (SSH_CHAN_IO_SOCK_R|SSH_CHAN_IO_SOCK_W)) &&
+	    c->mux_rcb != NULL)
+		c->mux_rcb(c);
+}
+
+/* Start the next connection attempt of c; returns the socket or -1. */
+static int
+channel_connect_next(Channel *c)
+{
+	struct resolve_reply *r = c->connect_addrs;
+	int sock = -1;
+
+	while (sock == -1 && c->connect_next < r->naddrs)
+		sock = connect_to_addr(r, c->connect_next++, c->host_port);
+	if (sock == -1)
+		return -1;
+	gettimeofday(&c->connect_tv, NULL);
+	c->connect_tv.tv_usec += CHAN_CONNECT_DELAY * 1000;
+	c->connect_tv.tv_sec += c->connect_tv.tv_usec / 1000000;
+	c->connect_tv.tv_usec %= 1000000;
+	return sock;
+}
+
+/* Start connecting c to the addresses of a lookup; returns -1 on failure. */
+static int
+channel_connect_addrs(Channel *c, struct resolve_reply *r)
 {
-	FD_SET(c->sock, readset);
+	int sock;
+
+	if (r->gaierr != 0) {
+		error("connect_to %.100s: unknown host (%s)", c->path,
+		    gai_strerror(r->gaierr));
+		return -1;
+	}
+	c->connect_addrs = xmalloc(sizeof(*r));
+	memcpy(c->connect_addrs, r, sizeof(*r));
+	c->connect_next = 0;
+	if ((sock = channel_connect_next(c)) == -1) {
+		error("connect_to %.100s port %d: failed.", c->path,
+		    c->host_port);
+		return -1;
+	}
+	channel_register_fds(c, sock, sock, -1, CHAN_EXTENDED_IGNORE, 1);
+	return 0;
 }
 
 static void
-channel_pre_connecting(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_connecting(Channel *c)
 {
+	struct timeval now;
+	int ms, sock;
+
 	debug3("channel %d: waiting for connection", c->self);
-	FD_SET(c->sock, writeset);
+	/*
+	 * While resolving, sock is the pipe from the resolver; it is -1
+	 * while the lookup waits for a free resolver.
+	 */
+	if (c->resolving) {
+		if (c->sock == -1) {
+			if (resolve_active >= RESOLVE_MAX_ACTIVE ||
+			    (sock = resolve_start(c->path)) == -1) {
+				/* try again after the next wakeup */
+				channel_mark(c);
+				return;
+			}
+			debug2("channel %d: resolving %.100s", c->self,
+			    c->path);
+			channel_register_fds(c, sock, sock, -1,
+			    CHAN_EXTENDED_IGNORE, 1);
+		}
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
+		return;
+	}
+	if (c->efd == -1 && c->connect_addrs != NULL &&
+	    c->connect_next < c->connect_addrs->naddrs) {
+		gettimeofday(&now, NULL);
+		ms = (c->connect_tv.tv_sec - now.tv_sec) * 1000 +
+		    (c->connect_tv.tv_usec - now.tv_usec) / 1000;
+		if (ms > 0) {
+			if (channel_timeout_ms == -1 || ms < channel_timeout_ms)
+				channel_timeout_ms = ms;
+			channel_mark(c);
+		} else if ((sock = channel_connect_next(c)) != -1) {
+			debug2("channel %d: racing address %d",
+			    c->self, c->connect_next - 1);
+			channel_register_fds(c, c->rfd, c->wfd, sock,
+			    CHAN_EXTENDED_IGNORE, 1);
+		}
+	}
+	c->io_want |= SSH_CHAN_IO_SOCK_W;
+	if (c->efd != -1)
+		c->io_want |= SSH_CHAN_IO_EFD_W;
 }
 
 static void
-channel_pre_open_13(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_open_13(Channel *c)
 {
 	if (buffer_len(&c->input) < packet_get_maxsize())
-		FD_SET(c->sock, readset);
-	if (buffer_len(&c->output) > 0)
-		FD_SET(c->sock, writeset);
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
+	if (CHANNEL_OUTPUT_LEN(c) > 0)
+		c->io_want |= SSH_CHAN_IO_SOCK_W;
 }
 
 static void
-channel_pre_open(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_open(Channel *c)
 {
 	u_int limit = compat20 ? c->remote_window : packet_get_maxsize();
 
 	if (c->istate == CHAN_INPUT_OPEN &&
 	    limit > 0 &&
 	    buffer_len(&c->input) < limit)
-		FD_SET(c->rfd, readset);
+		c->io_want |= SSH_CHAN_IO_RFD;
 	if (c->ostate == CHAN_OUTPUT_OPEN ||
 	    c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
-		if (buffer_len(&c->output) > 0) {
-			FD_SET(c->wfd, writeset);
+		if (CHANNEL_OUTPUT_LEN(c) > 0) {
+			c->io_want |= SSH_CHAN_IO_WFD;
 		} else if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN) {
 			if (CHANNEL_EFD_OUTPUT_ACTIVE(c))
 			       debug2("channel %d: obuf_empty delayed efd %d/(%d)",
@@ -712,16 +969,16 @@ channel_pre_open(Channel *c, fd_set * readset, fd_set * writeset)
 	if (compat20 && c->efd != -1) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
 		    buffer_len(&c->extended) > 0)
-			FD_SET(c->efd, writeset);
+			c->io_want |= SSH_CHAN_IO_EFD_W;
 		else if (!(c->flags & CHAN_EOF_SENT) &&
 		    c->extended_usage == CHAN_EXTENDED_READ &&
 		    buffer_len(&c->extended) < c->remote_window)
-			FD_SET(c->efd, readset);
+			c->io_want |= SSH_CHAN_IO_EFD_R;
 	}
 }
 
 static void
-channel_pre_input_draining(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_input_draining(Channel *c)
 {
 	if (buffer_len(&c->input) == 0) {
 		packet_start(SSH_MSG_CHANNEL_CLOSE);
@@ -733,12 +990,12 @@ channel_pre_input_draining(Channel *c, fd_set * readset, fd_set * writeset)
 }
 
 static void
-channel_pre_output_draining(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_output_draining(Channel *c)
 {
-	if (buffer_len(&c->output) == 0)
+	if (CHANNEL_OUTPUT_LEN(c) == 0)
 		chan_mark_dead(c);
 	else
-		FD_SET(c->sock, writeset);
+		c->io_want |= SSH_CHAN_IO_SOCK_W;
 }
 
 /*
@@ -751,17 +1008,17 @@ channel_pre_output_draining(Channel *c, fd_set * readset, fd_set * writeset)
  * Returns: 0 = need more data, -1 = wrong cookie, 1 = ok
  */
 static int
-x11_open_helper(Buffer *b)
+x11_open_helper(Chunkbuf *b)
 {
 	u_char *ucp;
 	u_int proto_len, data_len;
 
 	/* Check if the fixed size part of the packet is in buffer. */
-	if (buffer_len(b) < 12)
+	if (chunkbuf_len(b) < 12)
 		return 0;
 
 	/* Parse the lengths of variable-length fields. */
-	ucp = buffer_ptr(b);
+	ucp = chunkbuf_pullup(b, 12);
 	if (ucp[0] == 0x42) {	/* Byte order MSB first. */
 		proto_len = 256 * ucp[6] + ucp[7];
 		data_len = 256 * ucp[8] + ucp[9];
@@ -775,9 +1032,11 @@ x11_open_helper(Buffer *b)
 	}
 
 	/* Check if the whole packet is in buffer. */
-	if (buffer_len(b) <
+	if (chunkbuf_len(b) <
 	    12 + ((proto_len + 3) & ~3) + ((data_len + 3) & ~3))
 		return 0;
+	ucp = chunkbuf_pullup(b,
+	    12 + ((proto_len + 3) & ~3) + ((data_len + 3) & ~3));
 
 	/* Check if authentication protocol matches. */
 	if (proto_len != strlen(x11_saved_proto) ||
@@ -809,13 +1068,13 @@ x11_open_helper(Buffer *b)
 }
 
 static void
-channel_pre_x11_open_13(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_x11_open_13(Channel *c)
 {
-	int ret = x11_open_helper(&c->output);
+	int ret = x11_open_helper(&c->outq);
 	if (ret == 1) {
 		/* Start normal processing for the channel. */
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open_13(c, readset, writeset);
+		channel_pre_open_13(c);
 	} else if (ret == -1) {
 		/*
 		 * We have received an X11 connection that has bad
@@ -824,6 +1083,7 @@ channel_pre_x11_open_13(Channel *c, fd_set * readset, fd_set * writeset)
 		log("X11 connection rejected because of wrong authentication.");
 		buffer_clear(&c->input);
 		buffer_clear(&c->output);
+		chunkbuf_clear(&c->outq);
 		channel_close_fd(&c->sock);
 		c->sock = -1;
 		c->type = SSH_CHANNEL_CLOSED;
@@ -834,15 +1094,15 @@ channel_pre_x11_open_13(Channel *c, fd_set * readset, fd_set * writeset)
 }
 
 static void
-channel_pre_x11_open(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_x11_open(Channel *c)
 {
-	int ret = x11_open_helper(&c->output);
+	int ret = x11_open_helper(&c->outq);
 
 	/* c->force_drain = 1; */
 
 	if (ret == 1) {
 		c->type = SSH_CHANNEL_OPEN;
-		channel_pre_open(c, readset, writeset);
+		channel_pre_open(c);
 	} else if (ret == -1) {
 		log("X11 connection rejected because of wrong authentication.");
 		debug("X11 rejected %d i%d/o%d", c->self, c->istate, c->ostate);
@@ -850,6 +1110,7 @@ channel_pre_x11_open(Channel *c, fd_set * readset, fd_set * writeset)
 		buffer_clear(&c->input);
 		chan_ibuf_empty(c);
 		buffer_clear(&c->output);
+		chunkbuf_clear(&c->outq);
 		/* for proto v1, the peer will send an IEOF */
 		if (compat20)
 			chan_write_failed(c);
@@ -861,7 +1122,7 @@ channel_pre_x11_open(Channel *c, fd_set * readset, fd_set * writeset)
 
 /* try to decode a socks4 header */
 static int
-channel_decode_socks4(Channel *c, fd_set * readset, fd_set * writeset)
+channel_decode_socks4(Channel *c)
 {
 	u_char *p, *host;
 	int len, have, i, found;
@@ -925,13 +1186,14 @@ channel_decode_socks4(Channel *c, fd_set * readset, fd_set * writeset)
 	s4_rsp.command = 90;			/* cd: req granted */
 	s4_rsp.dest_port = 0;			/* ignored */
 	s4_rsp.dest_addr.s_addr = INADDR_ANY;	/* ignored */
-	buffer_append(&c->output, (char *)&s4_rsp, sizeof(s4_rsp));
+	channel_output_flush(c);
+	chunkbuf_append(&c->outq, &s4_rsp, sizeof(s4_rsp));
 	return 1;
 }
 
 /* dynamic port forwarding */
 static void
-channel_pre_dynamic(Channel *c, fd_set * readset, fd_set * writeset)
+channel_pre_dynamic(Channel *c)
 {
 	u_char *p;
 	int have, ret;
@@ -943,14 +1205,14 @@ channel_pre_dynamic(Channel *c, fd_set * readset, fd_set * writeset)
 	/* check if the fixed size part of the packet is in buffer. */
 	if (have < 4) {
 		/* need more */
-		FD_SET(c->sock, readset);
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
 		return;
 	}
 	/* try to guess the protocol */
 	p = buffer_ptr(&c->input);
 	switch (p[0]) {
 	case 0x04:
-		ret = channel_decode_socks4(c, readset, writeset);
+		ret = channel_decode_socks4(c);
 		break;
 	default:
 		ret = -1;
@@ -961,7 +1223,7 @@ channel_pre_dynamic(Channel *c, fd_set * readset, fd_set * writeset)
 	} else if (ret == 0) {
 		debug2("channel %d: pre_dynamic: need more", c->self);
 		/* need more */
-		FD_SET(c->sock, readset);
+		c->io_want |= SSH_CHAN_IO_SOCK_R;
 	} else {
 		/* switch to the next state */
 		c->type = SSH_CHANNEL_OPENING;
@@ -971,7 +1233,7 @@ channel_pre_dynamic(Channel *c, fd_set * readset, fd_set * writeset)
 
 /* This is our fake X11 server socket. */
 static void
-channel_post_x11_listener(Channel *c, fd_set * readset, fd_set * writeset)
+channel_post_x11_listener(Channel *c)
 {
 	Channel *nc;
 	struct sockaddr addr;
@@ -980,7 +1242,7 @@ channel_post_x11_listener(Channel *c, fd_set * readset, fd_set * writeset)
 	char buf[16384], *remote_ipaddr;
 	int remote_port;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R)) {
 		debug("X11 connection requested.");
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, &addr, &addrlen);
@@ -1084,7 +1346,7 @@ port_open_helper(Channel *c, char *rtype)
  * This socket is listening for connections to a forwarded TCP/IP port.
  */
 static void
-channel_post_port_listener(Channel *c, fd_set * readset, fd_set * writeset)
+channel_post_port_listener(Channel *c)
 {
 	Channel *nc;
 	struct sockaddr addr;
@@ -1092,7 +1354,7 @@ channel_post_port_listener(Channel *c, fd_set * readset, fd_set * writeset)
 	socklen_t addrlen;
 	char *rtype;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R)) {
 		debug("Connection to port %d forwarding "
 		    "to %.100s port %d requested.",
 		    c->listening_port, c->path, c->host_port);
@@ -1129,7 +1391,7 @@ channel_post_port_listener(Channel *c, fd_set * readset, fd_set * writeset)
 			/*
 			 * do not call the channel_post handler until
 			 * this flag has been reset by a pre-handler.
-			 * otherwise the FD_ISSET calls might overflow
+			 * otherwise the io_ready bits might be stale
 			 */
 			nc->delayed = 1;
 		} else {
@@ -1143,7 +1405,7 @@ channel_post_port_listener(Channel *c, fd_set * readset, fd_set * writeset)
  * clients.
  */
 static void
-channel_post_auth_listener(Channel *c, fd_set * readset, fd_set * writeset)
+channel_post_auth_listener(Channel *c)
 {
 	Channel *nc;
 	char *name;
@@ -1151,7 +1413,7 @@ channel_post_auth_listener(Channel *c, fd_set * readset, fd_set * writeset)
 	struct sockaddr addr;
 	socklen_t addrlen;
 
-	if (FD_ISSET(c->sock, readset)) {
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R)) {
 		addrlen = sizeof(addr);
 		newsock = accept(c->sock, &addr, &addrlen);
 		if (newsock < 0) {
@@ -1178,60 +1440,172 @@ channel_post_auth_listener(Channel *c, fd_set * readset, fd_set * writeset)
 }
 
 static void
-channel_post_connecting(Channel *c, fd_set * readset, fd_set * writeset)
+channel_open_failed(Channel *c, const char *reason)
+{
+	if (compat20) {
+		packet_start(SSH2_MSG_CHANNEL_OPEN_FAILURE);
+		packet_put_int(c->remote_id);
+		packet_put_int(SSH2_OPEN_CONNECT_FAILED);
+		if (!(datafellows & SSH_BUG_OPENFAILURE)) {
+			packet_put_cstring(reason);
+			packet_put_cstring("");
+		}
+	} else {
+		packet_start(SSH_MSG_CHANNEL_OPEN_FAILURE);
+		packet_put_int(c->remote_id);
+	}
+	packet_send();
+	chan_mark_dead(c);
+}
+
+/* Collect the answer of the resolver and start connecting. */
+static void
+channel_post_resolving(Channel *c)
+{
+	struct resolve_reply r;
+	int len;
+
+	len = channel_read_buffer(c->sock, &c->input);
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return;
+	if (len > 0)
+		return;		/* wait for EOF */
+	channel_close_fds(c);
+	c->resolving = 0;
+	resolve_active--;
+	if (buffer_len(&c->input) != sizeof(r)) {
+		memset(&r, 0, sizeof(r));
+		r.gaierr = EAI_FAIL;
+	} else {
+		buffer_get(&c->input, &r, sizeof(r));
+		if (r.naddrs < 0 || r.naddrs > RESOLVE_MAX_ADDRS)
+			r.naddrs = 0;
+		resolve_cache_store(c->path, &r);
+	}
+	buffer_clear(&c->input);
+	debug2("channel %d: resolved %.100s: %d addresses", c->self,
+	    c->path, r.naddrs);
+	if (channel_connect_addrs(c, &r) == -1)
+		channel_open_failed(c, r.gaierr != 0 ?
+		    gai_strerror(r.gaierr) : "connect failed");
+}
+
+/* Returns the pending error of a connecting socket. */
+static int
+channel_connect_error(int sock)
 {
 	int err = 0;
 	socklen_t sz = sizeof(err);
 
-	if (FD_ISSET(c->sock, writeset)) {
-		if (getsockopt(c->sock, SOL_SOCKET, SO_ERROR, &err, &sz) < 0) {
-			err = errno;
-			error("getsockopt SO_ERROR failed");
-		}
-		if (err == 0) {
-			debug("channel %d: connected", c->self);
-			c->type = SSH_CHANNEL_OPEN;
-			if (compat20) {
-				packet_start(SSH2_MSG_CHANNEL_OPEN_CONFIRMATION);
-				packet_put_int(c->remote_id);
-				packet_put_int(c->self);
-				packet_put_int(c->local_window);
-				packet_put_int(c->local_maxpacket);
-			} else {
-				packet_start(SSH_MSG_CHANNEL_OPEN_CONFIRMATION);
-				packet_put_int(c->remote_id);
-				packet_put_int(c->self);
-			}
-		} else {
-			debug("channel %d: not connected: %s",
-			    c->self, strerror(err));
-			if (compat20) {
-				packet_start(SSH2_MSG_CHANNEL_OPEN_FAILURE);
-				packet_put_int(c->remote_id);
-				packet_put_int(SSH2_OPEN_CONNECT_FAILED);
-				if (!(datafellows & SSH_BUG_OPENFAILURE)) {
-					packet_put_cstring(strerror(err));
-					packet_put_cstring("");
-				}
-			} else {
-				packet_start(SSH_MSG_CHANNEL_OPEN_FAILURE);
-				packet_put_int(c->remote_id);
-			}
-			chan_mark_dead(c);
+	if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &sz) < 0) {
+		err = errno;
+		error("getsockopt SO_ERROR failed");
+	}
+	return err;
+}
+
+/* The connection is up; confirm the channel. */
+static void
+channel_connected(Channel *c)
+{
+	debug("channel %d: connected", c->self);
+	xfree(c->connect_addrs);
+	c->connect_addrs = NULL;
+	c->type = SSH_CHANNEL_OPEN;
+	if (compat20) {
+		packet_start(SSH2_MSG_CHANNEL_OPEN_CONFIRMATION);
+		packet_put_int(c->remote_id);
+		packet_put_int(c->self);
+		packet_put_int(c->local_window);
+		packet_put_int(c->local_maxpacket);
+	} else {
+		packet_start(SSH_MSG_CHANNEL_OPEN_CONFIRMATION);
+		packet_put_int(c->remote_id);
+		packet_put_int(c->self);
+	}
+	packet_send();
+}
+
+/*
+ * c->sock holds the oldest connection attempt and c->efd the one raced
+ * against it, if any.  The first to complete wins; a failed attempt is
+ * replaced by the next address right away.
+ */
+static void
+channel_post_connecting(Channel *c)
+{
+	int err, sock;
+
+	if (c->resolving) {
+		if ((c->io_ready & SSH_CHAN_IO_SOCK_R))
+			channel_post_resolving(c);
+		return;
+	}
+	if (c->efd != -1 && (c->io_ready & SSH_CHAN_IO_EFD_W)) {
+		if ((err = channel_connect_error(c->efd)) == 0) {
+			sock = c->efd;
+			c->efd = -1;
+			channel_close_fds(c);
+			channel_register_fds(c, sock, sock, -1,
+			    CHAN_EXTENDED_IGNORE, 1);
+			channel_connected(c);
+			return;
 		}
-		packet_send();
+		debug("channel %d: not connected: %s", c->self, strerror(err));
+		channel_close_fd(&c->efd);
+		gettimeofday(&c->connect_tv, NULL);
+	}
+	if (!(c->io_ready & SSH_CHAN_IO_SOCK_W))
+		return;
+	if ((err = channel_connect_error(c->sock)) == 0) {
+		channel_close_fd(&c->efd);
+		channel_connected(c);
+		return;
+	}
+	debug("channel %d: not connected: %s", c->self, strerror(err));
+	sock = c->efd;
+	c->efd = -1;
+	channel_close_fds(c);
+	if (sock == -1 && (sock = channel_connect_next(c)) == -1) {
+		error("connect_to %.100s port %d: failed.", c->path,
+		    c->host_port);
+		channel_open_failed(c, strerror(err));
+		return;
 	}
+	channel_register_fds(c, sock, sock, -1, CHAN_EXTENDED_IGNORE, 1);
 }
 
+/* maximum amount of data read from a channel descriptor at a time */
+#define CHAN_READ_MAX	(16*1024)
+
+/*
+ * Read from fd straight into the free space at the end of b, instead of
+ * bouncing the data through a stack buffer.
+ */
 static int
-channel_handle_rfd(Channel *c, fd_set * readset, fd_set * writeset)
+channel_read_buffer(int fd, Buffer *b)
 {
-	char buf[16*1024];
+	u_char *p;
+	int len;
+
+	p = buffer_append_space(b, CHAN_READ_MAX);
+	len = read(fd, p, CHAN_READ_MAX);
+	buffer_consume_end(b, len > 0 ? CHAN_READ_MAX - len : CHAN_READ_MAX);
+	return len;
+}
+
+static int
+channel_handle_rfd(Channel *c)
+{
+	char buf[CHAN_READ_MAX];
 	int len;
 
 	if (c->rfd != -1 &&
-	    FD_ISSET(c->rfd, readset)) {
-		len = read(c->rfd, buf, sizeof(buf));
+	    (c->io_ready & SSH_CHAN_IO_RFD)) {
+		if (c->input_filter != NULL)
+			len = read(c->rfd, buf, sizeof(buf));
+		else
+			len = channel_read_buffer(c->rfd, &c->input);
 		if (len < 0 && (errno == EINTR || errno == EAGAIN))
 			return 1;
 		if (len <= 0) {
@@ -1243,6 +1617,7 @@ channel_handle_rfd(Channel *c, fd_set * readset, fd_set * writeset)
 				return -1;
 			} else if (compat13) {
 				buffer_clear(&c->output);
+				chunkbuf_clear(&c->outq);
 				c->type = SSH_CHANNEL_INPUT_DRAINING;
 				debug("channel %d: input draining.", c->self);
 			} else {
@@ -1250,32 +1625,35 @@ channel_handle_rfd(Channel *c, fd_set * readset, fd_set * writeset)
 			}
 			return -1;
 		}
-		if (c->input_filter != NULL) {
-			if (c->input_filter(c, buf, len) == -1) {
-				debug("channel %d: filter stops", c->self);
-				chan_read_failed(c);
-			}
-		} else {
-			buffer_append(&c->input, buf, len);
+		if (c->input_filter != NULL &&
+		    c->input_filter(c, buf, len) == -1) {
+			debug("channel %d: filter stops", c->self);
+			chan_read_failed(c);
 		}
 	}
 	return 1;
 }
+/* maximum number of output chunks written with one writev() */
+#define CHAN_WRITE_IOV	16
+
 static int
-channel_handle_wfd(Channel *c, fd_set * readset, fd_set * writeset)
+channel_handle_wfd(Channel *c)
 {
 	struct termios tio;
+	struct iovec iov[CHAN_WRITE_IOV];
 	u_char *data;
 	u_int dlen;
 	int len;
 
 	/* Send buffered output data to the socket. */
+	channel_output_flush(c);
 	if (c->wfd != -1 &&
-	    FD_ISSET(c->wfd, writeset) &&
-	    buffer_len(&c->output) > 0) {
-		data = buffer_ptr(&c->output);
-		dlen = buffer_len(&c->output);
-		len = write(c->wfd, data, dlen);
+	    (c->io_ready & SSH_CHAN_IO_WFD) &&
+	    chunkbuf_len(&c->outq) > 0) {
+		dlen = chunkbuf_len(&c->outq);
+		len = writev(c->wfd, iov,
+		    chunkbuf_iov(&c->outq, iov, CHAN_WRITE_IOV));
+		data = iov[0].iov_base;
 		if (len < 0 && (errno == EINTR || errno == EAGAIN))
 			return 1;
 		if (len <= 0) {
@@ -1285,6 +1663,7 @@ channel_handle_wfd(Channel *c, fd_set * readset, fd_set * writeset)
 				return -1;
 			} else if (compat13) {
 				buffer_clear(&c->output);
+				chunkbuf_clear(&c->outq);
 				debug("channel %d: input draining.", c->self);
 				c->type = SSH_CHANNEL_INPUT_DRAINING;
 			} else {
@@ -1305,7 +1684,7 @@ channel_handle_wfd(Channel *c, fd_set * readset, fd_set * writeset)
 				packet_send();
 			}
 		}
-		buffer_consume(&c->output, len);
+		chunkbuf_consume(&c->outq, len);
 		if (compat20 && len > 0) {
 			c->local_consumed += len;
 		}
@@ -1313,15 +1692,14 @@ channel_handle_wfd(Channel *c, fd_set * readset, fd_set * writeset)
 	return 1;
 }
 static int
-channel_handle_efd(Channel *c, fd_set * readset, fd_set * writeset)
+channel_handle_efd(Channel *c)
 {
-	char buf[16*1024];
 	int len;
 
 /** XXX handle drain efd, too */
 	if (c->efd != -1) {
 		if (c->extended_usage == CHAN_EXTENDED_WRITE &&
-		    FD_ISSET(c->efd, writeset) &&
+		    (c->io_ready & SSH_CHAN_IO_EFD_W) &&
 		    buffer_len(&c->extended) > 0) {
 			len = write(c->efd, buffer_ptr(&c->extended),
 			    buffer_len(&c->extended));
@@ -1338,8 +1716,8 @@ channel_handle_efd(Channel *c, fd_set * readset, fd_set * writeset)
 				c->local_consumed += len;
 			}
 		} else if (c->extended_usage == CHAN_EXTENDED_READ &&
-		    FD_ISSET(c->efd, readset)) {
-			len = read(c->efd, buf, sizeof(buf));
+		    (c->io_ready & SSH_CHAN_IO_EFD_R)) {
+			len = channel_read_buffer(c->efd, &c->extended);
 			debug2("channel %d: read %d from efd %d",
 			    c->self, len, c->efd);
 			if (len < 0 && (errno == EINTR || errno == EAGAIN))
@@ -1348,58 +1726,162 @@ channel_handle_efd(Channel *c, fd_set * readset, fd_set * writeset)
 				debug2("channel %d: closing read-efd %d",
 				    c->self, c->efd);
 				channel_close_fd(&c->efd);
-			} else {
-				buffer_append(&c->extended, buf, len);
 			}
 		}
 	}
 	return 1;
 }
+
+/*
+ * Window auto-tuning.  A peer can send at most one window per round trip,
+ * so the window has to cover the bandwidth-delay product of the path.
+ * If the peer fills most of the window within a round trip and we keep
+ * up writing, the window is the bottleneck and it is grown towards twice
+ * the data received per round trip, up to channel_window_max.  It is
+ * halved again, down to its initial size, when our writer falls behind
+ * or the grown windows of all channels exceed the budget.
+ */
+static void
+channel_window_tune(Channel *c)
+{
+	int max = c->local_window_max, newmax = max;
+	u_int64_t budget;
+
+	budget = (u_int64_t)channel_window_max * CHAN_WINDOW_BUDGET;
+	if (CHANNEL_OUTPUT_LEN(c) > (u_int)max / 2 ||
+	    channel_window_total > budget) {
+		newmax = MAX(max / 2, c->local_window_base);
+	} else if (c->win_bdp >= (u_int)max / 4 * 3 &&
+	    max < channel_window_max) {
+		newmax = MIN(c->win_bdp, (u_int)channel_window_max / 2) * 2;
+		newmax = MIN(newmax, max * 2);
+		newmax = MAX(newmax, max);
+	}
+	c->win_bdp = 0;
+	if (newmax == max)
+		return;
+	debug2("channel %d: window max %d -> %d, rtt %u rate %u",
+	    c->self, max, newmax, c->win_rtt, c->win_rate);
+	c->local_window_max = newmax;
+	c->local_window_delta += newmax - max;
+	channel_window_total += newmax - max;
+}
+
+static u_int
+channel_window_rtt(Channel *c)
+{
+#ifdef TCP_INFO
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+
+	/* the kernel knows better, if it tells us */
+	if (compat20 && getsockopt(packet_get_connection_in(), IPPROTO_TCP,
+	    TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt > 0)
+		return ti.tcpi_rtt;
+#endif
+	return c->win_rtt;
+}
+
+/*
+ * Account for len bytes of data received on the channel.  The time it
+ * takes to receive a full window is an upper bound for the round trip
+ * time; the minimum of these samples is used, allowed to creep up slowly
+ * so that the estimate follows route changes.
+ */
+static void
+channel_window_account(Channel *c, u_int len)
+{
+	struct timeval now;
+	u_int elapsed, rtt, rate;
+
+	gettimeofday(&now, NULL);
+	if (!timerisset(&c->win_tv))
+		c->win_tv = c->rate_tv = now;
+	c->win_bytes += len;
+	c->rate_bytes += len;
+	if (c->win_bytes >= (u_int)c->local_window_max) {
+		elapsed = (now.tv_sec - c->win_tv.tv_sec) * 1000000 +
+		    now.tv_usec - c->win_tv.tv_usec;
+		if (c->win_rtt == 0 || elapsed < c->win_rtt)
+			c->win_rtt = elapsed;
+		else
+			c->win_rtt += (elapsed - c->win_rtt) / 32;
+		c->win_tv = now;
+		c->win_bytes = 0;
+	}
+	elapsed = (now.tv_sec - c->rate_tv.tv_sec) * 1000000 +
+	    now.tv_usec - c->rate_tv.tv_usec;
+	if (elapsed < CHAN_RATE_INTERVAL)
+		return;
+	/* ask the kernel once per sample, not for every packet */
+	if (c->rate_rtt == 0)
+		c->rate_rtt = channel_window_rtt(c);
+	if ((rtt = c->rate_rtt) == 0 || elapsed < rtt)
+		return;
+	c->win_bdp = (u_int64_t)c->rate_bytes * rtt / elapsed;
+	rate = (u_int64_t)c->rate_bytes * 1000000 / elapsed;
+	c->win_rate = c->win_rate == 0 ? rate : (3 * c->win_rate + rate) / 4;
+	c->rate_tv = now;
+	c->rate_bytes = 0;
+	c->rate_rtt = 0;
+}
+
 static int
 channel_check_window(Channel *c)
 {
+	int adjust;
+
 	if (c->type == SSH_CHANNEL_OPEN &&
 	    !(c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD)) &&
 	    c->local_window < c->local_window_max/2 &&
 	    c->local_consumed > 0) {
+		channel_window_tune(c);
+		adjust = c->local_consumed + c->local_window_delta;
+		c->local_consumed = 0;
+		if (adjust <= 0) {
+			/* shrinking: withhold the credit */
+			c->local_window_delta = adjust;
+			return 1;
+		}
+		c->local_window_delta = 0;
 		packet_start(SSH2_MSG_CHANNEL_WINDOW_ADJUST);
 		packet_put_int(c->remote_id);
-		packet_put_int(c->local_consumed);
+		packet_put_int(adjust);
 		packet_send();
 		debug2("channel %d: window %d sent adjust %d",
-		    c->self, c->local_window,
-		    c->local_consumed);
-		c->local_window += c->local_consumed;
-		c->local_consumed = 0;
+		    c->self, c->local_window, adjust);
+		c->local_window += adjust;
 	}
 	return 1;
 }
 
 static void
-channel_post_open(Channel *c, fd_set * readset, fd_set * writeset)
+channel_post_open(Channel *c)
 {
 	if (c->delayed)
 		return;
-	channel_handle_rfd(c, readset, writeset);
-	channel_handle_wfd(c, readset, writeset);
+	channel_handle_rfd(c);
+	channel_handle_wfd(c);
 	if (!compat20)
 		return;
-	channel_handle_efd(c, readset, writeset);
+	channel_handle_efd(c);
 	channel_check_window(c);
 }
 
 static void
-channel_post_output_drain_13(Channel *c, fd_set * readset, fd_set * writeset)
+channel_post_output_drain_13(Channel *c)
 {
+	struct iovec iov[CHAN_WRITE_IOV];
 	int len;
 	/* Send buffered output data to the socket. */
-	if (FD_ISSET(c->sock, writeset) && buffer_len(&c->output) > 0) {
-		len = write(c->sock, buffer_ptr(&c->output),
-			    buffer_len(&c->output));
+	channel_output_flush(c);
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_W) && chunkbuf_len(&c->outq) > 0) {
+		len = writev(c->sock, iov,
+		    chunkbuf_iov(&c->outq, iov, CHAN_WRITE_IOV));
 		if (len <= 0)
-			buffer_clear(&c->output);
+			chunkbuf_clear(&c->outq);
 		else
-			buffer_consume(&c->output, len);
+			chunkbuf_consume(&c->outq, len);
 	}
 }
 
@@ -1414,6 +1896,8 @@ channel_handler_init_20(void)
 	channel_pre[SSH_CHANNEL_AUTH_SOCKET] =		&channel_pre_listener;
 	channel_pre[SSH_CHANNEL_CONNECTING] =		&channel_pre_connecting;
 	channel_pre[SSH_CHANNEL_DYNAMIC] =		&channel_pre_dynamic;
+	channel_pre[SSH_CHANNEL_MUX_LISTENER] =		&channel_pre_listener;
+	channel_pre[SSH_CHANNEL_MUX_CLIENT] =		&channel_pre_mux_client;
 
 	channel_post[SSH_CHANNEL_OPEN] =		&channel_post_open;
 	channel_post[SSH_CHANNEL_PORT_LISTENER] =	&channel_post_port_listener;
@@ -1422,6 +1906,8 @@ channel_handler_init_20(void)
 	channel_post[SSH_CHANNEL_AUTH_SOCKET] =		&channel_post_auth_listener;
 	channel_post[SSH_CHANNEL_CONNECTING] =		&channel_post_connecting;
 	channel_post[SSH_CHANNEL_DYNAMIC] =		&channel_post_open;
+	channel_post[SSH_CHANNEL_MUX_LISTENER] =	&channel_post_mux;
+	channel_post[SSH_CHANNEL_MUX_CLIENT] =		&channel_post_mux;
 }
 
 static void
@@ -1504,24 +1990,96 @@ channel_garbage_collect(Channel *c)
 }
 
 static void
-channel_handler(chan_fn *ftab[], fd_set * readset, fd_set * writeset)
+channel_run(chan_fn *ftab[], Channel *c)
 {
 	static int did_init = 0;
-	int i;
-	Channel *c;
 
 	if (!did_init) {
 		channel_handler_init();
 		did_init = 1;
 	}
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
-			continue;
-		if (ftab[c->type] != NULL)
-			(*ftab[c->type])(c, readset, writeset);
-		channel_garbage_collect(c);
+	if (ftab == channel_pre)
+		c->io_want = 0;
+	if (ftab[c->type] != NULL)
+		(*ftab[c->type])(c);
+	if (ftab == channel_post) {
+		c->io_ready = 0;
+		channel_mark(c);
 	}
+	channel_garbage_collect(c);
+}
+
+static void
+channel_handler(chan_fn *ftab[])
+{
+	int l;
+	Channel *c, *next;
+
+	for (l = 0; l < CHAN_NLISTS; l++) {
+		/* the handler may free the channel */
+		for (c = TAILQ_FIRST(&channel_lists[l]); c != NULL; c = next) {
+			next = TAILQ_NEXT(c, next);
+			channel_run(ftab, c);
+		}
+	}
+}
+
+/*
+ * Run the pre handlers.  Channels are serviced while rekeying as well:
+ * the packet layer queues what they send until NEWKEYS, and the caller
+ * holds back channel_output_poll(), so their data stays buffered.
+ */
+static void
+channel_prepare(int rekeying)
+{
+	int i;
+
+	/* every channel is visited, forget the queue */
+	for (i = 0; i < channel_ndirty; i++)
+		if (channels[channel_dirty[i]] != NULL)
+			channels[channel_dirty[i]]->dirty = 0;
+	channel_ndirty = 0;
+	channel_timeout_ms = -1;
+	channel_handler(channel_pre);
+}
+
+/*
+ * Returns the number of milliseconds until a channel needs attention
+ * without any descriptor becoming ready, or -1.  Valid after
+ * channel_prepare_select() or channel_prepare_poll().
+ */
+int
+channel_poll_timeout(void)
+{
+	return channel_timeout_ms;
+}
+
+/* Returns the descriptor and direction a SSH_CHAN_IO_* bit refers to. */
+static int
+channel_io_fd(Channel *c, u_int bit, u_int *eventsp)
+{
+	switch (bit) {
+	case SSH_CHAN_IO_RFD:
+		*eventsp = SSHPOLL_IN;
+		return c->rfd;
+	case SSH_CHAN_IO_WFD:
+		*eventsp = SSHPOLL_OUT;
+		return c->wfd;
+	case SSH_CHAN_IO_EFD_R:
+		*eventsp = SSHPOLL_IN;
+		return c->efd;
+	case SSH_CHAN_IO_EFD_W:
+		*eventsp = SSHPOLL_OUT;
+		return c->efd;
+	case SSH_CHAN_IO_SOCK_R:
+		*eventsp = SSHPOLL_IN;
+		return c->sock;
+	case SSH_CHAN_IO_SOCK_W:
+		*eventsp = SSHPOLL_OUT;
+		return c->sock;
+	}
+	*eventsp = 0;
+	return -1;
 }
 
 /*
@@ -1532,8 +2090,9 @@ void
 channel_prepare_select(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
     int *nallocp, int rekeying)
 {
-	int n;
-	u_int sz;
+	int l, n, fd;
+	u_int sz, bit, events;
+	Channel *c;
 
 	n = MAX(*maxfdp, channel_max_fd);
 
@@ -1548,8 +2107,19 @@ channel_prepare_select(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
 	memset(*readsetp, 0, sz);
 	memset(*writesetp, 0, sz);
 
-	if (!rekeying)
-		channel_handler(channel_pre, *readsetp, *writesetp);
+	channel_prepare(rekeying);
+	for (l = 0; l < CHAN_NLISTS; l++) {
+		TAILQ_FOREACH(c, &channel_lists[l], next) {
+			for (bit = 1; bit <= SSH_CHAN_IO_SOCK_W; bit <<= 1) {
+				if (!(c->io_want & bit))
+					continue;
+				if ((fd = channel_io_fd(c, bit, &events)) == -1)
+					continue;
+				FD_SET(fd, events == SSHPOLL_IN ?
+				    *readsetp : *writesetp);
+			}
+		}
+	}
 }
 
 /*
@@ -1559,111 +2129,305 @@ channel_prepare_select(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
 void
 channel_after_select(fd_set * readset, fd_set * writeset)
 {
-	channel_handler(channel_post, readset, writeset);
+	int l, fd;
+	u_int bit, events;
+	Channel *c;
+
+	for (l = 0; l < CHAN_NLISTS; l++) {
+		TAILQ_FOREACH(c, &channel_lists[l], next) {
+			c->io_ready = 0;
+			for (bit = 1; bit <= SSH_CHAN_IO_SOCK_W; bit <<= 1) {
+				if (!(c->io_want & bit))
+					continue;
+				if ((fd = channel_io_fd(c, bit, &events)) == -1)
+					continue;
+				if (FD_ISSET(fd, events == SSHPOLL_IN ?
+				    readset : writeset))
+					c->io_ready |= bit;
+			}
+		}
+	}
+	channel_handler(channel_post);
+}
+
+/*
+ * Register the interest of a channel with the readiness backend.  The
+ * backend only makes a system call if the interest has changed.
+ */
+static void
+channel_register_poll(Sshpoll *sp, Channel *c)
+{
+	int fds[4], nfds, fd, j;
+	u_int want[4], bit, events;
+
+	nfds = 0;
+	for (bit = 1; bit <= SSH_CHAN_IO_SOCK_W; bit <<= 1) {
+		if ((fd = channel_io_fd(c, bit, &events)) == -1)
+			continue;
+		for (j = 0; j < nfds; j++)
+			if (fds[j] == fd)
+				break;
+		if (j == nfds) {
+			fds[nfds] = fd;
+			want[nfds++] = 0;
+		}
+		if (c->io_want & bit)
+			want[j] |= events;
+	}
+	for (j = 0; j < nfds; j++)
+		sshpoll_set(sp, fds[j], want[j], c->self);
 }
 
+/*
+ * Like channel_prepare_select(), but registers the channel descriptors
+ * with a readiness backend that keeps the interest across calls.  Only
+ * the channels queued by channel_mark() are prepared, so the cost of a
+ * wakeup does not grow with the number of idle channels.  Garbage
+ * collection happens in channel_run() for the same channels.
+ */
+void
+channel_prepare_poll(Sshpoll *sp, int rekeying)
+{
+	int i, n, id;
+	Channel *c;
 
-/* If there is data to send to the connection, enqueue some of it now. */
+	channel_poller = sp;
+	channel_timeout_ms = -1;
+	/* channels marked by the handlers are left for the next call */
+	n = channel_ndirty;
+	for (i = 0; i < n; i++) {
+		id = channel_dirty[i];
+		if ((c = channels[id]) == NULL || !c->dirty)
+			continue;
+		c->dirty = 0;
+		channel_run(channel_pre, c);
+		/* the handler may free the channel */
+		if ((c = channels[id]) != NULL)
+			channel_register_poll(sp, c);
+	}
+	channel_ndirty -= n;
+	memmove(channel_dirty, channel_dirty + n, channel_ndirty * sizeof(int));
+}
 
+/*
+ * After sshpoll_wait(), run the post handlers of the channels that own
+ * a ready descriptor.  Idle channels are not visited.
+ */
 void
-channel_output_poll(void)
+channel_after_poll(Sshpoll *sp)
 {
-	int len, i;
+	static int *ready = NULL;
+	static int nalloc = 0;
+	int i, n, fd, id;
+	u_int bit, events, revents, was;
 	Channel *c;
 
-	for (i = 0; i < channels_alloc; i++) {
-		c = channels[i];
-		if (c == NULL)
+	for (n = 0, i = 0; i < sshpoll_nready(sp); i++) {
+		if (sshpoll_ready(sp, i, &fd, &revents, &id) == -1)
+			break;
+		/* descriptors not owned by a channel are tagged -1 */
+		if (revents == 0 || id < 0 || id >= channels_alloc ||
+		    (c = channels[id]) == NULL)
+			continue;
+		was = c->io_ready;
+		for (bit = 1; bit <= SSH_CHAN_IO_SOCK_W; bit <<= 1) {
+			if (!(c->io_want & bit) ||
+			    channel_io_fd(c, bit, &events) != fd)
+				continue;
+			if (revents & events)
+				c->io_ready |= bit;
+		}
+		if (was != 0 || c->io_ready == 0)
 			continue;
+		if (n >= nalloc) {
+			nalloc = MAX(nalloc * 2, 16);
+			ready = xrealloc(ready, nalloc * sizeof(int));
+		}
+		ready[n++] = id;
+	}
+	for (i = 0; i < n; i++)
+		if ((c = channels[ready[i]]) != NULL)
+			channel_run(channel_post, c);
+}
+
+
+
+/*
+ * Channel output is scheduled deficit round robin.  In every round a
+ * channel with data may send up to the quantum of its class, and the
+ * classes are served in order of priority, so that keystrokes are not
+ * queued behind the packets of a bulk transfer.
+ */
+#define CHAN_CLASS_BULK		0	/* sessions without a tty */
+#define CHAN_CLASS_TCP		1	/* forwarded connections, agent */
+#define CHAN_CLASS_X11		2
+#define CHAN_CLASS_INTERACTIVE	3	/* sessions with a tty */
+#define CHAN_NCLASSES		4
+
+static const int channel_quantum[CHAN_NCLASSES] = {
+	16 * 1024, 32 * 1024, 64 * 1024, 128 * 1024
+};
+
+static int
+channel_class(Channel *c)
+{
+	/*
+	 * Classify by what the channel carries, not by its descriptors:
+	 * a session without a pty talks over a socketpair, too.
+	 */
+	if (strcmp(c->ctype, "session") == 0)
+		return c->isatty ? CHAN_CLASS_INTERACTIVE : CHAN_CLASS_BULK;
+	if (c->type == SSH_CHANNEL_X11_OPEN || strstr(c->ctype, "x11") != NULL)
+		return CHAN_CLASS_X11;
+	return CHAN_CLASS_TCP;
+}
 
+/*
+ * Send at most one data and one extended data packet.  Returns the number
+ * of bytes sent.
+ */
+static int
+channel_output_packet(Channel *c)
+{
+	int len, sent = 0;
+	u_int32_t hdr[2];
+
+	/* Get the amount of buffered data for this channel. */
+	if ((c->istate == CHAN_INPUT_OPEN ||
+	    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
+	    (len = buffer_len(&c->input)) > 0) {
 		/*
-		 * We are only interested in channels that can have buffered
-		 * incoming data.
+		 * Send some data for the other side over the secure
+		 * connection.
 		 */
-		if (compat13) {
-			if (c->type != SSH_CHANNEL_OPEN &&
-			    c->type != SSH_CHANNEL_INPUT_DRAINING)
-				continue;
+		if (compat20) {
+			if (len > c->remote_window)
+				len = c->remote_window;
+			if (len > c->remote_maxpacket)
+				len = c->remote_maxpacket;
 		} else {
-			if (c->type != SSH_CHANNEL_OPEN)
-				continue;
+			if (packet_is_interactive()) {
+				if (len > 1024)
+					len = 512;
+			} else {
+				/* Keep the packets at reasonable size. */
+				if (len > packet_get_maxsize()/2)
+					len = packet_get_maxsize()/2;
+			}
 		}
-		if (compat20 &&
-		    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
-			/* XXX is this true? */
-			debug3("channel %d: will not send data after close", c->self);
-			continue;
+		if (len > 0) {
+			hdr[0] = c->remote_id;
+			packet_send_data(compat20 ?
+			    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA,
+			    hdr, 1, buffer_ptr(&c->input), len);
+			buffer_consume(&c->input, len);
+			c->remote_window -= len;
+			sent += len;
 		}
+	} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
+		if (compat13)
+			fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
+		/*
+		 * input-buffer is empty and read-socket shutdown:
+		 * tell peer, that we will not send more data: send IEOF.
+		 * hack for extended data: delay EOF if EFD still in use.
+		 */
+		if (CHANNEL_EFD_INPUT_ACTIVE(c))
+		       debug2("channel %d: ibuf_empty delayed efd %d/(%d)",
+			   c->self, c->efd, buffer_len(&c->extended));
+		else
+			chan_ibuf_empty(c);
+	}
+	/* Send extended data, i.e. stderr */
+	if (compat20 &&
+	    !(c->flags & CHAN_EOF_SENT) &&
+	    c->remote_window > 0 &&
+	    (len = buffer_len(&c->extended)) > 0 &&
+	    c->extended_usage == CHAN_EXTENDED_READ) {
+		debug2("channel %d: rwin %d elen %d euse %d",
+		    c->self, c->remote_window, buffer_len(&c->extended),
+		    c->extended_usage);
+		if (len > c->remote_window)
+			len = c->remote_window;
+		if (len > c->remote_maxpacket)
+			len = c->remote_maxpacket;
+		hdr[0] = c->remote_id;
+		hdr[1] = SSH2_EXTENDED_DATA_STDERR;
+		packet_send_data(SSH2_MSG_CHANNEL_EXTENDED_DATA,
+		    hdr, 2, buffer_ptr(&c->extended), len);
+		buffer_consume(&c->extended, len);
+		c->remote_window -= len;
+		sent += len;
+		debug2("channel %d: sent ext data %d", c->self, len);
+	}
+	if (sent > 0)
+		channel_mark(c);
+	return sent;
+}
 
-		/* Get the amount of buffered data for this channel. */
-		if ((c->istate == CHAN_INPUT_OPEN ||
-		    c->istate == CHAN_INPUT_WAIT_DRAIN) &&
-		    (len = buffer_len(&c->input)) > 0) {
+/*
+ * Give every channel that has data its quantum, highest class first.
+ * Returns the number of bytes sent.
+ */
+static int
+channel_output_poll_round(void)
+{
+	int class, len, sent = 0;
+	Channel *c;
+
+	for (class = CHAN_NCLASSES - 1; class >= 0; class--) {
+		TAILQ_FOREACH(c, &channel_lists[CHAN_LIST_DATA], next) {
 			/*
-			 * Send some data for the other side over the secure
-			 * connection.
+			 * We are only interested in channels that can have
+			 * buffered incoming data.
 			 */
-			if (compat20) {
-				if (len > c->remote_window)
-					len = c->remote_window;
-				if (len > c->remote_maxpacket)
-					len = c->remote_maxpacket;
+			if (compat13) {
+				if (c->type != SSH_CHANNEL_OPEN &&
+				    c->type != SSH_CHANNEL_INPUT_DRAINING)
+					continue;
 			} else {
-				if (packet_is_interactive()) {
-					if (len > 1024)
-						len = 512;
-				} else {
-					/* Keep the packets at reasonable size. */
-					if (len > packet_get_maxsize()/2)
-						len = packet_get_maxsize()/2;
-				}
+				if (c->type != SSH_CHANNEL_OPEN)
+					continue;
 			}
-			if (len > 0) {
-				packet_start(compat20 ?
-				    SSH2_MSG_CHANNEL_DATA : SSH_MSG_CHANNEL_DATA);
-				packet_put_int(c->remote_id);
-				packet_put_string(buffer_ptr(&c->input), len);
-				packet_send();
-				buffer_consume(&c->input, len);
-				c->remote_window -= len;
+			if (channel_class(c) != class)
+				continue;
+			if (compat20 &&
+			    (c->flags & (CHAN_CLOSE_SENT|CHAN_CLOSE_RCVD))) {
+				/* XXX is this true? */
+				debug3("channel %d: will not send data after close", c->self);
+				continue;
 			}
-		} else if (c->istate == CHAN_INPUT_WAIT_DRAIN) {
-			if (compat13)
-				fatal("cannot happen: istate == INPUT_WAIT_DRAIN for proto 1.3");
 			/*
-			 * input-buffer is empty and read-socket shutdown:
-			 * tell peer, that we will not send more data: send IEOF.
-			 * hack for extended data: delay EOF if EFD still in use.
+			 * Packets are not split to fit the credit; the
+			 * overdraft is carried into the next round.
 			 */
-			if (CHANNEL_EFD_INPUT_ACTIVE(c))
-			       debug2("channel %d: ibuf_empty delayed efd %d/(%d)",
-				   c->self, c->efd, buffer_len(&c->extended));
-			else
-				chan_ibuf_empty(c);
-		}
-		/* Send extended data, i.e. stderr */
-		if (compat20 &&
-		    !(c->flags & CHAN_EOF_SENT) &&
-		    c->remote_window > 0 &&
-		    (len = buffer_len(&c->extended)) > 0 &&
-		    c->extended_usage == CHAN_EXTENDED_READ) {
-			debug2("channel %d: rwin %d elen %d euse %d",
-			    c->self, c->remote_window, buffer_len(&c->extended),
-			    c->extended_usage);
-			if (len > c->remote_window)
-				len = c->remote_window;
-			if (len > c->remote_maxpacket)
-				len = c->remote_maxpacket;
-			packet_start(SSH2_MSG_CHANNEL_EXTENDED_DATA);
-			packet_put_int(c->remote_id);
-			packet_put_int(SSH2_EXTENDED_DATA_STDERR);
-			packet_put_string(buffer_ptr(&c->extended), len);
-			packet_send();
-			buffer_consume(&c->extended, len);
-			c->remote_window -= len;
-			debug2("channel %d: sent ext data %d", c->self, len);
+			c->output_deficit += channel_quantum[class];
+			while (c->output_deficit > 0 &&
+			    (len = channel_output_packet(c)) > 0) {
+				c->output_deficit -= len;
+				sent += len;
+			}
+			/* an idle or blocked channel does not save credit */
+			if (c->output_deficit > 0)
+				c->output_deficit = 0;
 		}
 	}
+	return sent;
+}
+
+/*
+ * If there is data to send to the connection, enqueue some of it now.
+ * Rounds are repeated until the connection has enough buffered output;
+ * the data packets are encrypted as one batch.
+ */
+void
+channel_output_poll(void)
+{
+	packet_batch_begin();
+	while (channel_output_poll_round() > 0 &&
+	    packet_not_very_much_data_to_write())
+		;
+	packet_batch_end();
 }
 
 
@@ -1673,8 +2437,8 @@ void
 channel_input_data(int type, u_int32_t seq, void *ctxt)
 {
 	int id;
-	char *data;
-	u_int data_len;
+	Segment *seg;
+	u_int off, data_len;
 	Channel *c;
 
 	/* Get the channel number and verify it. */
@@ -1693,7 +2457,7 @@ channel_input_data(int type, u_int32_t seq, void *ctxt)
 		return;
 
 	/* Get the data. */
-	data = packet_get_string(&data_len);
+	seg = packet_get_string_seg(&off, &data_len);
 
 	if (compat20) {
 		if (data_len > c->local_maxpacket) {
@@ -1703,14 +2467,17 @@ channel_input_data(int type, u_int32_t seq, void *ctxt)
 		if (data_len > c->local_window) {
 			log("channel %d: rcvd too much data %d, win %d",
 			    c->self, data_len, c->local_window);
-			xfree(data);
+			segment_unref(seg);
 			return;
 		}
 		c->local_window -= data_len;
+		channel_window_account(c, data_len);
 	}
 	packet_check_eom();
-	buffer_append(&c->output, data, data_len);
-	xfree(data);
+	/* queue the decrypted packet itself instead of copying the data */
+	channel_output_flush(c);
+	chunkbuf_append_seg(&c->outq, seg, off, data_len);
+	segment_unref(seg);
 }
 
 void
@@ -1756,6 +2523,7 @@ channel_input_extended_data(int type, u_int32_t seq, void *ctxt)
 	}
 	debug2("channel %d: rcvd ext data %d", c->self, data_len);
 	c->local_window -= data_len;
+	channel_window_account(c, data_len);
 	buffer_append(&c->extended, data, data_len);
 	xfree(data);
 }
@@ -1923,8 +2691,8 @@ channel_input_open_failure(int type, u_int32_t seq, void *ctxt)
 			xfree(lang);
 	}
 	packet_check_eom();
-	/* Free the channel.  This will also close the socket. */
-	channel_free(c);
+	/* Let the garbage collector free it, so the owner is notified. */
+	chan_mark_dead(c);
 }
 
 void
@@ -1957,7 +2725,7 @@ channel_input_port_open(int type, u_int32_t seq, void *ctxt)
 	Channel *c = NULL;
 	u_short host_port;
 	char *host, *originator_string;
-	int remote_id, sock = -1;
+	int remote_id;
 
 	remote_id = packet_get_int();
 	host = packet_get_string(NULL);
@@ -1969,13 +2737,10 @@ channel_input_port_open(int type, u_int32_t seq, void *ctxt)
 		originator_string = xstrdup("unknown (remote did not supply name)");
 	}
 	packet_check_eom();
-	sock = channel_connect_to(host, host_port);
-	if (sock != -1) {
-		c = channel_new("connected socket",
-		    SSH_CHANNEL_CONNECTING, sock, sock, -1, 0, 0, 0,
-		    originator_string, 1);
+	c = channel_connect_start(host, host_port, "connected socket", 0, 0,
+	    originator_string);
+	if (c != NULL)
 		c->remote_id = remote_id;
-	}
 	if (c == NULL) {
 		packet_start(SSH_MSG_CHANNEL_OPEN_FAILURE);
 		packet_put_int(remote_id);
@@ -1993,6 +2758,13 @@ channel_set_af(int af)
 	IPv4or6 = af;
 }
 
+/* Set the ceiling for automatically grown channel windows. */
+void
+channel_set_window_max(int max)
+{
+	channel_window_max = max;
+}
+
 static int
 channel_setup_fwd_listener(int type, const char *listen_addr, u_short listen_port,
     const char *host_to_connect, u_short port_to_connect, int gateway_ports)
@@ -2228,59 +3000,191 @@ channel_clear_permitted_opens(void)
 }
 
 
-/* return socket to remote host, port */
-static int
-connect_to(const char *host, u_short port)
+/* -- name resolution */
+
+static u_int
+resolve_hash(const char *host)
 {
-	struct addrinfo hints, *ai, *aitop;
-	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
-	int gaierr;
-	int sock = -1;
+	u_int h = 0;
+
+	for (; *host != '\0'; host++)
+		h = h * 31 + tolower((u_char)*host);
+	return h % RESOLVE_CACHE_SIZE;
+}
+
+static struct resolve_reply *
+resolve_cache_lookup(const char *host)
+{
+	struct resolve_entry *e = &resolve_cache[resolve_hash(host)];
+
+	if (e->host == NULL || strcasecmp(e->host, host) != 0 ||
+	    e->expires <= time(NULL))
+		return NULL;
+	debug3("resolve_cache_lookup: %.100s: cached", host);
+	return &e->r;
+}
 
+static void
+resolve_cache_store(const char *host, struct resolve_reply *r)
+{
+	struct resolve_entry *e = &resolve_cache[resolve_hash(host)];
+
+	/* transient failures are not cached */
+	if (r->gaierr != 0 && r->gaierr != EAI_NONAME)
+		return;
+	if (e->host != NULL)
+		xfree(e->host);
+	e->host = xstrdup(host);
+	e->expires = time(NULL) +
+	    (r->naddrs > 0 ? RESOLVE_TTL : RESOLVE_NEG_TTL);
+	e->r = *r;
+}
+
+static void
+resolve_host(const char *host, struct resolve_reply *r)
+{
+	struct addrinfo hints, *ai, *aitop, *addrs[RESOLVE_MAX_ADDRS];
+	int i, n;
+
+	memset(r, 0, sizeof(*r));
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = IPv4or6;
 	hints.ai_socktype = SOCK_STREAM;
-	snprintf(strport, sizeof strport, "%d", port);
-	if ((gaierr = getaddrinfo(host, strport, &hints, &aitop)) != 0) {
-		error("connect_to %.100s: unknown host (%s)", host,
-		    gai_strerror(gaierr));
+	if ((r->gaierr = getaddrinfo(host, NULL, &hints, &aitop)) != 0)
+		return;
+	/* families alternate, starting with the one getaddrinfo() preferred */
+	n = addrinfo_interleave(aitop, addrs, RESOLVE_MAX_ADDRS);
+	for (i = 0; i < n; i++) {
+		ai = addrs[i];
+		if (ai->ai_addrlen > sizeof(r->addr[0]))
+			continue;
+		memcpy(&r->addr[r->naddrs], ai->ai_addr, ai->ai_addrlen);
+		r->addrlen[r->naddrs++] = ai->ai_addrlen;
+	}
+	freeaddrinfo(aitop);
+	if (r->naddrs == 0)
+		r->gaierr = EAI_NONAME;
+}
+
+/*
+ * Start resolving host in a subprocess.  Returns a pipe that delivers a
+ * struct resolve_reply followed by EOF, or -1.  The subprocess is
+ * detached by forking twice, so nobody has to wait for it; it keeps no
+ * descriptor but the pipe, so that it cannot hold connections open.
+ */
+static int
+resolve_start(const char *host)
+{
+	struct resolve_reply r;
+	pid_t pid;
+	int pfd[2], status, fd, i;
+
+	if (pipe(pfd) == -1) {
+		error("resolve_start: pipe: %.100s", strerror(errno));
 		return -1;
 	}
-	for (ai = aitop; ai; ai = ai->ai_next) {
-		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
-			continue;
-		if (getnameinfo(ai->ai_addr, ai->ai_addrlen, ntop, sizeof(ntop),
-		    strport, sizeof(strport), NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-			error("connect_to: getnameinfo failed");
-			continue;
-		}
-		sock = socket(ai->ai_family, SOCK_STREAM, 0);
-		if (sock < 0) {
-			error("socket: %.100s", strerror(errno));
-			continue;
-		}
-		if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
-			fatal("connect_to: F_SETFL: %s", strerror(errno));
-		if (connect(sock, ai->ai_addr, ai->ai_addrlen) < 0 &&
-		    errno != EINPROGRESS) {
-			error("connect_to %.100s port %s: %.100s", ntop, strport,
-			    strerror(errno));
-			close(sock);
-			continue;	/* fail -- try next */
-		}
-		break; /* success */
+	if ((pid = fork()) == -1) {
+		error("resolve_start: fork: %.100s", strerror(errno));
+		close(pfd[0]);
+		close(pfd[1]);
+		return -1;
+	}
+	if (pid == 0) {
+		/* the parent waits for us, so leave the cleanup to the child */
+		if (fork() != 0)
+			_exit(0);
+		for (i = 0; i < getdtablesize(); i++)
+			if (i != pfd[1])
+				close(i);
+		/* keep stdio off the descriptors getaddrinfo() opens */
+		while ((fd = open(_PATH_DEVNULL, O_RDWR)) != -1 &&
+		    fd <= STDERR_FILENO)
+			;
+		if (fd > STDERR_FILENO)
+			close(fd);
+		resolve_host(host, &r);
+		atomicio(write, pfd[1], &r, sizeof(r));
+		_exit(0);
+	}
+	close(pfd[1]);
+	while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+		;
+	resolve_active++;
+	return pfd[0];
+}
+
+/*
+ * Start a non-blocking connect to the i'th address of a lookup; returns
+ * the socket or -1.
+ */
+static int
+connect_to_addr(struct resolve_reply *r, int i, u_short port)
+{
+	struct sockaddr_storage ss;
+	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
+	int sock;
 
+	memcpy(&ss, &r->addr[i], r->addrlen[i]);
+	if (ss.ss_family == AF_INET)
+		((struct sockaddr_in *)&ss)->sin_port = htons(port);
+	else
+		((struct sockaddr_in6 *)&ss)->sin6_port = htons(port);
+	if (getnameinfo((struct sockaddr *)&ss, r->addrlen[i],
+	    ntop, sizeof(ntop), strport, sizeof(strport),
+	    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+		error("connect_to: getnameinfo failed");
+		return -1;
 	}
-	freeaddrinfo(aitop);
-	if (!ai) {
-		error("connect_to %.100s port %d: failed.", host, port);
+	sock = socket(ss.ss_family, SOCK_STREAM, 0);
+	if (sock < 0) {
+		error("socket: %.100s", strerror(errno));
+		return -1;
+	}
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+		fatal("connect_to: F_SETFL: %s", strerror(errno));
+	if (connect(sock, (struct sockaddr *)&ss, r->addrlen[i]) < 0 &&
+	    errno != EINPROGRESS) {
+		error("connect_to %.100s port %s: %.100s", ntop, strport,
+		    strerror(errno));
+		close(sock);
 		return -1;
 	}
-	/* success */
 	set_nodelay(sock);
 	return sock;
 }
 
+/* Connect to the addresses of a lookup in turn; returns the socket or -1. */
+static int
+connect_to_addrs(struct resolve_reply *r, const char *host, u_short port)
+{
+	int i, sock = -1;
+
+	if (r->gaierr != 0) {
+		error("connect_to %.100s: unknown host (%s)", host,
+		    gai_strerror(r->gaierr));
+		return -1;
+	}
+	for (i = 0; i < r->naddrs && sock == -1; i++)
+		sock = connect_to_addr(r, i, port);
+	if (sock == -1)
+		error("connect_to %.100s port %d: failed.", host, port);
+	return sock;
+}
+
+/* return socket to remote host, port */
+static int
+connect_to(const char *host, u_short port)
+{
+	struct resolve_reply r, *rp;
+
+	if ((rp = resolve_cache_lookup(host)) == NULL) {
+		resolve_host(host, &r);
+		resolve_cache_store(host, &r);
+		rp = &r;
+	}
+	return connect_to_addrs(rp, host, port);
+}
+
 int
 channel_connect_by_listen_address(u_short listen_port)
 {
@@ -2296,9 +3200,8 @@ channel_connect_by_listen_address(u_short listen_port)
 	return -1;
 }
 
-/* Check if connecting to that port is permitted and connect. */
-int
-channel_connect_to(const char *host, u_short port)
+static int
+channel_permit_open(const char *host, u_short port)
 {
 	int i, permit;
 
@@ -2313,11 +3216,74 @@ channel_connect_to(const char *host, u_short port)
 	if (!permit) {
 		log("Received request to connect to host %.100s port %d, "
 		    "but the request was denied.", host, port);
-		return -1;
+		return 0;
 	}
+	return 1;
+}
+
+/* Check if connecting to that port is permitted and connect. */
+int
+channel_connect_to(const char *host, u_short port)
+{
+	if (!channel_permit_open(host, port))
+		return -1;
 	return connect_to(host, port);
 }
 
+/*
+ * Like channel_connect_to(), but returns a new channel in state
+ * SSH_CHANNEL_CONNECTING, or NULL.  Unless the answer is cached, the
+ * channel first waits for the name lookup; see channel_post_connecting().
+ */
+Channel *
+channel_connect_start(const char *host, u_short port, char *ctype,
+    int window, int maxpack, char *remote_name)
+{
+	struct resolve_reply r, *rp;
+	Channel *c;
+	int sock;
+
+	if (!channel_permit_open(host, port)) {
+		xfree(remote_name);
+		return NULL;
+	}
+	if ((rp = resolve_cache_lookup(host)) == NULL) {
+		if (resolve_active >= RESOLVE_MAX_ACTIVE) {
+			/* channel_pre_connecting() starts it later */
+			c = channel_new(ctype, SSH_CHANNEL_CONNECTING,
+			    -1, -1, -1, window, maxpack, 0, remote_name, 1);
+			c->resolving = 1;
+			strlcpy(c->path, host, sizeof(c->path));
+			c->host_port = port;
+			debug2("channel %d: queued lookup of %.100s",
+			    c->self, host);
+			return c;
+		}
+		if ((sock = resolve_start(host)) != -1) {
+			c = channel_new(ctype, SSH_CHANNEL_CONNECTING,
+			    sock, sock, -1, window, maxpack, 0,
+			    remote_name, 1);
+			c->resolving = 1;
+			strlcpy(c->path, host, sizeof(c->path));
+			c->host_port = port;
+			debug2("channel %d: resolving %.100s", c->self, host);
+			return c;
+		}
+		resolve_host(host, &r);
+		resolve_cache_store(host, &r);
+		rp = &r;
+	}
+	c = channel_new(ctype, SSH_CHANNEL_CONNECTING, -1, -1, -1,
+	    window, maxpack, 0, remote_name, 1);
+	strlcpy(c->path, host, sizeof(c->path));
+	c->host_port = port;
+	if (channel_connect_addrs(c, rp) == -1) {
+		channel_free(c);
+		return NULL;
+	}
+	return c;
+}
+
 /* -- X11 forwarding */
 
 /*
@@ -38,7 +38,11 @@
 #ifndef CHANNEL_H
 #define CHANNEL_H
 
+#include <sys/queue.h>
+
 #include "buffer.h"
+#include "chunkbuf.h"
+#include "sshpoll.h"
 
 /* Definitions for channel types. */
 #define SSH_CHANNEL_X11_LISTENER	1	/* Listening for inet X11 conn. */
@@ -55,7 +59,9 @@
 #define SSH_CHANNEL_CONNECTING		12
 #define SSH_CHANNEL_DYNAMIC		13
 #define SSH_CHANNEL_ZOMBIE		14	/* Almost dead. */
-#define SSH_CHANNEL_MAX_TYPE		15
+#define SSH_CHANNEL_MUX_LISTENER	15	/* Listening for mux clients */
+#define SSH_CHANNEL_MUX_CLIENT		16	/* Connection from a mux client */
+#define SSH_CHANNEL_MAX_TYPE		17
 
 #define SSH_CHANNEL_PATH_LEN		256
 
@@ -64,6 +70,7 @@ typedef struct Channel Channel;
 
 typedef void channel_callback_fn(int, void *);
 typedef int channel_filter_fn(struct Channel *, char *, int);
+typedef void channel_mux_fn(struct Channel *);
 
 struct Channel {
 	int     type;		/* channel type/state */
@@ -79,9 +86,15 @@ struct Channel {
 	int     isatty;		/* rfd is a tty */
 	int     force_drain;	/* force close on iEOF */
 	int     delayed;		/* fdset hack */
+	u_int	io_want;	/* SSH_CHAN_IO_* set by pre handlers */
+	u_int	io_ready;	/* SSH_CHAN_IO_* ready for post handlers */
+	int	dirty;		/* pre handler has to run again */
 	Buffer  input;		/* data read from socket, to be sent over
 				 * encrypted connection */
-	Buffer  output;		/* data received over encrypted connection for
+	Buffer  output;		/* data for the socket appended by other
+				 * code, e.g. input filters; moved to outq
+				 * before writing */
+	Chunkbuf outq;		/* data received over encrypted connection for
 				 * send on socket */
 	Buffer  extended;
 	char    path[SSH_CHANNEL_PATH_LEN];
@@ -96,8 +109,24 @@ struct Channel {
 	int	local_window_max;
 	int	local_consumed;
 	int	local_maxpacket;
+	int	local_window_base;	/* initial local_window_max */
+	int	local_window_delta;	/* change of local_window_max not
+					 * yet announced to the peer */
+	struct timeval win_tv;		/* start of the rtt measurement */
+	u_int	win_bytes;		/* data received since win_tv */
+	struct timeval rate_tv;		/* start of the rate measurement */
+	u_int	rate_bytes;		/* data received since rate_tv */
+	u_int	rate_rtt;		/* rtt for the current rate sample */
+	u_int	win_rtt;		/* estimated round trip time, usec */
+	u_int	win_rate;		/* smoothed receive rate, bytes/s */
+	u_int	win_bdp;		/* data received in the last rtt */
 	int     extended_usage;
 	int	single_connection;
+	int	output_deficit;		/* output scheduler credit */
+	int	resolving;		/* sock is the resolver pipe */
+	struct resolve_reply *connect_addrs;	/* addresses to connect to */
+	int	connect_next;		/* next address to try */
+	struct timeval connect_tv;	/* when to race the next address */
 
 	char   *ctype;		/* type */
 
@@ -105,10 +134,30 @@ struct Channel {
 	channel_callback_fn	*confirm;
 	channel_callback_fn	*detach_user;
 
+	/* multiplexing: called when sock is readable */
+	channel_mux_fn		*mux_rcb;
+	void			*mux_ctx;
+
 	/* filter */
 	channel_filter_fn	*input_filter;
+
+	int	list;			/* CHAN_LIST_* this channel is on */
+	TAILQ_ENTRY(Channel) next;	/* live channels */
 };
 
+/* live channel lists */
+#define CHAN_LIST_DATA			0
+#define CHAN_LIST_LISTEN		1	/* listeners, auth socket */
+#define CHAN_NLISTS			2
+
+/* readiness bits for io_want/io_ready */
+#define SSH_CHAN_IO_RFD			0x01
+#define SSH_CHAN_IO_WFD			0x02
+#define SSH_CHAN_IO_EFD_R		0x04
+#define SSH_CHAN_IO_EFD_W		0x08
+#define SSH_CHAN_IO_SOCK_R		0x10
+#define SSH_CHAN_IO_SOCK_W		0x20
+
 #define CHAN_EXTENDED_IGNORE		0
 #define CHAN_EXTENDED_READ		1
 #define CHAN_EXTENDED_WRITE		2
@@ -121,6 +170,10 @@ struct Channel {
 #define CHAN_X11_PACKET_DEFAULT	(16*1024)
 #define CHAN_X11_WINDOW_DEFAULT	(4*CHAN_X11_PACKET_DEFAULT)
 
+/* ceiling for the automatically grown windows, and its allowed range */
+#define CHAN_WINDOW_MAX_DEFAULT	(16*1024*1024)
+#define CHAN_WINDOW_MAX_LIMIT	(256*1024*1024)
+
 /* possible input states */
 #define CHAN_INPUT_OPEN			0
 #define CHAN_INPUT_WAIT_DRAIN		1
@@ -138,6 +191,10 @@ struct Channel {
 #define CHAN_EOF_SENT			0x04
 #define CHAN_EOF_RCVD			0x08
 
+/* bytes waiting to be written to the socket */
+#define CHANNEL_OUTPUT_LEN(c) \
+	(buffer_len(&(c)->output) + chunkbuf_len(&(c)->outq))
+
 /* check whether 'efd' is still in use */
 #define CHANNEL_EFD_INPUT_ACTIVE(c) \
 	(compat20 && c->extended_usage == CHAN_EXTENDED_READ && \
@@ -151,6 +208,7 @@ struct Channel {
 /* channel management */
 
 Channel	*channel_lookup(int);
+void	 channel_mark(Channel *);
 Channel *channel_new(char *, int, int, int, int, int, int, int, char *, int);
 void	 channel_set_fds(int, int, int, int, int, int, u_int);
 void	 channel_free(Channel *);
@@ -182,6 +240,8 @@ void	 channel_input_window_adjust(int, u_int32_t, void *);
 
 void	 channel_prepare_select(fd_set **, fd_set **, int *, int*, int);
 void     channel_after_select(fd_set *, fd_set *);
+void	 channel_prepare_poll(Sshpoll *, int);
+void	 channel_after_poll(Sshpoll *);
 void     channel_output_poll(void);
 
 int      channel_not_very_much_buffered_data(void);
@@ -192,11 +252,14 @@ int	 channel_find_open(void);
 
 /* tcp forwarding */
 void	 channel_set_af(int af);
+void	 channel_set_window_max(int);
 void     channel_permit_all_opens(void);
 void	 channel_add_permitted_opens(char *, int);
 void	 channel_clear_permitted_opens(void);
 void     channel_input_port_forward_request(int, int);
 int	 channel_connect_to(const char *, u_short);
+Channel	*channel_connect_start(const char *, u_short, char *, int, int, char *);
+int	 channel_poll_timeout(void);
 int	 channel_connect_by_listen_address(u_short);
 void	 channel_request_remote_forwarding(u_short, const char *, u_short);
 int	 channel_setup_local_fwd_listener(u_short, const char *, u_short, int);
@@ -0,0 +1,334 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <sys/uio.h>
+
+#include "xmalloc.h"
+#include "log.h"
+#include "chunkbuf.h"
+
+/* Size classes and the number of free segments kept for each. */
+static struct {
+	u_int	size;
+	u_int	max_free;
+	u_int	nfree;
+	Segment	*free;
+} seg_class[] = {
+	{ 1024,		64,	0, NULL },
+	{ 4096,		32,	0, NULL },
+	{ 16384,	16,	0, NULL },
+	{ 36864,	16,	0, NULL },	/* a full channel data packet */
+	{ 65536,	8,	0, NULL },
+};
+#define SEG_NCLASS	(sizeof(seg_class) / sizeof(seg_class[0]))
+
+/* Data smaller than this is copied instead of adopted. */
+#define CHUNKBUF_ADOPT_MIN	512
+
+#define CHUNK_MAX_FREE	256
+static Chunk *chunk_free = NULL;
+static u_int chunk_nfree = 0;
+
+Segment *
+segment_new(u_int size)
+{
+	Segment *seg;
+	u_int i;
+
+	for (i = 0; i < SEG_NCLASS; i++)
+		if (size <= seg_class[i].size)
+			break;
+	if (i < SEG_NCLASS && seg_class[i].free != NULL) {
+		seg = seg_class[i].free;
+		seg_class[i].free = seg->next;
+		seg_class[i].nfree--;
+	} else {
+		if (i < SEG_NCLASS)
+			size = seg_class[i].size;
+		seg = xmalloc(sizeof(*seg) + size);
+		seg->data = (u_char *)(seg + 1);
+		seg->size = size;
+		seg->sclass = i < SEG_NCLASS ? (int)i : SEG_LARGE;
+	}
+	seg->used = 0;
+	seg->refcnt = 1;
+	seg->next = NULL;
+	return seg;
+}
+
+/* Wrap memory obtained from xmalloc(); it is xfree()d with the segment. */
+Segment *
+segment_adopt(void *data, u_int len)
+{
+	Segment *seg;
+
+	seg = xmalloc(sizeof(*seg));
+	seg->data = data;
+	seg->size = seg->used = len;
+	seg->refcnt = 1;
+	seg->sclass = SEG_ADOPTED;
+	seg->next = NULL;
+	return seg;
+}
+
+void
+segment_ref(Segment *seg)
+{
+	seg->refcnt++;
+}
+
+void
+segment_unref(Segment *seg)
+{
+	if (seg->refcnt == 0)
+		fatal("segment_unref: refcnt underflow");
+	if (--seg->refcnt > 0)
+		return;
+	if (seg->sclass >= 0 &&
+	    seg_class[seg->sclass].nfree < seg_class[seg->sclass].max_free) {
+		seg->next = seg_class[seg->sclass].free;
+		seg_class[seg->sclass].free = seg;
+		seg_class[seg->sclass].nfree++;
+		return;
+	}
+	if (seg->sclass == SEG_ADOPTED) {
+		memset(seg->data, 0, seg->size);
+		xfree(seg->data);
+	}
+	xfree(seg);
+}
+
+static Chunk *
+chunk_new(Segment *seg, u_int off, u_int len)
+{
+	Chunk *c;
+
+	if (chunk_free != NULL) {
+		c = chunk_free;
+		chunk_free = c->next;
+		chunk_nfree--;
+	} else
+		c = xmalloc(sizeof(*c));
+	c->seg = seg;
+	c->off = off;
+	c->len = len;
+	c->next = NULL;
+	return c;
+}
+
+static void
+chunk_release(Chunk *c)
+{
+	segment_unref(c->seg);
+	if (chunk_nfree < CHUNK_MAX_FREE) {
+		c->next = chunk_free;
+		chunk_free = c;
+		chunk_nfree++;
+	} else
+		xfree(c);
+}
+
+static void
+chunkbuf_push(Chunkbuf *b, Chunk *c)
+{
+	if (b->tail == NULL)
+		b->head = c;
+	else
+		b->tail->next = c;
+	b->tail = c;
+	b->len += c->len;
+}
+
+void
+chunkbuf_init(Chunkbuf *b)
+{
+	b->head = b->tail = NULL;
+	b->len = 0;
+}
+
+void
+chunkbuf_clear(Chunkbuf *b)
+{
+	Chunk *c;
+
+	while ((c = b->head) != NULL) {
+		b->head = c->next;
+		chunk_release(c);
+	}
+	b->tail = NULL;
+	b->len = 0;
+}
+
+void
+chunkbuf_free(Chunkbuf *b)
+{
+	chunkbuf_clear(b);
+}
+
+u_int
+chunkbuf_len(Chunkbuf *b)
+{
+	return b->len;
+}
+
+/* Copy data to the end, filling the free space of the last segment first. */
+void
+chunkbuf_append(Chunkbuf *b, const void *data, u_int len)
+{
+	const u_char *p = data;
+	Chunk *c;
+	u_int n;
+
+	while (len > 0) {
+		c = b->tail;
+		if (c != NULL && c->seg->refcnt == 1 &&
+		    c->off + c->len == c->seg->used &&
+		    c->seg->used < c->seg->size) {
+			n = MIN(len, c->seg->size - c->seg->used);
+			memcpy(c->seg->data + c->seg->used, p, n);
+			c->seg->used += n;
+			c->len += n;
+			b->len += n;
+			p += n;
+			len -= n;
+			continue;
+		}
+		chunkbuf_push(b, chunk_new(segment_new(len), 0, 0));
+	}
+}
+
+/*
+ * Append len bytes at off of seg by reference.  Small ranges are copied,
+ * so that they do not pin a larger segment.
+ */
+void
+chunkbuf_append_seg(Chunkbuf *b, Segment *seg, u_int off, u_int len)
+{
+	if (off + len > seg->used || off + len < off)
+		fatal("chunkbuf_append_seg: range %u/%u outside segment %u",
+		    off, len, seg->used);
+	if (len == 0)
+		return;
+	if (len < CHUNKBUF_ADOPT_MIN) {
+		chunkbuf_append(b, seg->data + off, len);
+		return;
+	}
+	segment_ref(seg);
+	chunkbuf_push(b, chunk_new(seg, off, len));
+}
+
+/*
+ * Append memory obtained from xmalloc(), taking over its ownership.
+ * Small blocks are copied and freed right away, to avoid queueing many
+ * tiny segments, e.g. for interactive sessions.
+ */
+void
+chunkbuf_append_mem(Chunkbuf *b, void *data, u_int len)
+{
+	Segment *seg;
+
+	if (len < CHUNKBUF_ADOPT_MIN) {
+		chunkbuf_append(b, data, len);
+		memset(data, 0, len);
+		xfree(data);
+		return;
+	}
+	seg = segment_adopt(data, len);
+	chunkbuf_push(b, chunk_new(seg, 0, len));
+}
+
+void
+chunkbuf_consume(Chunkbuf *b, u_int len)
+{
+	Chunk *c;
+
+	if (len > b->len)
+		fatal("chunkbuf_consume: trying to get more bytes %u than in "
+		    "buffer %u", len, b->len);
+	b->len -= len;
+	while (len > 0) {
+		c = b->head;
+		if (len < c->len) {
+			c->off += len;
+			c->len -= len;
+			break;
+		}
+		len -= c->len;
+		b->head = c->next;
+		chunk_release(c);
+	}
+	if (b->head == NULL)
+		b->tail = NULL;
+}
+
+/* Describe the queued data for writev().  Returns the number of iovecs. */
+int
+chunkbuf_iov(Chunkbuf *b, struct iovec *iov, int max)
+{
+	Chunk *c;
+	int n;
+
+	for (n = 0, c = b->head; c != NULL && n < max; c = c->next, n++) {
+		iov[n].iov_base = c->seg->data + c->off;
+		iov[n].iov_len = c->len;
+	}
+	return n;
+}
+
+/*
+ * Make the first len bytes contiguous and writable, copying them into a
+ * private segment if necessary.  Returns a pointer to the data.
+ */
+void *
+chunkbuf_pullup(Chunkbuf *b, u_int len)
+{
+	Segment *seg;
+	Chunk *c;
+	u_int n, done;
+
+	if (len > b->len)
+		fatal("chunkbuf_pullup: %u bytes requested, %u in buffer",
+		    len, b->len);
+	c = b->head;
+	if (c != NULL && len <= c->len && c->seg->refcnt == 1)
+		return c->seg->data + c->off;
+
+	seg = segment_new(len);
+	for (done = 0, c = b->head; done < len; c = c->next) {
+		n = MIN(len - done, c->len);
+		memcpy(seg->data + done, c->seg->data + c->off, n);
+		done += n;
+	}
+	seg->used = len;
+	chunkbuf_consume(b, len);
+	c = chunk_new(seg, 0, len);
+	c->next = b->head;
+	b->head = c;
+	if (b->tail == NULL)
+		b->tail = c;
+	b->len += len;
+	return seg->data;
+}
@@ -0,0 +1,82 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CHUNKBUF_H
+#define CHUNKBUF_H
+
+/*
+ * A Chunkbuf is a queue of references into refcounted Segments.  Segments
+ * come from per size class free lists.  Consuming only advances or drops
+ * the head reference, and data can be moved between queues by passing
+ * segment references instead of copying.
+ */
+
+struct iovec;
+
+typedef struct Segment Segment;
+struct Segment {
+	u_char	*data;
+	u_int	 size;		/* allocated bytes */
+	u_int	 used;		/* bytes filled in */
+	u_int	 refcnt;
+	int	 sclass;	/* size class, or SEG_* below */
+	Segment	*next;		/* free list */
+};
+
+#define SEG_LARGE	-1	/* bigger than any size class */
+#define SEG_ADOPTED	-2	/* data was allocated by the caller */
+
+typedef struct Chunk Chunk;
+struct Chunk {
+	Segment	*seg;
+	u_int	 off;		/* start of data in seg */
+	u_int	 len;
+	Chunk	*next;
+};
+
+typedef struct {
+	Chunk	*head;
+	Chunk	*tail;
+	u_int	 len;		/* total bytes */
+} Chunkbuf;
+
+Segment	*segment_new(u_int);
+Segment	*segment_adopt(void *, u_int);
+void	 segment_ref(Segment *);
+void	 segment_unref(Segment *);
+
+void	 chunkbuf_init(Chunkbuf *);
+void	 chunkbuf_free(Chunkbuf *);
+void	 chunkbuf_clear(Chunkbuf *);
+u_int	 chunkbuf_len(Chunkbuf *);
+void	 chunkbuf_append(Chunkbuf *, const void *, u_int);
+void	 chunkbuf_append_seg(Chunkbuf *, Segment *, u_int, u_int);
+void	 chunkbuf_append_mem(Chunkbuf *, void *, u_int);
+void	 chunkbuf_consume(Chunkbuf *, u_int);
+int	 chunkbuf_iov(Chunkbuf *, struct iovec *, int);
+void	*chunkbuf_pullup(Chunkbuf *, u_int);
+
+#endif
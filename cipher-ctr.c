@@ -0,0 +1,262 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <openssl/evp.h>
+
+#include "log.h"
+#include "xmalloc.h"
+
+#if OPENSSL_VERSION_NUMBER < 0x00907000L
+#include "rijndael.h"
+#endif
+
+const EVP_CIPHER *evp_aes_128_ctr(void);
+void ssh_aes_ctr_iv(EVP_CIPHER_CTX *, int, u_char *, u_int);
+
+#define AES_CTR_BLOCKSIZE	16
+
+/* number of keystream blocks generated at a time */
+#define AES_CTR_RINGBLOCKS	256
+#define AES_CTR_RINGSIZE	(AES_CTR_RINGBLOCKS * AES_CTR_BLOCKSIZE)
+
+/*
+ * AES in counter mode (RFC 4344 style, big endian 128 bit counter).
+ * Since the keystream does not depend on the data, it is computed ahead
+ * of use, a ring of counter blocks at a time.  The counter blocks of a
+ * ring are independent, so they are encrypted with a single ECB call
+ * that lets the AES implementation pipeline them.  En- and decryption
+ * then reduce to XOR with the ring.
+ */
+struct ssh_aes_ctr_ctx
+{
+#if OPENSSL_VERSION_NUMBER < 0x00907000L
+	rijndael_ctx	aes_ctx;
+#else
+	EVP_CIPHER_CTX	ecb;
+	int		ecb_init;
+#endif
+	u_char		ctr[AES_CTR_BLOCKSIZE];	/* counter of ks[0] */
+	u_int		kslen;			/* keystream bytes in ks */
+	u_int		kspos;			/* keystream bytes used */
+	u_char		ctrs[AES_CTR_RINGSIZE];
+	u_char		ks[AES_CTR_RINGSIZE];
+};
+
+/* Add n to a big endian counter. */
+static void
+ssh_ctr_add(u_char *ctr, u_int n, u_int len)
+{
+	int i;
+
+	for (i = len - 1; i >= 0 && n != 0; i--) {
+		n += ctr[i];
+		ctr[i] = n & 0xff;
+		n >>= 8;
+	}
+}
+
+/* Discard the rest of the ring, moving the counter to the next unused block. */
+static void
+ssh_aes_ctr_discard(struct ssh_aes_ctr_ctx *c)
+{
+	ssh_ctr_add(c->ctr, (c->kspos + AES_CTR_BLOCKSIZE - 1) /
+	    AES_CTR_BLOCKSIZE, AES_CTR_BLOCKSIZE);
+	memset(c->ks, 0, sizeof(c->ks));
+	c->kslen = c->kspos = 0;
+}
+
+/* Compute the next ring of keystream, starting at c->ctr. */
+static int
+ssh_aes_ctr_refill(struct ssh_aes_ctr_ctx *c)
+{
+	u_char *p;
+	int i;
+
+	ssh_ctr_add(c->ctr, c->kslen / AES_CTR_BLOCKSIZE, AES_CTR_BLOCKSIZE);
+	p = c->ctrs;
+	memcpy(p, c->ctr, AES_CTR_BLOCKSIZE);
+	for (i = 1; i < AES_CTR_RINGBLOCKS; i++) {
+		memcpy(p + AES_CTR_BLOCKSIZE, p, AES_CTR_BLOCKSIZE);
+		p += AES_CTR_BLOCKSIZE;
+		ssh_ctr_add(p, 1, AES_CTR_BLOCKSIZE);
+	}
+#if OPENSSL_VERSION_NUMBER < 0x00907000L
+	for (i = 0; i < AES_CTR_RINGBLOCKS; i++)
+		rijndael_encrypt(&c->aes_ctx, c->ctrs + i * AES_CTR_BLOCKSIZE,
+		    c->ks + i * AES_CTR_BLOCKSIZE);
+#else
+	if (EVP_Cipher(&c->ecb, c->ks, c->ctrs, AES_CTR_RINGSIZE) == 0)
+		return (0);
+#endif
+	c->kslen = AES_CTR_RINGSIZE;
+	c->kspos = 0;
+	return (1);
+}
+
+static int
+ssh_aes_ctr(EVP_CIPHER_CTX *ctx, u_char *dest, const u_char *src,
+    u_int len)
+{
+	struct ssh_aes_ctr_ctx *c;
+	const u_char *ks;
+	u_int i, n;
+
+	if (len == 0)
+		return (1);
+	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL) {
+		error("ssh_aes_ctr: no context");
+		return (0);
+	}
+	while (len > 0) {
+		if (c->kspos == c->kslen && !ssh_aes_ctr_refill(c))
+			return (0);
+		n = MIN(len, c->kslen - c->kspos);
+		ks = c->ks + c->kspos;
+		for (i = 0; i < n; i++)
+			dest[i] = src[i] ^ ks[i];
+		c->kspos += n;
+		dest += n;
+		src += n;
+		len -= n;
+	}
+	return (1);
+}
+
+static int
+ssh_aes_ctr_init(EVP_CIPHER_CTX *ctx, const u_char *key, const u_char *iv,
+    int enc)
+{
+	struct ssh_aes_ctr_ctx *c;
+#if OPENSSL_VERSION_NUMBER >= 0x00907000L
+	const EVP_CIPHER *type;
+#endif
+
+	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) == NULL) {
+		c = xmalloc(sizeof(*c));
+		memset(c, 0, sizeof(*c));
+		EVP_CIPHER_CTX_set_app_data(ctx, c);
+	}
+	if (key != NULL) {
+#if OPENSSL_VERSION_NUMBER < 0x00907000L
+		/* counter mode always uses the encryption direction */
+		rijndael_set_key(&c->aes_ctx, (u_char *)key,
+		    8*EVP_CIPHER_CTX_key_length(ctx), 1);
+#else
+		switch (EVP_CIPHER_CTX_key_length(ctx)) {
+		case 16:
+			type = EVP_aes_128_ecb();
+			break;
+		case 24:
+			type = EVP_aes_192_ecb();
+			break;
+		case 32:
+			type = EVP_aes_256_ecb();
+			break;
+		default:
+			error("ssh_aes_ctr_init: bad key length %d",
+			    EVP_CIPHER_CTX_key_length(ctx));
+			return (0);
+		}
+		if (c->ecb_init)
+			EVP_CIPHER_CTX_cleanup(&c->ecb);
+		EVP_CIPHER_CTX_init(&c->ecb);
+		c->ecb_init = 1;
+		/* counter mode always uses the encryption direction */
+		if (EVP_CipherInit(&c->ecb, type, (u_char *)key, NULL, 1) == 0)
+			return (0);
+		EVP_CIPHER_CTX_set_padding(&c->ecb, 0);
+#endif
+		memset(c->ks, 0, sizeof(c->ks));
+		c->kslen = c->kspos = 0;
+	}
+	if (iv != NULL) {
+		memcpy(c->ctr, iv, AES_CTR_BLOCKSIZE);
+		memset(c->ks, 0, sizeof(c->ks));
+		c->kslen = c->kspos = 0;
+	}
+	return (1);
+}
+
+static int
+ssh_aes_ctr_cleanup(EVP_CIPHER_CTX *ctx)
+{
+	struct ssh_aes_ctr_ctx *c;
+
+	if ((c = EVP_CIPHER_CTX_get_app_data(ctx)) != NULL) {
+#if OPENSSL_VERSION_NUMBER >= 0x00907000L
+		if (c->ecb_init)
+			EVP_CIPHER_CTX_cleanup(&c->ecb);
+#endif
+		memset(c, 0, sizeof(*c));
+		xfree(c);
+		EVP_CIPHER_CTX_set_app_data(ctx, NULL);
+	}
+	return (1);
+}
+
+/*
+ * Export or install the counter, for the privsep key state.  The
+ * exported counter is the one for the next unused keystream block; any
+ * keystream computed ahead is thrown away on install.
+ */
+void
+ssh_aes_ctr_iv(EVP_CIPHER_CTX *evp, int doset, u_char * iv, u_int len)
+{
+	struct ssh_aes_ctr_ctx *c;
+
+	if ((c = EVP_CIPHER_CTX_get_app_data(evp)) == NULL)
+		fatal("ssh_aes_ctr_iv: no context");
+	if (len != AES_CTR_BLOCKSIZE)
+		fatal("ssh_aes_ctr_iv: bad iv length %u", len);
+	if (doset) {
+		memcpy(c->ctr, iv, AES_CTR_BLOCKSIZE);
+		memset(c->ks, 0, sizeof(c->ks));
+		c->kslen = c->kspos = 0;
+	} else {
+		if (c->kspos % AES_CTR_BLOCKSIZE)
+			fatal("ssh_aes_ctr_iv: unaligned keystream position");
+		ssh_aes_ctr_discard(c);
+		memcpy(iv, c->ctr, AES_CTR_BLOCKSIZE);
+	}
+}
+
+const EVP_CIPHER *
+evp_aes_128_ctr(void)
+{
+	static EVP_CIPHER aes_ctr;
+
+	memset(&aes_ctr, 0, sizeof(EVP_CIPHER));
+	aes_ctr.nid = NID_undef;
+	aes_ctr.block_size = AES_CTR_BLOCKSIZE;
+	aes_ctr.iv_len = AES_CTR_BLOCKSIZE;
+	aes_ctr.key_len = 16;
+	aes_ctr.init = ssh_aes_ctr_init;
+	aes_ctr.cleanup = ssh_aes_ctr_cleanup;
+	aes_ctr.do_cipher = ssh_aes_ctr;
+	aes_ctr.flags = EVP_CIPH_CBC_MODE | EVP_CIPH_VARIABLE_LENGTH |
+	    EVP_CIPH_ALWAYS_CALL_INIT | EVP_CIPH_CUSTOM_IV;
+	return (&aes_ctr);
+}
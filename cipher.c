@@ -49,6 +49,8 @@ static const EVP_CIPHER *evp_rijndael(void);
 #endif
 static const EVP_CIPHER *evp_ssh1_3des(void);
 static const EVP_CIPHER *evp_ssh1_bf(void);
+const EVP_CIPHER *evp_aes_128_ctr(void);
+void ssh_aes_ctr_iv(EVP_CIPHER_CTX *, int, u_char *, u_int);
 
 struct Cipher {
 	char	*name;
@@ -79,6 +81,9 @@ struct Cipher {
 	{ "rijndael-cbc@lysator.liu.se",
 				SSH_CIPHER_SSH2, 16, 32, EVP_aes_256_cbc },
 #endif
+	{ "aes128-ctr", 	SSH_CIPHER_SSH2, 16, 16, evp_aes_128_ctr },
+	{ "aes192-ctr", 	SSH_CIPHER_SSH2, 16, 24, evp_aes_128_ctr },
+	{ "aes256-ctr", 	SSH_CIPHER_SSH2, 16, 32, evp_aes_128_ctr },
 
 	{ NULL,			SSH_CIPHER_ILLEGAL, 0, 0, NULL }
 };
@@ -554,6 +559,10 @@ cipher_get_keyiv(CipherContext *cc, u_char *iv, u_int len)
 		if (evplen != len)
 			fatal("%s: wrong iv length %d != %d", __func__,
 			    evplen, len);
+		if (c->evptype == evp_aes_128_ctr) {
+			ssh_aes_ctr_iv(&cc->evp, 0, iv, len);
+			return;
+		}
 
 #if OPENSSL_VERSION_NUMBER < 0x00907000L
 		if (c->evptype == evp_rijndael) {
@@ -602,6 +611,10 @@ cipher_set_keyiv(CipherContext *cc, u_char *iv)
 		evplen = EVP_CIPHER_CTX_iv_length(&cc->evp);
 		if (evplen == 0)
 			return;
+		if (c->evptype == evp_aes_128_ctr) {
+			ssh_aes_ctr_iv(&cc->evp, 1, iv, evplen);
+			return;
+		}
 
 #if OPENSSL_VERSION_NUMBER < 0x00907000L
 		if (c->evptype == evp_rijndael) {
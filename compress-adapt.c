@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <zlib.h>
+
+#include "log.h"
+#include "buffer.h"
+#include "compress.h"
+#include "histogram.h"
+#include "compress-adapt.h"
+
+/* Payload bytes over which the compression ratio is sampled. */
+#define ADAPT_WINDOW		(256 * 1024)
+
+/* compressed/raw ratios, in percent, at which the level is lowered */
+#define ADAPT_POOR		90
+#define ADAPT_INCOMPRESSIBLE	98
+
+/* Queued output at which the link, not the CPU, limits throughput. */
+#define ADAPT_BACKLOG		(128 * 1024)
+
+/* Windows sent as stored blocks before compression is tried again. */
+#define ADAPT_PROBE		16
+
+struct adapt_stats {
+	u_int64_t	raw;
+	u_int64_t	comp;
+	struct timeval	time;
+};
+
+static z_stream outgoing_stream;
+static int outgoing_init = 0;
+static int base_level;		/* level asked for */
+static int cur_level;		/* level the stream uses */
+static int next_level;		/* level for the next packet */
+static u_int level_changes;
+static u_int stored_windows;
+static u_int win_raw, win_comp;
+
+static struct adapt_stats out_stats, in_stats;
+
+static void
+adapt_account(struct adapt_stats *st, u_int raw, u_int comp,
+    struct timeval *start)
+{
+	struct timeval now, td;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, start, &td);
+	timeradd(&st->time, &td, &st->time);
+	st->raw += raw;
+	st->comp += comp;
+}
+
+void
+adapt_compress_init_send(int level)
+{
+	if (level < 1 || level > 9)
+		fatal("Bad compression level %d.", level);
+	if (outgoing_init)
+		deflateEnd(&outgoing_stream);
+	memset(&outgoing_stream, 0, sizeof(outgoing_stream));
+	/* a new stream keeps the level learned so far */
+	if (!outgoing_init || base_level != level)
+		cur_level = next_level = level;
+	base_level = level;
+	if (deflateInit(&outgoing_stream, cur_level) != Z_OK)
+		fatal("adapt_compress_init_send: deflateInit failed");
+	outgoing_init = 1;
+	win_raw = win_comp = 0;
+}
+
+/* Picks the level for the next window from the ratio of the last one. */
+static void
+adapt_level(u_int backlog)
+{
+	u_int ratio;
+
+	ratio = (u_int64_t)win_comp * 100 / win_raw;
+	win_raw = win_comp = 0;
+	if (cur_level == 0) {
+		/* the data may have changed; probe now and then */
+		if (++stored_windows < ADAPT_PROBE)
+			return;
+		stored_windows = 0;
+		next_level = 1;
+	} else if (ratio >= ADAPT_INCOMPRESSIBLE)
+		next_level = 0;
+	else if (ratio >= ADAPT_POOR)
+		next_level = 1;
+	else if (backlog >= ADAPT_BACKLOG)
+		next_level = MIN(MAX(cur_level, base_level) + 1, 9);
+	else
+		next_level = base_level;
+	if (next_level != cur_level)
+		debug2("adapt_compress: ratio %u%% backlog %u: level %d -> %d",
+		    ratio, backlog, cur_level, next_level);
+}
+
+/*
+ * Compresses the contents of input_buffer into output_buffer, like
+ * buffer_compress().  backlog is the amount of output still waiting to
+ * be written to the connection.
+ */
+void
+adapt_compress(Buffer *input_buffer, Buffer *output_buffer, u_int backlog)
+{
+	u_char buf[4096];
+	struct timeval start;
+	u_int len, olen;
+	int status;
+
+	/* This case is not handled below. */
+	if ((len = buffer_len(input_buffer)) == 0)
+		return;
+	gettimeofday(&start, NULL);
+	olen = buffer_len(output_buffer);
+
+	if (next_level != cur_level) {
+		/*
+		 * The previous packet was flushed completely, so changing
+		 * the parameters only emits the end of the current block.
+		 */
+		outgoing_stream.next_in = NULL;
+		outgoing_stream.avail_in = 0;
+		outgoing_stream.next_out = buf;
+		outgoing_stream.avail_out = sizeof(buf);
+		status = deflateParams(&outgoing_stream, next_level,
+		    Z_DEFAULT_STRATEGY);
+		if (status != Z_OK)
+			fatal("adapt_compress: deflateParams returned %d",
+			    status);
+		buffer_append(output_buffer, buf,
+		    sizeof(buf) - outgoing_stream.avail_out);
+		cur_level = next_level;
+		level_changes++;
+	}
+
+	outgoing_stream.next_in = buffer_ptr(input_buffer);
+	outgoing_stream.avail_in = len;
+	do {
+		outgoing_stream.next_out = buf;
+		outgoing_stream.avail_out = sizeof(buf);
+		status = deflate(&outgoing_stream, Z_PARTIAL_FLUSH);
+		switch (status) {
+		case Z_OK:
+			buffer_append(output_buffer, buf,
+			    sizeof(buf) - outgoing_stream.avail_out);
+			break;
+		default:
+			fatal("adapt_compress: deflate returned %d", status);
+		}
+	} while (outgoing_stream.avail_out == 0);
+
+	olen = buffer_len(output_buffer) - olen;
+	adapt_account(&out_stats, len, olen, &start);
+	win_raw += len;
+	win_comp += olen;
+	if (win_raw >= ADAPT_WINDOW)
+		adapt_level(backlog);
+}
+
+/* buffer_uncompress(), with accounting. */
+void
+adapt_uncompress(Buffer *input_buffer, Buffer *output_buffer)
+{
+	struct timeval start;
+	u_int len, olen;
+
+	gettimeofday(&start, NULL);
+	len = buffer_len(input_buffer);
+	olen = buffer_len(output_buffer);
+	buffer_uncompress(input_buffer, output_buffer);
+	adapt_account(&in_stats, buffer_len(output_buffer) - olen, len,
+	    &start);
+}
+
+static void
+adapt_report(const char *dir, struct adapt_stats *st, hist_out_fn *out)
+{
+	if (st->raw == 0)
+		return;
+	out("compress %s: raw data %llu, compressed %llu, factor %.2f, "
+	    "%ld.%03lds", dir, (unsigned long long)st->raw,
+	    (unsigned long long)st->comp,
+	    st->comp ? (double)st->raw / st->comp : 0.0,
+	    (long)st->time.tv_sec, (long)st->time.tv_usec / 1000);
+}
+
+void
+adapt_compress_report(hist_out_fn *out)
+{
+	adapt_report("outgoing", &out_stats, out);
+	if (outgoing_init)
+		out("compress outgoing: level %d (asked %d), %u changes",
+		    cur_level, base_level, level_changes);
+	adapt_report("incoming", &in_stats, out);
+}
+
+void
+adapt_compress_uninit(void)
+{
+	adapt_compress_report(debug);
+	if (outgoing_init) {
+		deflateEnd(&outgoing_stream);
+		outgoing_init = 0;
+	}
+}
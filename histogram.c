@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include "histogram.h"
+
+void
+hist_add(Histogram *h, u_int32_t val)
+{
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++)
+		if (val < (1U << i))
+			break;
+	h->bucket[i]++;
+	h->count++;
+	h->sum += val;
+	if (val > h->max)
+		h->max = val;
+}
+
+/*
+ * Reports the histogram as one line, e.g.
+ * "packet size out: 12 samples, avg 52 max 100 bytes; <64:10 <128:2".
+ * Buckets are listed from the first to the last used one.
+ */
+void
+hist_report(Histogram *h, const char *name, const char *unit,
+    hist_out_fn *out)
+{
+	char buf[512], *p;
+	int i, first, last;
+
+	if (h->count == 0) {
+		out("%s: no samples", name);
+		return;
+	}
+	for (first = 0; h->bucket[first] == 0; first++)
+		;
+	for (last = HIST_BUCKETS - 1; h->bucket[last] == 0; last--)
+		;
+	buf[0] = '\0';
+	for (i = first; i <= last; i++) {
+		p = buf + strlen(buf);
+		if (i == HIST_BUCKETS - 1)
+			snprintf(p, sizeof(buf) - (p - buf), " >=%u:%u",
+			    1U << (i - 1), h->bucket[i]);
+		else
+			snprintf(p, sizeof(buf) - (p - buf), " <%u:%u",
+			    1U << i, h->bucket[i]);
+	}
+	out("%s: %llu samples, avg %llu max %u %s;%s", name,
+	    (unsigned long long)h->count,
+	    (unsigned long long)(h->sum / h->count), h->max, unit, buf);
+}
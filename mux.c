@@ -0,0 +1,768 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <sys/un.h>
+#include <sys/uio.h>
+
+#include "ssh.h"
+#include "xmalloc.h"
+#include "log.h"
+#include "buffer.h"
+#include "bufaux.h"
+#include "getput.h"
+#include "atomicio.h"
+#include "packet.h"
+#include "channels.h"
+#include "readconf.h"
+#include "monitor_fdpass.h"
+#include "sshtty.h"
+#include "misc.h"
+#include "mux.h"
+
+/* from ssh.c */
+extern Options options;
+extern Buffer command;
+extern int tty_flag;
+extern int subsystem_flag;
+extern int stdin_null_flag;
+
+#define MUX_VERSION		1
+#define MUX_MSG_MAX		(256 * 1024)
+#define MUX_TERM_MAX		256
+#define MUX_CMD_MAX		(64 * 1024)
+
+/*
+ * Messages on the control socket.  They are framed like those of msg.c:
+ * a 32 bit length, then the type and the payload.  A client sends
+ * MUX_C_NEW_SESSION with its command, the master answers MUX_S_OK, and
+ * the client passes its stdin, stdout and stderr.  MUX_S_SESSION tells
+ * it that the session runs, MUX_S_EXIT that it has ended.
+ */
+#define MUX_C_NEW_SESSION	1
+#define MUX_S_OK		2
+#define MUX_S_SESSION		3
+#define MUX_S_FAILURE		4
+#define MUX_S_EXIT		5
+
+#define MUX_F_TTY		0x01
+#define MUX_F_SUBSYSTEM		0x02
+
+/*
+ * The client loop keeps the exit-status of session channels to itself,
+ * so a mux client cannot learn that of its command and exits with this.
+ */
+#define MUX_EXIT_UNKNOWN	255
+
+/* master side state of a client */
+struct mux_session {
+	int	 state;
+	int	 ctl_id;	/* channel of the control connection */
+	int	 session_id;	/* session channel */
+	int	 opened;	/* the session channel was confirmed */
+	u_int	 flags;
+	char	*term;
+	Buffer	 cmd;
+	u_int	 ws_col, ws_row, ws_xpixel, ws_ypixel;
+	int	 fds[3];
+	int	 nfds;
+};
+#define MUX_STATE_REQUEST	0	/* waiting for MUX_C_NEW_SESSION */
+#define MUX_STATE_FDS		1	/* receiving the descriptors */
+#define MUX_STATE_SESSION	2	/* session channel exists */
+#define MUX_STATE_CLOSING	3	/* close once the replies are out */
+
+static char *mux_path = NULL;
+
+/*
+ * Like msg_send() and msg_recv(), for the client, which may block on
+ * the control socket.  Errors are returned instead of being fatal.
+ */
+static int
+mux_send(int fd, u_char type, Buffer *m)
+{
+	u_char buf[5];
+	u_int mlen = buffer_len(m);
+
+	PUT_32BIT(buf, mlen + 1);
+	buf[4] = type;
+	if (atomicio(write, fd, buf, sizeof(buf)) != sizeof(buf) ||
+	    atomicio(write, fd, buffer_ptr(m), mlen) != mlen) {
+		error("mux_send: write: %.100s", strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int
+mux_recv(int fd, Buffer *m)
+{
+	u_char buf[4];
+	u_int len;
+
+	if (atomicio(read, fd, buf, sizeof(buf)) != sizeof(buf))
+		return -1;
+	len = GET_32BIT(buf);
+	if (len == 0 || len > MUX_MSG_MAX) {
+		error("mux_recv: bad message length %u", len);
+		return -1;
+	}
+	buffer_clear(m);
+	if (atomicio(read, fd, buffer_append_space(m, len), len) != len)
+		return -1;
+	return 0;
+}
+
+/*
+ * The master never blocks on a client: replies are queued in c->output
+ * and written by mux_master_io() when the socket is writable.
+ */
+static void
+mux_queue(Channel *c, u_char type, Buffer *m)
+{
+	u_char buf[5];
+
+	PUT_32BIT(buf, buffer_len(m) + 1);
+	buf[4] = type;
+	buffer_append(&c->output, buf, sizeof(buf));
+	buffer_append(&c->output, buffer_ptr(m), buffer_len(m));
+}
+
+static void
+mux_send_int(Channel *c, u_char type, u_int val)
+{
+	Buffer m;
+
+	buffer_init(&m);
+	buffer_put_int(&m, val);
+	mux_queue(c, type, &m);
+	buffer_free(&m);
+}
+
+static void
+mux_send_failure(Channel *c, const char *reason)
+{
+	Buffer m;
+
+	buffer_init(&m);
+	buffer_put_cstring(&m, reason);
+	mux_queue(c, MUX_S_FAILURE, &m);
+	buffer_free(&m);
+}
+
+/*
+ * Non-fatal versions of buffer_get_int() and buffer_get_string(): a
+ * malformed request must not take the master down.  Strings longer
+ * than max are refused.
+ */
+static int
+mux_get_int(Buffer *m, u_int *vp)
+{
+	if (buffer_len(m) < 4)
+		return -1;
+	*vp = GET_32BIT((u_char *)buffer_ptr(m));
+	buffer_consume(m, 4);
+	return 0;
+}
+
+static char *
+mux_get_string(Buffer *m, u_int max, u_int *lenp)
+{
+	u_int len;
+	char *s;
+
+	if (mux_get_int(m, &len) == -1 || len > max || buffer_len(m) < len)
+		return NULL;
+	s = xmalloc(len + 1);
+	buffer_get(m, s, len);
+	s[len] = '\0';
+	if (lenp != NULL)
+		*lenp = len;
+	return s;
+}
+
+/*
+ * Receive a descriptor passed with mm_send_fd() into *fdp.  Returns 1
+ * on success, 0 if nothing has arrived yet and -1 on error.
+ */
+static int
+mux_recv_fd(int sock, int *fdp)
+{
+	struct msghdr msg;
+	struct iovec vec;
+	struct cmsghdr *cmsg;
+	char ch, tmp[CMSG_SPACE(sizeof(int))];
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	vec.iov_base = &ch;
+	vec.iov_len = 1;
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = tmp;
+	msg.msg_controllen = sizeof(tmp);
+
+	if ((n = recvmsg(sock, &msg, 0)) != 1) {
+		if (n == -1 && (errno == EINTR || errno == EAGAIN))
+			return 0;
+		if (n == -1)
+			error("mux_recv_fd: recvmsg: %.100s", strerror(errno));
+		return -1;
+	}
+	cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+		error("mux_recv_fd: no descriptor");
+		return -1;
+	}
+	*fdp = *(int *)CMSG_DATA(cmsg);
+	return 1;
+}
+
+/* -- master side */
+
+static void
+mux_session_free(struct mux_session *ms)
+{
+	while (ms->nfds > 0)
+		close(ms->fds[--ms->nfds]);
+	if (ms->term != NULL)
+		xfree(ms->term);
+	buffer_free(&ms->cmd);
+	memset(ms, 0, sizeof(*ms));
+	xfree(ms);
+}
+
+/* Shut down the local side of a session whose client went away. */
+static void
+mux_session_close(Channel *c)
+{
+	if (c->type != SSH_CHANNEL_OPEN)
+		return;
+	if (c->istate == CHAN_INPUT_OPEN)
+		chan_read_failed(c);
+	if (c->ostate == CHAN_OUTPUT_OPEN)
+		chan_write_failed(c);
+}
+
+/* The session channel was confirmed; request pty and command. */
+static void
+mux_session_confirm(int id, void *arg)
+{
+	struct mux_session *ms;
+	Channel *c, *cc;
+	u_int len;
+
+	if ((c = channel_lookup(id)) == NULL || (ms = c->mux_ctx) == NULL)
+		return;
+	debug2("channel %d: mux session confirmed", id);
+	ms->opened = 1;
+	if (ms->flags & MUX_F_TTY) {
+		channel_request_start(id, "pty-req", 0);
+		packet_put_cstring(ms->term);
+		packet_put_int(ms->ws_col);
+		packet_put_int(ms->ws_row);
+		packet_put_int(ms->ws_xpixel);
+		packet_put_int(ms->ws_ypixel);
+		/* the client leaves the terminal alone until MUX_S_SESSION */
+		tty_make_modes(c->rfd, NULL);
+		packet_send();
+	}
+	if (options.forward_agent) {
+		channel_request_start(id, "auth-agent-req@openssh.com", 0);
+		packet_send();
+	}
+	len = buffer_len(&ms->cmd);
+	if (len > 0) {
+		if (ms->flags & MUX_F_SUBSYSTEM) {
+			debug("channel %d: subsystem: %.*s", id,
+			    (int)MIN(len, 900), (u_char *)buffer_ptr(&ms->cmd));
+			channel_request_start(id, "subsystem", 0);
+		} else {
+			debug("channel %d: command: %.*s", id,
+			    (int)MIN(len, 900), (u_char *)buffer_ptr(&ms->cmd));
+			channel_request_start(id, "exec", 0);
+		}
+		packet_put_string(buffer_ptr(&ms->cmd), len);
+		packet_send();
+	} else {
+		channel_request_start(id, "shell", 0);
+		packet_send();
+	}
+	if ((cc = channel_lookup(ms->ctl_id)) == NULL)
+		mux_session_close(c);
+	else
+		mux_send_int(cc, MUX_S_SESSION, c->self);
+}
+
+/* The session channel is gone; tell the client. */
+static void
+mux_session_detach(int id, void *arg)
+{
+	struct mux_session *ms;
+	Channel *c, *cc;
+
+	if ((c = channel_lookup(id)) == NULL)
+		return;
+	channel_cancel_cleanup(id);
+	if ((ms = c->mux_ctx) == NULL)
+		return;
+	c->mux_ctx = NULL;
+	ms->session_id = -1;
+	if (ms->ctl_id == -1) {
+		mux_session_free(ms);
+		return;
+	}
+	if ((cc = channel_lookup(ms->ctl_id)) != NULL) {
+		if (ms->opened)
+			mux_send_int(cc, MUX_S_EXIT, MUX_EXIT_UNKNOWN);
+		else
+			mux_send_failure(cc, "session open failed");
+		ms->state = MUX_STATE_CLOSING;
+	}
+}
+
+/* The control connection is gone; end the session, if any. */
+static void
+mux_ctl_detach(int id, void *arg)
+{
+	struct mux_session *ms;
+	Channel *c, *sc;
+
+	if ((c = channel_lookup(id)) == NULL)
+		return;
+	channel_cancel_cleanup(id);
+	if ((ms = c->mux_ctx) == NULL)
+		return;
+	c->mux_ctx = NULL;
+	ms->ctl_id = -1;
+	if (ms->session_id == -1) {
+		mux_session_free(ms);
+		return;
+	}
+	if ((sc = channel_lookup(ms->session_id)) != NULL)
+		mux_session_close(sc);
+}
+
+static int
+mux_session_open(struct mux_session *ms)
+{
+	Channel *c;
+	int window, packetmax, i;
+
+	for (i = 0; i < 3; i++)
+		if (!isatty(ms->fds[i]))
+			set_nonblock(ms->fds[i]);
+	window = CHAN_SES_WINDOW_DEFAULT;
+	packetmax = CHAN_SES_PACKET_DEFAULT;
+	if (ms->flags & MUX_F_TTY) {
+		window >>= 1;
+		packetmax >>= 1;
+	}
+	c = channel_new("session", SSH_CHANNEL_OPENING,
+	    ms->fds[0], ms->fds[1], ms->fds[2], window, packetmax,
+	    CHAN_EXTENDED_WRITE, xstrdup("mux-session"), /*nonblock*/0);
+	ms->nfds = 0;		/* owned by the channel now */
+	c->mux_ctx = ms;
+	ms->session_id = c->self;
+	ms->state = MUX_STATE_SESSION;
+	debug2("channel %d: new mux session for control channel %d",
+	    c->self, ms->ctl_id);
+
+	channel_send_open(c->self);
+	channel_register_confirm(c->self, mux_session_confirm);
+	channel_register_cleanup(c->self, mux_session_detach);
+	return 0;
+}
+
+static int
+mux_master_request(Channel *c, struct mux_session *ms, Buffer *m)
+{
+	u_int version, len;
+	char *cmd;
+	u_char type;
+
+	/* the frame holds at least the type */
+	type = *(u_char *)buffer_ptr(m);
+	buffer_consume(m, 1);
+	if (type != MUX_C_NEW_SESSION || mux_get_int(m, &version) == -1 ||
+	    version != MUX_VERSION) {
+		error("channel %d: unsupported mux request %d", c->self, type);
+		mux_send_failure(c, "unsupported request");
+		return -1;
+	}
+	if (mux_get_int(m, &ms->flags) == -1 ||
+	    (ms->term = mux_get_string(m, MUX_TERM_MAX, NULL)) == NULL ||
+	    (cmd = mux_get_string(m, MUX_CMD_MAX, &len)) == NULL)
+		goto bad;
+	buffer_append(&ms->cmd, cmd, len);
+	xfree(cmd);
+	if (mux_get_int(m, &ms->ws_col) == -1 ||
+	    mux_get_int(m, &ms->ws_row) == -1 ||
+	    mux_get_int(m, &ms->ws_xpixel) == -1 ||
+	    mux_get_int(m, &ms->ws_ypixel) == -1)
+		goto bad;
+	mux_send_int(c, MUX_S_OK, c->self);
+	ms->state = MUX_STATE_FDS;
+	return 0;
+ bad:
+	error("channel %d: malformed mux request", c->self);
+	mux_send_failure(c, "malformed request");
+	return -1;
+}
+
+/*
+ * Append what is available on the control connection to c->input.
+ * Returns 1 if data was read, 0 if none is available yet and -1 on
+ * EOF or error.
+ */
+static int
+mux_master_fill(Channel *c)
+{
+	char buf[1024];
+	int len;
+
+	len = read(c->sock, buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return 0;
+	if (len <= 0)
+		return -1;
+	buffer_append(&c->input, buf, len);
+	return 1;
+}
+
+/*
+ * Take one complete message off c->input into m.  Returns 1 if there
+ * was one, 0 if more data is needed and -1 if the length is bad.
+ */
+static int
+mux_master_frame(Channel *c, Buffer *m)
+{
+	u_int len;
+
+	if (buffer_len(&c->input) < 4)
+		return 0;
+	len = GET_32BIT((u_char *)buffer_ptr(&c->input));
+	if (len == 0 || len > MUX_MSG_MAX) {
+		error("channel %d: bad mux message length %u", c->self, len);
+		return -1;
+	}
+	if (buffer_len(&c->input) < 4 + len)
+		return 0;
+	buffer_consume(&c->input, 4);
+	buffer_append(m, buffer_ptr(&c->input), len);
+	buffer_consume(&c->input, len);
+	return 1;
+}
+
+/*
+ * Input on a control connection.  Bytes are collected in c->input and
+ * a request is parsed only once it is complete.  Anything that arrives
+ * in a state where it is not expected is refused with MUX_S_FAILURE.
+ * Returns -1 if the connection is gone.
+ */
+static int
+mux_master_read(Channel *c, struct mux_session *ms)
+{
+	Buffer m;
+	int fd, r;
+
+	switch (ms->state) {
+	case MUX_STATE_REQUEST:
+		if ((r = mux_master_fill(c)) <= 0)
+			return r;
+		buffer_init(&m);
+		if ((r = mux_master_frame(c, &m)) == 1) {
+			if (buffer_len(&c->input) != 0) {
+				/* descriptors must wait for MUX_S_OK */
+				error("channel %d: mux data before reply",
+				    c->self);
+				mux_send_failure(c, "protocol error");
+				r = -1;
+			} else
+				r = mux_master_request(c, ms, &m);
+		} else if (r == -1)
+			mux_send_failure(c, "bad message length");
+		buffer_free(&m);
+		if (r == -1)
+			ms->state = MUX_STATE_CLOSING;
+		return 0;
+	case MUX_STATE_FDS:
+		if ((r = mux_recv_fd(c->sock, &fd)) <= 0)
+			return r;
+		ms->fds[ms->nfds++] = fd;
+		if (ms->nfds == 3)
+			mux_session_open(ms);
+		return 0;
+	case MUX_STATE_SESSION:
+		/* nothing more is expected; refuse anything but EOF */
+		if ((r = mux_master_fill(c)) <= 0)
+			return r;
+		error("channel %d: unexpected mux message", c->self);
+		buffer_clear(&c->input);
+		mux_send_failure(c, "unexpected message");
+		ms->state = MUX_STATE_CLOSING;
+		return 0;
+	default:
+		/* closing: drop whatever the client still sends */
+		if ((r = mux_master_fill(c)) <= 0)
+			return r;
+		buffer_clear(&c->input);
+		return 0;
+	}
+}
+
+/*
+ * I/O on a control connection: write the queued replies, then read.  A
+ * connection in MUX_STATE_CLOSING is closed once its replies are out.
+ */
+static void
+mux_master_io(Channel *c)
+{
+	struct mux_session *ms = c->mux_ctx;
+	int len;
+
+	if (ms == NULL)
+		return;
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_W) && buffer_len(&c->output) > 0) {
+		len = write(c->sock, buffer_ptr(&c->output),
+		    buffer_len(&c->output));
+		if (len < 0 && (errno == EINTR || errno == EAGAIN))
+			len = 0;
+		else if (len <= 0)
+			goto closed;
+		buffer_consume(&c->output, len);
+	}
+	if ((c->io_ready & SSH_CHAN_IO_SOCK_R) &&
+	    mux_master_read(c, ms) == -1)
+		goto closed;
+	if (ms->state == MUX_STATE_CLOSING && buffer_len(&c->output) == 0)
+		chan_mark_dead(c);
+	return;
+ closed:
+	debug2("channel %d: mux client closed", c->self);
+	chan_mark_dead(c);
+}
+
+static void
+mux_master_accept(Channel *c)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	struct mux_session *ms;
+	Channel *nc;
+	uid_t euid;
+	gid_t egid;
+	int sock;
+
+	if ((sock = accept(c->sock, (struct sockaddr *)&addr,
+	    &addrlen)) == -1) {
+		if (errno != EINTR && errno != EWOULDBLOCK)
+			error("accept: %.100s", strerror(errno));
+		return;
+	}
+	if (getpeereid(sock, &euid, &egid) < 0) {
+		error("getpeereid %d failed: %.100s", sock, strerror(errno));
+		close(sock);
+		return;
+	}
+	if (euid != 0 && euid != getuid()) {
+		error("mux client uid %u does not match uid %u",
+		    (u_int)euid, (u_int)getuid());
+		close(sock);
+		return;
+	}
+	ms = xmalloc(sizeof(*ms));
+	memset(ms, 0, sizeof(*ms));
+	buffer_init(&ms->cmd);
+	ms->state = MUX_STATE_REQUEST;
+	ms->session_id = -1;
+
+	nc = channel_new("mux client", SSH_CHANNEL_MUX_CLIENT, sock, sock, -1,
+	    0, 0, 0, xstrdup("mux client"), 1);
+	nc->mux_rcb = mux_master_io;
+	nc->mux_ctx = ms;
+	ms->ctl_id = nc->self;
+	channel_register_cleanup(nc->self, mux_ctl_detach);
+	debug2("channel %d: new mux client", nc->self);
+}
+
+static void
+mux_cleanup(void *arg)
+{
+	if (mux_path == NULL)
+		return;
+	unlink(mux_path);
+	xfree(mux_path);
+	mux_path = NULL;
+}
+
+/* Start accepting mux clients on the control socket at path. */
+void
+muxserver_listen(const char *path)
+{
+	struct sockaddr_un sunaddr;
+	mode_t old_umask;
+	Channel *c;
+	int sock;
+
+	memset(&sunaddr, 0, sizeof(sunaddr));
+	sunaddr.sun_family = AF_UNIX;
+	if (strlcpy(sunaddr.sun_path, path, sizeof(sunaddr.sun_path)) >=
+	    sizeof(sunaddr.sun_path)) {
+		error("Control socket path %.100s too long", path);
+		return;
+	}
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		error("socket: %.100s", strerror(errno));
+		return;
+	}
+	old_umask = umask(0177);
+	if (bind(sock, (struct sockaddr *)&sunaddr, sizeof(sunaddr)) < 0) {
+		error("bind %.100s: %.100s", path, strerror(errno));
+		umask(old_umask);
+		close(sock);
+		return;
+	}
+	umask(old_umask);
+	if (listen(sock, 64) < 0) {
+		error("listen %.100s: %.100s", path, strerror(errno));
+		unlink(path);
+		close(sock);
+		return;
+	}
+	mux_path = xstrdup(path);
+	fatal_add_cleanup(mux_cleanup, NULL);
+
+	c = channel_new("mux listener", SSH_CHANNEL_MUX_LISTENER, sock, sock,
+	    -1, 0, 0, 0, xstrdup(path), 1);
+	c->mux_rcb = mux_master_accept;
+	debug("channel %d: multiplexing on %.100s", c->self, path);
+}
+
+/* Remove the control socket. */
+void
+muxserver_close(void)
+{
+	if (mux_path == NULL)
+		return;
+	fatal_remove_cleanup(mux_cleanup, NULL);
+	mux_cleanup(NULL);
+}
+
+/* -- client side */
+
+static Buffer *
+muxclient_wait(int sock, Buffer *m, u_char want)
+{
+	char *reason;
+	u_char type;
+
+	if (mux_recv(sock, m) == -1)
+		fatal("Lost the connection to the master");
+	type = buffer_get_char(m);
+	if (type == MUX_S_FAILURE) {
+		reason = buffer_get_string(m, NULL);
+		fatal("Master refused the session: %.100s", reason);
+	}
+	if (type != want)
+		fatal("Unexpected message %d from the master", type);
+	return m;
+}
+
+/*
+ * Run the session through the master listening on path.  Returns only
+ * if there is no master, so that the caller connects on its own.
+ */
+void
+muxclient(const char *path)
+{
+	struct sockaddr_un sunaddr;
+	struct winsize ws;
+	Buffer m;
+	char *term;
+	u_int flags = 0;
+	int sock, fd, exitval;
+
+	memset(&sunaddr, 0, sizeof(sunaddr));
+	sunaddr.sun_family = AF_UNIX;
+	if (strlcpy(sunaddr.sun_path, path, sizeof(sunaddr.sun_path)) >=
+	    sizeof(sunaddr.sun_path))
+		fatal("Control socket path %.100s too long", path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		fatal("socket: %.100s", strerror(errno));
+	if (connect(sock, (struct sockaddr *)&sunaddr, sizeof(sunaddr)) < 0) {
+		debug("No master on %.100s: %.100s", path, strerror(errno));
+		close(sock);
+		return;
+	}
+	debug("Using the master on %.100s", path);
+
+	if (tty_flag)
+		flags |= MUX_F_TTY;
+	if (subsystem_flag)
+		flags |= MUX_F_SUBSYSTEM;
+	if ((term = getenv("TERM")) == NULL)
+		term = "";
+	if (ioctl(fileno(stdin), TIOCGWINSZ, &ws) < 0)
+		memset(&ws, 0, sizeof(ws));
+
+	buffer_init(&m);
+	buffer_put_int(&m, MUX_VERSION);
+	buffer_put_int(&m, flags);
+	buffer_put_cstring(&m, term);
+	buffer_put_string(&m, buffer_ptr(&command), buffer_len(&command));
+	buffer_put_int(&m, ws.ws_col);
+	buffer_put_int(&m, ws.ws_row);
+	buffer_put_int(&m, ws.ws_xpixel);
+	buffer_put_int(&m, ws.ws_ypixel);
+	if (mux_send(sock, MUX_C_NEW_SESSION, &m) == -1)
+		fatal("Lost the connection to the master");
+	muxclient_wait(sock, &m, MUX_S_OK);
+
+	if (stdin_null_flag) {
+		if ((fd = open(_PATH_DEVNULL, O_RDONLY)) < 0)
+			fatal("open %s: %.100s", _PATH_DEVNULL,
+			    strerror(errno));
+		mm_send_fd(sock, fd);
+		close(fd);
+	} else
+		mm_send_fd(sock, STDIN_FILENO);
+	mm_send_fd(sock, STDOUT_FILENO);
+	mm_send_fd(sock, STDERR_FILENO);
+
+	/* the master reads the terminal modes before this arrives */
+	muxclient_wait(sock, &m, MUX_S_SESSION);
+	if (tty_flag)
+		enter_raw_mode();
+	if (mux_recv(sock, &m) == -1 || buffer_get_char(&m) != MUX_S_EXIT)
+		exitval = 255;
+	else
+		exitval = buffer_get_int(&m);
+	if (tty_flag)
+		leave_raw_mode();
+	buffer_free(&m);
+	close(sock);
+	exit(exitval);
+}
@@ -86,6 +86,7 @@ chan_set_istate(Channel *c, u_int next)
 	debug("channel %d: input %s -> %s", c->self, istates[c->istate],
 	    istates[next]);
 	c->istate = next;
+	channel_mark(c);
 }
 static void
 chan_set_ostate(Channel *c, u_int next)
@@ -95,6 +96,7 @@ chan_set_ostate(Channel *c, u_int next)
 	debug("channel %d: output %s -> %s", c->self, ostates[c->ostate],
 	    ostates[next]);
 	c->ostate = next;
+	channel_mark(c);
 }
 
 /*
@@ -208,7 +210,7 @@ void
 chan_obuf_empty(Channel *c)
 {
 	debug("channel %d: obuf empty", c->self);
-	if (buffer_len(&c->output)) {
+	if (CHANNEL_OUTPUT_LEN(c)) {
 		error("channel %d: chan_obuf_empty for non empty buffer",
 		    c->self);
 		return;
@@ -251,6 +253,7 @@ chan_send_oclose1(Channel *c)
 	case CHAN_OUTPUT_OPEN:
 	case CHAN_OUTPUT_WAIT_DRAIN:
 		buffer_clear(&c->output);
+		chunkbuf_clear(&c->outq);
 		packet_start(SSH_MSG_CHANNEL_OUTPUT_CLOSE);
 		packet_put_int(c->remote_id);
 		packet_send();
@@ -367,7 +370,7 @@ chan_rcvd_ieof(Channel *c)
 	else
 		chan_rcvd_ieof1(c);
 	if (c->ostate == CHAN_OUTPUT_WAIT_DRAIN &&
-	    buffer_len(&c->output) == 0 &&
+	    CHANNEL_OUTPUT_LEN(c) == 0 &&
 	    !CHANNEL_EFD_OUTPUT_ACTIVE(c))
 		chan_obuf_empty(c);
 }
@@ -392,6 +395,7 @@ void
 chan_mark_dead(Channel *c)
 {
 	c->type = SSH_CHANNEL_ZOMBIE;
+	channel_mark(c);
 }
 
 int
@@ -440,6 +444,7 @@ static void
 chan_shutdown_write(Channel *c)
 {
 	buffer_clear(&c->output);
+	chunkbuf_clear(&c->outq);
 	if (compat20 && c->type == SSH_CHANNEL_LARVAL)
 		return;
 	/* shutdown failure is allowed if write failed already */
@@ -39,6 +39,8 @@
 #include "includes.h"
 RCSID("$OpenBSD: packet.c,v 1.95 2002/06/19 18:01:00 markus Exp $");
 
+#include <sys/queue.h>
+
 #include "xmalloc.h"
 #include "buffer.h"
 #include "packet.h"
@@ -47,6 +49,8 @@ RCSID("$OpenBSD: packet.c,v 1.95 2002/06/19 18:01:00 markus Exp $");
 #include "getput.h"
 
 #include "compress.h"
+#include "histogram.h"
+#include "compress-adapt.h"
 #include "deattack.h"
 #include "channels.h"
 
@@ -58,10 +62,13 @@ RCSID("$OpenBSD: packet.c,v 1.95 2002/06/19 18:01:00 markus Exp $");
 #include "kex.h"
 #include "mac.h"
 #include "log.h"
+#include "randbuf.h"
 #include "canohost.h"
 #include "misc.h"
 #include "ssh.h"
 
+#include <openssl/hmac.h>
+
 #ifdef PACKET_DEBUG
 #define DBG(x) x
 #else
@@ -98,6 +105,21 @@ static Buffer outgoing_packet;
 /* Buffer for the incoming packet currently being processed. */
 static Buffer incoming_packet;
 
+/*
+ * SSH2 channel data packets are decrypted into a segment instead, and only
+ * the header fields of the payload are copied to incoming_packet.  The
+ * data string stays in the segment, at incoming_seg_off, so that
+ * packet_get_string_seg() can pass it on by reference.
+ */
+static Segment *incoming_seg = NULL;
+static u_int incoming_seg_off;
+static u_int incoming_seg_len;
+
+/* message type, recipient channel and string length */
+#define DATA_HDR_LEN	(1 + 4 + 4)
+
+static void packet_release_seg(void);
+
 /* Scratch buffer for packet compression/decompression. */
 static Buffer compression_buffer;
 static int compression_buffer_ready = 0;
@@ -105,6 +127,9 @@ static int compression_buffer_ready = 0;
 /* Flag indicating whether packet compression/decompression is enabled. */
 static int packet_compression = 0;
 
+/* maximum number of bytes taken from the connection by one read */
+#define PACKET_READ_LEN	(64 * 1024)
+
 /* default maximum packet size */
 int max_packet_size = 32768;
 
@@ -126,6 +151,103 @@ static u_int ssh1_keylen;
 /* roundup current message to extra_pad bytes */
 static u_char extra_pad = 0;
 
+/* A piece of plaintext for packet_send_data(). */
+struct packet_seg {
+	const u_char *ptr;
+	u_int len;
+};
+
+/*
+ * A packet queued by packet_send_data().  The framed plaintext and the
+ * room for its MAC sit in output at off, counted from buffer_ptr().
+ */
+struct packet_batch_ent {
+	u_int off;
+	u_int plen;		/* packet without the MAC */
+	u_char type;
+};
+
+/*
+ * Packets queued between packet_batch_begin() and packet_batch_end().
+ * Queued packets are plaintext at the end of output, so every other
+ * use of output flushes the batch first: packet_send() before it
+ * appends and packet_write_poll() before it writes and consumes.
+ */
+static struct packet_batch_ent *batch = NULL;
+static u_int batch_len = 0;
+static u_int batch_alloc = 0;
+static int batching = 0;
+
+/*
+ * Between our KEXINIT and NEWKEYS only transport layer messages may be
+ * sent.  Other packets, e.g. window adjustments from the channels, are
+ * queued and sent right after NEWKEYS.
+ */
+struct packet_queued {
+	TAILQ_ENTRY(packet_queued) next;
+	Buffer payload;
+};
+static TAILQ_HEAD(, packet_queued) rekey_queue =
+    TAILQ_HEAD_INITIALIZER(rekey_queue);
+static int rekeying = 0;
+
+/*
+ * Traffic under the current keys, per direction, and the limits after
+ * which packet_need_rekeying() asks for a new key exchange.
+ */
+struct packet_state {
+	u_int64_t	bytes;
+	u_int64_t	max_bytes;
+	u_int32_t	packets;
+};
+static struct packet_state p_state[MODE_MAX];
+static u_int64_t rekey_limit = 0;	/* 0: derived from the cipher */
+static time_t rekey_interval = 0;	/* 0: no time based rekeying */
+static time_t rekey_time = 0;		/* last NEWKEYS */
+
+/* rekey long before the sequence numbers wrap */
+#define REKEY_MAX_PACKETS	((u_int32_t)1 << 31)
+
+/*
+ * Transport statistics for packet_stats_report(), kept all the time:
+ * traffic per direction and message type, the time spent in the cipher
+ * and the MAC, and histograms of the packet sizes and the output queue.
+ */
+static struct {
+	u_int64_t	bytes[MODE_MAX][256];
+	u_int32_t	packets[MODE_MAX][256];
+	struct timeval	cipher_time[MODE_MAX];
+	struct timeval	mac_time[MODE_MAX];
+	Histogram	size[MODE_MAX];
+	Histogram	output_queue;
+} pstats;
+
+/* MAC context for outgoing packets, keyed once per set_newkeys() */
+static HMAC_CTX send_mac_ctx;
+static int send_mac_keyed = 0;
+
+/* Counts a packet of len bytes on the wire towards rekeying and stats. */
+static void
+packet_account(int mode, u_char type, u_int len)
+{
+	p_state[mode].packets++;
+	p_state[mode].bytes += len;
+	pstats.packets[mode][type]++;
+	pstats.bytes[mode][type] += len;
+	hist_add(&pstats.size[mode], len);
+}
+
+/* Adds the time from start to end to *acc. */
+static void
+packet_stats_time(struct timeval *acc, struct timeval *start,
+    struct timeval *end)
+{
+	struct timeval td;
+
+	timersub(end, start, &td);
+	timeradd(acc, &td, acc);
+}
+
 /*
  * Sets the descriptors used for communication.  Disables encryption until
  * packet_set_encryption_key is called.
@@ -337,8 +459,10 @@ packet_close(void)
 	buffer_free(&output);
 	buffer_free(&outgoing_packet);
 	buffer_free(&incoming_packet);
+	packet_release_seg();
 	if (compression_buffer_ready) {
 		buffer_free(&compression_buffer);
+		adapt_compress_uninit();
 		buffer_compress_uninit();
 	}
 	cipher_cleanup(&send_context);
@@ -382,7 +506,7 @@ packet_start_compression(int level)
 		fatal("Compression already enabled.");
 	packet_compression = 1;
 	packet_init_compression();
-	buffer_compress_init_send(level);
+	adapt_compress_init_send(level);
 	buffer_compress_init_recv();
 }
 
@@ -480,9 +604,8 @@ static void
 packet_send1(void)
 {
 	u_char buf[8], *cp;
-	int i, padding, len;
+	int padding, len;
 	u_int checksum;
-	u_int32_t rand = 0;
 
 	/*
 	 * If using packet compression, compress the payload of the outgoing
@@ -494,7 +617,8 @@ packet_send1(void)
 		buffer_consume(&outgoing_packet, 8);
 		/* padding */
 		buffer_append(&compression_buffer, "\0\0\0\0\0\0\0\0", 8);
-		buffer_compress(&outgoing_packet, &compression_buffer);
+		adapt_compress(&outgoing_packet, &compression_buffer,
+		    buffer_len(&output));
 		buffer_clear(&outgoing_packet);
 		buffer_append(&outgoing_packet, buffer_ptr(&compression_buffer),
 		    buffer_len(&compression_buffer));
@@ -506,12 +630,7 @@ packet_send1(void)
 	padding = 8 - len % 8;
 	if (!send_context.plaintext) {
 		cp = buffer_ptr(&outgoing_packet);
-		for (i = 0; i < padding; i++) {
-			if (i % 4 == 0)
-				rand = arc4random();
-			cp[7 - i] = rand & 0xff;
-			rand >>= 8;
-		}
+		randbuf_fill(cp + 8 - padding, padding);
 	}
 	buffer_consume(&outgoing_packet, 8 - padding);
 
@@ -547,6 +666,91 @@ packet_send1(void)
 	 */
 }
 
+/*
+ * Compute the MAC for an outgoing packet over seqnr and the concatenation
+ * of the segments.  The HMAC key schedule is computed only once per key.
+ */
+static void
+packet_mac_segs(Mac *mac, u_int32_t seqnr, struct packet_seg *seg, int nseg,
+    u_char *dst)
+{
+	u_char m[EVP_MAX_MD_SIZE], b[4];
+	int i;
+
+	if (mac->key == NULL)
+		fatal("packet_mac_segs: no key");
+	if (mac->mac_len > sizeof(m))
+		fatal("packet_mac_segs: mac too long");
+	if (!send_mac_keyed) {
+		HMAC_Init(&send_mac_ctx, mac->key, mac->key_len, mac->md);
+		send_mac_keyed = 1;
+	} else
+		HMAC_Init(&send_mac_ctx, NULL, 0, NULL);
+	PUT_32BIT(b, seqnr);
+	HMAC_Update(&send_mac_ctx, b, sizeof(b));
+	for (i = 0; i < nseg; i++)
+		HMAC_Update(&send_mac_ctx, seg[i].ptr, seg[i].len);
+	HMAC_Final(&send_mac_ctx, m, NULL);
+	memcpy(dst, m, mac->mac_len);
+	memset(m, 0, sizeof(m));
+}
+
+/*
+ * MAC and encrypt the queued packets in place.  Without a MAC the batch
+ * is one contiguous region and is encrypted with a single cipher call;
+ * otherwise the MAC slots split it and each packet takes one call.
+ */
+static void
+packet_batch_flush(void)
+{
+	struct packet_batch_ent *e;
+	struct packet_seg seg;
+	struct timeval t0, t1, t2;
+	u_char *base, *cp;
+	u_int i, maclen, total = 0;
+	Mac *mac = NULL;
+
+	if (batch_len == 0)
+		return;
+	if (newkeys[MODE_OUT] != NULL)
+		mac = &newkeys[MODE_OUT]->mac;
+	maclen = (mac && mac->enabled) ? mac->mac_len : 0;
+
+	base = buffer_ptr(&output);
+	for (i = 0; i < batch_len; i++) {
+		e = &batch[i];
+		cp = base + e->off;
+		gettimeofday(&t0, NULL);
+		if (maclen) {
+			seg.ptr = cp;
+			seg.len = e->plen;
+			packet_mac_segs(mac, send_seqnr, &seg, 1, cp + e->plen);
+			DBG(debug("done calc MAC out #%d", send_seqnr));
+		}
+		gettimeofday(&t1, NULL);
+		if (maclen)
+			cipher_crypt(&send_context, cp, cp, e->plen);
+		gettimeofday(&t2, NULL);
+		packet_stats_time(&pstats.mac_time[MODE_OUT], &t0, &t1);
+		packet_stats_time(&pstats.cipher_time[MODE_OUT], &t1, &t2);
+		DBG(debug("send: len %d", e->plen));
+		total += e->plen;
+
+		/* increment sequence number for outgoing packets */
+		if (++send_seqnr == 0)
+			log("outgoing seqnr wraps around");
+		packet_account(MODE_OUT, e->type, e->plen + maclen);
+	}
+	if (!maclen) {
+		gettimeofday(&t1, NULL);
+		cp = base + batch[0].off;
+		cipher_crypt(&send_context, cp, cp, total);
+		gettimeofday(&t2, NULL);
+		packet_stats_time(&pstats.cipher_time[MODE_OUT], &t1, &t2);
+	}
+	batch_len = 0;
+}
+
 void
 set_newkeys(int mode)
 {
@@ -588,16 +792,36 @@ set_newkeys(int mode)
 	comp = &newkeys[mode]->comp;
 	if (mac->md != NULL)
 		mac->enabled = 1;
+	if (mode == MODE_OUT && send_mac_keyed) {
+		HMAC_cleanup(&send_mac_ctx);
+		send_mac_keyed = 0;
+	}
 	DBG(debug("cipher_init_context: %d", mode));
 	cipher_init(cc, enc->cipher, enc->key, enc->key_len,
 	    enc->iv, enc->block_size, encrypt);
+	/*
+	 * Without a configured limit, rekey after 2^(blocksize*2) blocks
+	 * for ciphers with 128 bit or larger blocks, and after 1GB for
+	 * 64 bit ones.
+	 */
+	p_state[mode].bytes = 0;
+	p_state[mode].packets = 0;
+	if (enc->block_size >= 16)
+		p_state[mode].max_bytes = ((u_int64_t)1 <<
+		    (MIN(enc->block_size, 28) * 2)) * enc->block_size;
+	else
+		p_state[mode].max_bytes = (u_int64_t)1 << 30;
+	if (rekey_limit != 0)
+		p_state[mode].max_bytes = MIN(p_state[mode].max_bytes,
+		    rekey_limit);
+	rekey_time = time(NULL);
 	/* Deleting the keys does not gain extra security */
 	/* memset(enc->iv,  0, enc->block_size);
 	   memset(enc->key, 0, enc->key_len); */
 	if (comp->type != 0 && comp->enabled == 0) {
 		packet_init_compression();
 		if (mode == MODE_OUT)
-			buffer_compress_init_send(6);
+			adapt_compress_init_send(6);
 		else
 			buffer_compress_init_recv();
 		comp->enabled = 1;
@@ -608,13 +832,15 @@ set_newkeys(int mode)
  * Finalize packet in SSH2 format (compress, mac, encrypt, enqueue)
  */
 static void
-packet_send2(void)
+packet_send2_wrapped(void)
 {
-	u_char type, *cp, *macbuf = NULL;
+	u_char type, *cp;
 	u_char padlen, pad;
 	u_int packet_length = 0;
-	u_int i, len;
-	u_int32_t rand = 0;
+	u_int len, maclen;
+	struct packet_seg seg;
+	struct timeval t0, t1, t2;
+	Buffer *pkt = &outgoing_packet;
 	Enc *enc   = NULL;
 	Mac *mac   = NULL;
 	Comp *comp = NULL;
@@ -640,17 +866,17 @@ packet_send2(void)
 		/* skip header, compress only payload */
 		buffer_consume(&outgoing_packet, 5);
 		buffer_clear(&compression_buffer);
-		buffer_compress(&outgoing_packet, &compression_buffer);
-		buffer_clear(&outgoing_packet);
-		buffer_append(&outgoing_packet, "\0\0\0\0\0", 5);
-		buffer_append(&outgoing_packet, buffer_ptr(&compression_buffer),
-		    buffer_len(&compression_buffer));
+		buffer_append(&compression_buffer, "\0\0\0\0\0", 5);
+		adapt_compress(&outgoing_packet, &compression_buffer,
+		    buffer_len(&output));
+		/* continue with the compressed packet, no need to copy back */
+		pkt = &compression_buffer;
 		DBG(debug("compression: raw %d compressed %d", len,
-		    buffer_len(&outgoing_packet)));
+		    buffer_len(pkt)));
 	}
 
 	/* sizeof (packet_len + pad_len + payload) */
-	len = buffer_len(&outgoing_packet);
+	len = buffer_len(pkt);
 
 	/*
 	 * calc size of padding, alloc space, get random data,
@@ -668,40 +894,39 @@ packet_send2(void)
 		padlen += pad;
 		extra_pad = 0;
 	}
-	cp = buffer_append_space(&outgoing_packet, padlen);
+	cp = buffer_append_space(pkt, padlen);
 	if (enc && !send_context.plaintext) {
 		/* random padding */
-		for (i = 0; i < padlen; i++) {
-			if (i % 4 == 0)
-				rand = arc4random();
-			cp[i] = rand & 0xff;
-			rand >>= 8;
-		}
+		randbuf_fill(cp, padlen);
 	} else {
 		/* clear padding */
 		memset(cp, 0, padlen);
 	}
 	/* packet_length includes payload, padding and padding length field */
-	packet_length = buffer_len(&outgoing_packet) - 4;
-	cp = buffer_ptr(&outgoing_packet);
+	packet_length = buffer_len(pkt) - 4;
+	cp = buffer_ptr(pkt);
 	PUT_32BIT(cp, packet_length);
 	cp[4] = padlen;
 	DBG(debug("send: len %d (includes padlen %d)", packet_length+4, padlen));
 
+	/* reserve space for the encrypted packet and the unencrypted MAC */
+	maclen = (mac && mac->enabled) ? mac->mac_len : 0;
+	cp = buffer_append_space(&output, buffer_len(pkt) + maclen);
+
 	/* compute MAC over seqnr and packet(length fields, payload, padding) */
-	if (mac && mac->enabled) {
-		macbuf = mac_compute(mac, send_seqnr,
-		    buffer_ptr(&outgoing_packet),
-		    buffer_len(&outgoing_packet));
+	gettimeofday(&t0, NULL);
+	if (maclen) {
+		seg.ptr = buffer_ptr(pkt);
+		seg.len = buffer_len(pkt);
+		packet_mac_segs(mac, send_seqnr, &seg, 1, cp + seg.len);
 		DBG(debug("done calc MAC out #%d", send_seqnr));
 	}
-	/* encrypt packet and append to output buffer. */
-	cp = buffer_append_space(&output, buffer_len(&outgoing_packet));
-	cipher_crypt(&send_context, cp, buffer_ptr(&outgoing_packet),
-	    buffer_len(&outgoing_packet));
-	/* append unencrypted MAC */
-	if (mac && mac->enabled)
-		buffer_append(&output, (char *)macbuf, mac->mac_len);
+	/* encrypt packet into the output buffer */
+	gettimeofday(&t1, NULL);
+	cipher_crypt(&send_context, cp, buffer_ptr(pkt), buffer_len(pkt));
+	gettimeofday(&t2, NULL);
+	packet_stats_time(&pstats.mac_time[MODE_OUT], &t0, &t1);
+	packet_stats_time(&pstats.cipher_time[MODE_OUT], &t1, &t2);
 #ifdef PACKET_DEBUG
 	fprintf(stderr, "encrypted: ");
 	buffer_dump(&output);
@@ -709,15 +934,62 @@ packet_send2(void)
 	/* increment sequence number for outgoing packets */
 	if (++send_seqnr == 0)
 		log("outgoing seqnr wraps around");
+	packet_account(MODE_OUT, type, buffer_len(pkt) + maclen);
 	buffer_clear(&outgoing_packet);
+	if (pkt != &outgoing_packet)
+		buffer_clear(pkt);
 
 	if (type == SSH2_MSG_NEWKEYS)
 		set_newkeys(MODE_OUT);
 }
 
+/* Messages that may be sent while a key exchange is in progress. */
+static int
+packet_is_transport(u_char type)
+{
+	return (type < SSH2_MSG_USERAUTH_REQUEST &&
+	    type != SSH2_MSG_SERVICE_REQUEST &&
+	    type != SSH2_MSG_SERVICE_ACCEPT);
+}
+
+static void
+packet_send2(void)
+{
+	struct packet_queued *p;
+	u_char type;
+
+	type = ((u_char *)buffer_ptr(&outgoing_packet))[5];
+	if (rekeying && !packet_is_transport(type)) {
+		/* hand the packet over to the queue, without copying */
+		debug3("packet_send2: queueing type %u while rekeying", type);
+		p = xmalloc(sizeof(*p));
+		p->payload = outgoing_packet;
+		buffer_init(&outgoing_packet);
+		TAILQ_INSERT_TAIL(&rekey_queue, p, next);
+		return;
+	}
+	if (type == SSH2_MSG_KEXINIT)
+		rekeying = 1;
+	packet_send2_wrapped();
+	if (type != SSH2_MSG_NEWKEYS)
+		return;
+
+	/* send what piled up under the new keys */
+	rekeying = 0;
+	while ((p = TAILQ_FIRST(&rekey_queue)) != NULL) {
+		TAILQ_REMOVE(&rekey_queue, p, next);
+		buffer_free(&outgoing_packet);
+		outgoing_packet = p->payload;
+		xfree(p);
+		packet_send2_wrapped();
+	}
+}
+
 void
 packet_send(void)
 {
+	/* keep packets in order */
+	packet_batch_flush();
 	if (compat20)
 		packet_send2();
 	else
@@ -725,6 +997,98 @@ packet_send(void)
 	DBG(debug("packet_send done"));
 }
 
+/*
+ * Queue packets sent with packet_send_data() until packet_batch_end(),
+ * then encrypt them in one go.  Any other packet flushes the batch first,
+ * so ordering is preserved.
+ */
+void
+packet_batch_begin(void)
+{
+	batching = 1;
+}
+
+void
+packet_batch_end(void)
+{
+	batching = 0;
+	packet_batch_flush();
+}
+
+/*
+ * Sends a packet made of type, the 32 bit integers in hdr and the string
+ * (data, len), e.g. channel data.  With SSH2 and no compression the data
+ * is not copied into outgoing_packet: the packet is framed straight in
+ * output, next to the room for its MAC, and encrypted there in place.
+ */
+void
+packet_send_data(u_char type, const u_int32_t *hdr, u_int nhdr,
+    const void *data, u_int len)
+{
+	struct packet_batch_ent *e;
+	u_char *cp;
+	u_int i, hlen, padlen, maclen;
+	Enc *enc   = NULL;
+	Mac *mac   = NULL;
+	Comp *comp = NULL;
+	int block_size;
+
+	if (newkeys[MODE_OUT] != NULL) {
+		enc  = &newkeys[MODE_OUT]->enc;
+		mac  = &newkeys[MODE_OUT]->mac;
+		comp = &newkeys[MODE_OUT]->comp;
+	}
+	if (!compat20 || nhdr > PACKET_MAX_HDR || extra_pad || rekeying ||
+	    (comp && comp->enabled)) {
+		packet_start(type);
+		for (i = 0; i < nhdr; i++)
+			packet_put_int(hdr[i]);
+		packet_put_string(data, len);
+		packet_send();
+		return;
+	}
+	block_size = enc ? enc->block_size : 8;
+	maclen = (mac && mac->enabled) ? mac->mac_len : 0;
+
+	if (batch_len >= batch_alloc) {
+		batch_alloc = batch_alloc ? batch_alloc * 2 : 16;
+		batch = xrealloc(batch, batch_alloc * sizeof(*batch));
+	}
+	e = &batch[batch_len];
+
+	/* packet_len, pad_len, type, hdr and string length */
+	hlen = 4 + 1 + 1 + 4 * nhdr + 4;
+
+	/* same padding as packet_send2(), minimum is 4 bytes */
+	padlen = block_size - ((hlen + len) % block_size);
+	if (padlen < 4)
+		padlen += block_size;
+	e->plen = hlen + len + padlen;
+	e->type = type;
+
+	cp = buffer_append_space(&output, e->plen + maclen);
+	e->off = cp - (u_char *)buffer_ptr(&output);
+	PUT_32BIT(cp, e->plen - 4);
+	cp[4] = padlen;
+	cp[5] = type;
+	for (cp += 6, i = 0; i < nhdr; i++, cp += 4)
+		PUT_32BIT(cp, hdr[i]);
+	PUT_32BIT(cp, len);
+	memcpy(cp + 4, data, len);
+	cp += 4 + len;
+	if (enc && !send_context.plaintext) {
+		/* random padding */
+		randbuf_fill(cp, padlen);
+	} else {
+		/* clear padding */
+		memset(cp, 0, padlen);
+	}
+
+	batch_len++;
+	if (!batching)
+		packet_batch_flush();
+}
+
 /*
  * Waits until a packet has been received, and returns its type.  Note that
  * no other data is processed until this returns, so this function should not
@@ -736,7 +1100,6 @@ packet_read_seqnr(u_int32_t *seqnr_p)
 {
 	int type, len;
 	fd_set *setp;
-	char buf[8192];
 	DBG(debug("packet_read()"));
 
 	setp = (fd_set *)xmalloc(howmany(connection_in+1, NFDBITS) *
@@ -773,16 +1136,14 @@ packet_read_seqnr(u_int32_t *seqnr_p)
 		    (errno == EAGAIN || errno == EINTR))
 			;
 
-		/* Read data from the socket. */
-		len = read(connection_in, buf, sizeof(buf));
+		/* Read data from the socket into the buffer. */
+		len = packet_read_input();
 		if (len == 0) {
 			log("Connection closed by %.200s", get_remote_ipaddr());
 			fatal_cleanup();
 		}
 		if (len < 0)
 			fatal("Read from socket failed: %.100s", strerror(errno));
-		/* Append it to the buffer. */
-		packet_process_incoming(buf, len);
 	}
 	/* NOTREACHED */
 }
@@ -885,7 +1246,7 @@ packet_read_poll1(void)
 
 	if (packet_compression) {
 		buffer_clear(&compression_buffer);
-		buffer_uncompress(&incoming_packet, &compression_buffer);
+		adapt_uncompress(&incoming_packet, &compression_buffer);
 		buffer_clear(&incoming_packet);
 		buffer_append(&incoming_packet, buffer_ptr(&compression_buffer),
 		    buffer_len(&compression_buffer));
@@ -894,13 +1255,24 @@ packet_read_poll1(void)
 	return type;
 }
 
+static void
+packet_release_seg(void)
+{
+	if (incoming_seg != NULL) {
+		segment_unref(incoming_seg);
+		incoming_seg = NULL;
+	}
+	incoming_seg_len = 0;
+}
+
 static int
 packet_read_poll2(u_int32_t *seqnr_p)
 {
 	static u_int packet_length = 0;
-	u_int padlen, need;
-	u_char *macbuf, *cp, type;
+	u_int padlen, need, plen;
+	u_char *macbuf, *cp, *pkt, type;
 	int maclen, block_size;
+	struct timeval t0, t1, t2;
 	Enc *enc   = NULL;
 	Mac *mac   = NULL;
 	Comp *comp = NULL;
@@ -914,6 +1286,7 @@ packet_read_poll2(u_int32_t *seqnr_p)
 	block_size = enc ? enc->block_size : 8;
 
 	if (packet_length == 0) {
+		packet_release_seg();
 		/*
 		 * check if input size is less than the cipher block size,
 		 * decrypt first block and extract length of incoming packet
@@ -922,8 +1295,11 @@ packet_read_poll2(u_int32_t *seqnr_p)
 			return SSH_MSG_NONE;
 		buffer_clear(&incoming_packet);
 		cp = buffer_append_space(&incoming_packet, block_size);
+		gettimeofday(&t0, NULL);
 		cipher_crypt(&receive_context, cp, buffer_ptr(&input),
 		    block_size);
+		gettimeofday(&t1, NULL);
+		packet_stats_time(&pstats.cipher_time[MODE_IN], &t0, &t1);
 		cp = buffer_ptr(&incoming_packet);
 		packet_length = GET_32BIT(cp);
 		if (packet_length < 1 + 4 || packet_length > 256 * 1024) {
@@ -950,42 +1326,71 @@ packet_read_poll2(u_int32_t *seqnr_p)
 	fprintf(stderr, "read_poll enc/full: ");
 	buffer_dump(&input);
 #endif
-	cp = buffer_append_space(&incoming_packet, need);
+	cp = buffer_ptr(&incoming_packet);
+	if (cp[5] == SSH2_MSG_CHANNEL_DATA && !(comp && comp->enabled) &&
+	    packet_length >= 1 + DATA_HDR_LEN) {
+		incoming_seg = segment_new(4 + packet_length);
+		incoming_seg->used = 4 + packet_length;
+		memcpy(incoming_seg->data, cp, block_size);
+		buffer_clear(&incoming_packet);
+		cp = incoming_seg->data + block_size;
+		pkt = incoming_seg->data;
+	} else {
+		cp = buffer_append_space(&incoming_packet, need);
+		pkt = buffer_ptr(&incoming_packet);
+	}
+	gettimeofday(&t0, NULL);
 	cipher_crypt(&receive_context, cp, buffer_ptr(&input), need);
+	gettimeofday(&t1, NULL);
 	buffer_consume(&input, need);
 	/*
 	 * compute MAC over seqnr and packet,
 	 * increment sequence number for incoming packet
 	 */
 	if (mac && mac->enabled) {
-		macbuf = mac_compute(mac, read_seqnr,
-		    buffer_ptr(&incoming_packet),
-		    buffer_len(&incoming_packet));
+		macbuf = mac_compute(mac, read_seqnr, pkt, 4 + packet_length);
 		if (memcmp(macbuf, buffer_ptr(&input), mac->mac_len) != 0)
 			packet_disconnect("Corrupted MAC on input.");
 		DBG(debug("MAC #%d ok", read_seqnr));
 		buffer_consume(&input, mac->mac_len);
 	}
+	gettimeofday(&t2, NULL);
+	packet_stats_time(&pstats.cipher_time[MODE_IN], &t0, &t1);
+	packet_stats_time(&pstats.mac_time[MODE_IN], &t1, &t2);
 	if (seqnr_p != NULL)
 		*seqnr_p = read_seqnr;
 	if (++read_seqnr == 0)
 		log("incoming seqnr wraps around");
 
 	/* get padlen */
-	cp = buffer_ptr(&incoming_packet);
-	padlen = cp[4];
+	padlen = pkt[4];
 	DBG(debug("input: padlen %d", padlen));
 	if (padlen < 4)
 		packet_disconnect("Corrupted padlen %d on input.", padlen);
 
-	/* skip packet size + padlen, discard padding */
-	buffer_consume(&incoming_packet, 4 + 1);
-	buffer_consume_end(&incoming_packet, padlen);
+	if (incoming_seg != NULL) {
+		if (padlen >= packet_length)
+			packet_disconnect("Corrupted padlen %d on input.",
+			    padlen);
+		/* leave the data string in the segment */
+		plen = packet_length - 1 - padlen;
+		buffer_append(&incoming_packet, pkt + 4 + 1,
+		    MIN(plen, DATA_HDR_LEN));
+		if (plen > DATA_HDR_LEN) {
+			incoming_seg_off = 4 + 1 + DATA_HDR_LEN;
+			incoming_seg_len = plen - DATA_HDR_LEN;
+		} else
+			packet_release_seg();
+	} else {
+		/* skip packet size + padlen, discard padding */
+		buffer_consume(&incoming_packet, 4 + 1);
+		buffer_consume_end(&incoming_packet, padlen);
+	}
 
 	DBG(debug("input: len before de-compress %d", buffer_len(&incoming_packet)));
 	if (comp && comp->enabled) {
 		buffer_clear(&compression_buffer);
-		buffer_uncompress(&incoming_packet, &compression_buffer);
+		adapt_uncompress(&incoming_packet, &compression_buffer);
 		buffer_clear(&incoming_packet);
 		buffer_append(&incoming_packet, buffer_ptr(&compression_buffer),
 		    buffer_len(&compression_buffer));
@@ -996,6 +1401,7 @@ packet_read_poll2(u_int32_t *seqnr_p)
 	 * return length of payload (without type field)
 	 */
 	type = buffer_get_char(&incoming_packet);
+	packet_account(MODE_IN, type, 4 + packet_length + maclen);
 	if (type == SSH2_MSG_NEWKEYS)
 		set_newkeys(MODE_IN);
 #ifdef PACKET_DEBUG
@@ -1090,6 +1496,28 @@ packet_process_incoming(const char *buf, u_int len)
 	buffer_append(&input, buf, len);
 }
 
+/*
+ * Reads from the connection straight into the input buffer, without a
+ * bounce buffer on the stack.  A single read takes up to PACKET_READ_LEN
+ * bytes, enough for several full size packets, which packet_read_poll()
+ * then returns one after the other without further system calls.
+ * Returns the result of read(2), with errno intact.
+ */
+int
+packet_read_input(void)
+{
+	u_char *cp;
+	int len, saved_errno;
+
+	cp = buffer_append_space(&input, PACKET_READ_LEN);
+	len = read(connection_in, cp, PACKET_READ_LEN);
+	saved_errno = errno;
+	buffer_consume_end(&input, len > 0 ? PACKET_READ_LEN - len :
+	    PACKET_READ_LEN);
+	errno = saved_errno;
+	return len;
+}
+
 /* Returns a character from the packet. */
 
 u_int
@@ -1137,7 +1565,7 @@ packet_get_raw(int *length_ptr)
 int
 packet_remaining(void)
 {
-	return buffer_len(&incoming_packet);
+	return buffer_len(&incoming_packet) + incoming_seg_len;
 }
 
 /*
@@ -1153,6 +1581,41 @@ packet_get_string(u_int *length_ptr)
 	return buffer_get_string(&incoming_packet, length_ptr);
 }
 
+/*
+ * Like packet_get_string(), but returns a reference to a segment that
+ * holds the string at *offp.  The data of channel data packets is not
+ * copied.  The caller releases the segment with segment_unref().
+ */
+Segment *
+packet_get_string_seg(u_int *offp, u_int *length_ptr)
+{
+	Segment *seg;
+	u_int len;
+
+	len = buffer_get_int(&incoming_packet);
+	if (len > 256 * 1024)
+		packet_disconnect("Bad string length %u.", len);
+	if (incoming_seg == NULL || buffer_len(&incoming_packet) != 0) {
+		seg = segment_new(len);
+		buffer_get(&incoming_packet, seg->data, len);
+		seg->used = len;
+		*offp = 0;
+	} else {
+		if (len > incoming_seg_len)
+			packet_disconnect("Bad string length %u, %u bytes left.",
+			    len, incoming_seg_len);
+		seg = incoming_seg;
+		segment_ref(seg);
+		*offp = incoming_seg_off;
+		/* anything after the string is for packet_check_eom() */
+		buffer_append(&incoming_packet, seg->data + incoming_seg_off +
+		    len, incoming_seg_len - len);
+		incoming_seg_len = 0;
+	}
+	*length_ptr = len;
+	return seg;
+}
+
 /*
  * Sends a diagnostic message from the server to the client.  This message
  * can be sent at any time (but not while constructing another message). The
@@ -1242,7 +1705,11 @@ packet_disconnect(const char *fmt,...)
 void
 packet_write_poll(void)
 {
-	int len = buffer_len(&output);
+	int len;
+
+	/* queued packets are still plaintext */
+	packet_batch_flush();
+	len = buffer_len(&output);
 	if (len > 0) {
 		len = write(connection_out, buffer_ptr(&output), len);
 		if (len <= 0) {
@@ -1352,6 +1819,102 @@ packet_is_interactive(void)
 	return interactive_mode;
 }
 
+/* Samples the amount of output waiting for the connection. */
+void
+packet_stats_sample(void)
+{
+	hist_add(&pstats.output_queue, buffer_len(&output));
+}
+
+/*
+ * Reports the transport statistics of the connection through out, one
+ * line at a time.  SSH2 only.
+ */
+void
+packet_stats_report(hist_out_fn *out)
+{
+	static const char *dir[MODE_MAX] = { "in", "out" };
+	char name[64];
+	int mode, type;
+
+	for (mode = 0; mode < MODE_MAX; mode++) {
+		out("transport %s: cipher %ld.%06lds, mac %ld.%06lds", dir[mode],
+		    (long)pstats.cipher_time[mode].tv_sec,
+		    (long)pstats.cipher_time[mode].tv_usec,
+		    (long)pstats.mac_time[mode].tv_sec,
+		    (long)pstats.mac_time[mode].tv_usec);
+		for (type = 0; type < 256; type++)
+			if (pstats.packets[mode][type] != 0)
+				out("transport %s: type %d: %u packets, "
+				    "%llu bytes", dir[mode], type,
+				    pstats.packets[mode][type],
+				    (unsigned long long)
+				    pstats.bytes[mode][type]);
+		snprintf(name, sizeof(name), "packet size %s", dir[mode]);
+		hist_report(&pstats.size[mode], name, "bytes", out);
+	}
+	hist_report(&pstats.output_queue, "output queue", "bytes", out);
+	adapt_compress_report(out);
+}
+
+/*
+ * Returns true if the keys in use have protected enough traffic, or are
+ * old enough, that a new key exchange should be started.
+ */
+int
+packet_need_rekeying(void)
+{
+	int mode;
+
+	if (!compat20 || rekeying || newkeys[MODE_OUT] == NULL ||
+	    newkeys[MODE_IN] == NULL)
+		return 0;
+	for (mode = 0; mode < MODE_MAX; mode++)
+		if ((p_state[mode].max_bytes != 0 &&
+		    p_state[mode].bytes >= p_state[mode].max_bytes) ||
+		    p_state[mode].packets >= REKEY_MAX_PACKETS)
+			return 1;
+	return (rekey_interval != 0 && rekey_time != 0 &&
+	    time(NULL) >= rekey_time + rekey_interval);
+}
+
+/*
+ * Returns the number of seconds until time based rekeying is due, or
+ * -1 if it is disabled.
+ */
+int
+packet_rekey_timeout(void)
+{
+	time_t now;
+
+	if (!compat20 || rekey_interval == 0 || rekey_time == 0)
+		return -1;
+	now = time(NULL);
+	if (now >= rekey_time + rekey_interval)
+		return 0;
+	return (int)(rekey_time + rekey_interval - now);
+}
+
+/*
+ * Limits the data protected by one set of keys to bytes (0 keeps the
+ * default for the cipher) and their lifetime to seconds (0 for none).
+ * Both apply to the keys in use as well.
+ */
+void
+packet_set_rekey_limits(u_int64_t bytes, time_t seconds)
+{
+	debug3("packet_set_rekey_limits: %llu bytes, %ld seconds",
+	    (unsigned long long)bytes, (long)seconds);
+	rekey_limit = bytes;
+	rekey_interval = seconds;
+	if (bytes != 0) {
+		p_state[MODE_IN].max_bytes =
+		    MIN(p_state[MODE_IN].max_bytes, bytes);
+		p_state[MODE_OUT].max_bytes =
+		    MIN(p_state[MODE_OUT].max_bytes, bytes);
+	}
+}
+
 int
 packet_set_maxsize(int s)
 {
@@ -1392,15 +1955,7 @@ packet_add_padding(u_char pad)
 void
 packet_send_ignore(int nbytes)
 {
-	u_int32_t rand = 0;
-	int i;
-
 	packet_start(compat20 ? SSH2_MSG_IGNORE : SSH_MSG_IGNORE);
 	packet_put_int(nbytes);
-	for (i = 0; i < nbytes; i++) {
-		if (i % 4 == 0)
-			rand = arc4random();
-		packet_put_char(rand & 0xff);
-		rand >>= 8;
-	}
+	randbuf_fill(buffer_append_space(&outgoing_packet, nbytes), nbytes);
 }
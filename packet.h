@@ -17,6 +17,7 @@
 #define PACKET_H
 
 #include <openssl/bn.h>
+#include "chunkbuf.h"
 
 void     packet_set_connection(int, int);
 void     packet_set_nonblocking(void);
@@ -41,10 +42,17 @@ void     packet_put_cstring(const char *str);
 void     packet_put_raw(const void *buf, u_int len);
 void     packet_send(void);
 
+/* maximum number of header integers for packet_send_data() */
+#define PACKET_MAX_HDR	4
+void	 packet_send_data(u_char, const u_int32_t *, u_int, const void *, u_int);
+void	 packet_batch_begin(void);
+void	 packet_batch_end(void);
+
 int      packet_read(void);
 void     packet_read_expect(int type);
 int      packet_read_poll(void);
 void     packet_process_incoming(const char *buf, u_int len);
+int	 packet_read_input(void);
 int      packet_read_seqnr(u_int32_t *seqnr_p);
 int      packet_read_poll_seqnr(u_int32_t *seqnr_p);
 
@@ -54,6 +62,7 @@ void     packet_get_bignum(BIGNUM * value);
 void     packet_get_bignum2(BIGNUM * value);
 void	*packet_get_raw(int *length_ptr);
 void	*packet_get_string(u_int *length_ptr);
+Segment	*packet_get_string_seg(u_int *, u_int *);
 void     packet_disconnect(const char *fmt,...) __attribute__((format(printf, 1, 2)));
 void     packet_send_debug(const char *fmt,...) __attribute__((format(printf, 1, 2)));
 
@@ -72,6 +81,13 @@ void     packet_write_wait(void);
 int      packet_have_data_to_write(void);
 int      packet_not_very_much_data_to_write(void);
 
+void	 packet_stats_sample(void);
+void	 packet_stats_report(void (*)(const char *, ...));
+
+int	 packet_need_rekeying(void);
+int	 packet_rekey_timeout(void);
+void	 packet_set_rekey_limits(u_int64_t, time_t);
+
 int	 packet_connection_is_on_socket(void);
 int	 packet_connection_is_ipv4(void);
 int	 packet_remaining(void);
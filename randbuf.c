@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <openssl/rc4.h>
+
+#include "randbuf.h"
+
+/*
+ * The bytes come from an RC4 keystream that is keyed from arc4random()
+ * and computed a pool at a time, so that each caller pays a memcpy()
+ * instead of one arc4random() call per four bytes.  The key is made on
+ * first use, so sshd children that inherit an unused state after fork
+ * still get streams of their own.
+ */
+#define RANDBUF_POOL	1024
+#define RANDBUF_KEYLEN	32
+#define RANDBUF_DROP	1536		/* skip the weak start of the stream */
+#define RANDBUF_RESEED	(1600 * 1024)	/* rekey after this many bytes */
+
+static RC4_KEY rc4;
+static u_char pool[RANDBUF_POOL];
+static u_int pool_pos = RANDBUF_POOL;
+static u_int since_key = 0;
+static int keyed = 0;
+
+static void
+randbuf_key(void)
+{
+	u_char key[RANDBUF_KEYLEN];
+	u_int32_t r;
+	int i;
+
+	for (i = 0; i < RANDBUF_KEYLEN; i++) {
+		if (i % 4 == 0)
+			r = arc4random();
+		key[i] = r & 0xff;
+		r >>= 8;
+	}
+	RC4_set_key(&rc4, sizeof(key), key);
+	memset(key, 0, sizeof(key));
+	for (i = 0; i < RANDBUF_DROP; i += RANDBUF_POOL) {
+		memset(pool, 0, RANDBUF_POOL);
+		RC4(&rc4, RANDBUF_POOL, pool, pool);
+	}
+	since_key = 0;
+	keyed = 1;
+}
+
+static void
+randbuf_refill(void)
+{
+	if (!keyed || since_key >= RANDBUF_RESEED)
+		randbuf_key();
+	memset(pool, 0, sizeof(pool));
+	RC4(&rc4, sizeof(pool), pool, pool);
+	since_key += sizeof(pool);
+	pool_pos = 0;
+}
+
+/* Fills buf with len random bytes.  Bytes are never handed out twice. */
+void
+randbuf_fill(void *buf, u_int len)
+{
+	u_char *p = buf;
+	u_int n;
+
+	while (len > 0) {
+		if (pool_pos == RANDBUF_POOL)
+			randbuf_refill();
+		n = MIN(len, RANDBUF_POOL - pool_pos);
+		memcpy(p, pool + pool_pos, n);
+		pool_pos += n;
+		p += n;
+		len -= n;
+	}
+}
@@ -77,6 +77,8 @@
 #include "includes.h"
 RCSID("$OpenBSD: scp.c,v 1.91 2002/06/19 00:27:55 deraadt Exp $");
 
+#include <poll.h>
+
 #include "xmalloc.h"
 #include "atomicio.h"
 #include "pathnames.h"
@@ -185,6 +187,12 @@ typedef struct {
 	char *buf;
 } BUF;
 
+/*
+ * File data is moved in blocks of this size, so that a large transfer
+ * costs one read and one write per block instead of per page.
+ */
+#define COPY_BUFLEN	(1024 * 1024)
+
 BUF *allocbuf(BUF *, int, int);
 void lostconn(int);
 void nospace(void);
@@ -200,9 +208,38 @@ int pflag, iamremote, iamrecursive, targetshouldbedirectory;
 #define	CMDNEEDS	64
 char cmd[CMDNEEDS];		/* must hold "rcp -r -p -d\0" */
 
+/*
+ * Pipelined protocol.  The sender streams records and file data without
+ * waiting for an ack after each, and the receiver only answers when
+ * something went wrong, with the index of the file in the error.  At
+ * the end the sender sends "Q\n" and collects errors until the final
+ * ack.  With -z it is requested with "-o scp-pipeline" on the remote
+ * command line; a peer that supports it answers with PIPELINE_HELLO as
+ * its first record, otherwise the classic protocol is used.  It is not
+ * requested by default, since scp implementations other than this one
+ * may refuse the unknown option.
+ */
+#define PIPELINE_OPT	"scp-pipeline"
+#define PIPELINE_HELLO	"P1\n"
+int pipeline_request;		/* -z: ask the peer for it */
+int pipeline;			/* pipelined protocol in use */
+int pipeline_offer;		/* peer asked for it; announce it */
+int pipeline_want;		/* we asked for it; accept the hello */
+int pipeline_index;		/* number of the current file */
+
+/* Input from the peer is buffered, so that records are not read bytewise. */
+char remibuf[16384];
+size_t remipos, remilen;
+
 int response(void);
+int response_hello(void);
+ssize_t remread(void *, size_t);
+ssize_t remread_full(void *, size_t);
+void pipeline_poll(void);
+void pipeline_finish(void);
 void rsource(char *, struct stat *);
 void sink(int, char *[]);
+void sink_skip(off_t);
 void source(int, char *[]);
 void tolocal(int, char *[]);
 void toremote(char *, int, char *[]);
@@ -225,7 +262,7 @@ main(argc, argv)
 	addargs(&args, "-oClearAllForwardings yes");
 
 	fflag = tflag = 0;
-	while ((ch = getopt(argc, argv, "dfprtvBCc:i:P:q46S:o:F:")) != -1)
+	while ((ch = getopt(argc, argv, "dfprtvzBCc:i:P:q46S:o:F:")) != -1)
 		switch (ch) {
 		/* User-visible flags. */
 		case '4':
@@ -234,6 +271,12 @@ main(argc, argv)
 			addargs(&args, "-%c", ch);
 			break;
 		case 'o':
+			/* a peer asking for the pipelined protocol */
+			if (strcmp(optarg, PIPELINE_OPT) == 0) {
+				pipeline_offer = 1;
+				break;
+			}
+			/* FALLTHROUGH */
 		case 'c':
 		case 'i':
 		case 'F':
@@ -261,6 +304,9 @@ main(argc, argv)
 		case 'q':
 			showprogress = 0;
 			break;
+		case 'z':
+			pipeline_request = 1;
+			break;
 
 		/* Server options. */
 		case 'd':
@@ -292,7 +338,14 @@ main(argc, argv)
 	if (fflag) {
 		/* Follow "protocol", send data. */
 		(void) response();
+		if (pipeline_offer) {
+			pipeline = 1;
+			(void) atomicio(write, remout, PIPELINE_HELLO,
+			    sizeof(PIPELINE_HELLO) - 1);
+		}
 		source(argc, argv);
+		if (pipeline)
+			pipeline_finish();
 		exit(errs != 0);
 	}
 	if (tflag) {
@@ -396,18 +449,23 @@ toremote(targ, argc, argv)
 			if (remin == -1) {
 				len = strlen(targ) + CMDNEEDS + 20;
 				bp = xmalloc(len);
-				(void) snprintf(bp, len, "%s -t %s", cmd, targ);
+				(void) snprintf(bp, len, "%s%s -t %s", cmd,
+				    pipeline_request ? " -o" PIPELINE_OPT : "",
+				    targ);
 				host = cleanhostname(thost);
 				if (do_cmd(host, tuser, bp, &remin,
 				    &remout, argc) < 0)
 					exit(1);
-				if (response() < 0)
+				remipos = remilen = 0;
+				if (response_hello() < 0)
 					exit(1);
 				(void) xfree(bp);
 			}
 			source(1, argv + i);
 		}
 	}
+	if (pipeline)
+		pipeline_finish();
 }
 
 void
@@ -450,13 +508,17 @@ tolocal(argc, argv)
 		host = cleanhostname(host);
 		len = strlen(src) + CMDNEEDS + 20;
 		bp = xmalloc(len);
-		(void) snprintf(bp, len, "%s -f %s", cmd, src);
+		(void) snprintf(bp, len, "%s%s -f %s", cmd,
+		    pipeline_request ? " -o" PIPELINE_OPT : "", src);
 		if (do_cmd(host, suser, bp, &remin, &remout, argc) < 0) {
 			(void) xfree(bp);
 			++errs;
 			continue;
 		}
 		xfree(bp);
+		remipos = remilen = 0;
+		pipeline = pipeline_index = 0;
+		pipeline_want = pipeline_request;
 		sink(1, argv + argc - 1);
 		(void) close(remin);
 		remin = remout = -1;
@@ -520,9 +582,15 @@ syserr:			run_err("%s: %s", name, strerror(errno));
 			    (u_long) stb.st_mtime,
 			    (u_long) stb.st_atime);
 			(void) atomicio(write, remout, buf, strlen(buf));
-			if (response() < 0)
+			if (!pipeline && response() < 0)
 				goto next;
 		}
+		/* a pipelined receiver expects the data after the header */
+		if ((bp = allocbuf(&buffer, fd, COPY_BUFLEN)) == NULL)
+			goto next;
+#ifdef POSIX_FADV_SEQUENTIAL
+		(void) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
 #define	FILEMODEMASK	(S_ISUID|S_ISGID|S_IRWXU|S_IRWXG|S_IRWXO)
 		snprintf(buf, sizeof buf, "C%04o %lld %s\n",
 		    (u_int) (stb.st_mode & FILEMODEMASK),
@@ -531,10 +599,9 @@ syserr:			run_err("%s: %s", name, strerror(errno));
 			fprintf(stderr, "Sending file modes: %s", buf);
 			fflush(stderr);
 		}
+		pipeline_index++;
 		(void) atomicio(write, remout, buf, strlen(buf));
-		if (response() < 0)
-			goto next;
-		if ((bp = allocbuf(&buffer, fd, 2048)) == NULL) {
+		if (!pipeline && response() < 0) {
 next:			(void) close(fd);
 			continue;
 		}
@@ -570,7 +637,10 @@ next:			(void) close(fd);
 			(void) atomicio(write, remout, "", 1);
 		else
 			run_err("%s: %s", name, strerror(haderr));
-		(void) response();
+		if (pipeline)
+			pipeline_poll();
+		else
+			(void) response();
 	}
 }
 
@@ -597,7 +667,7 @@ rsource(name, statp)
 		    (u_long) statp->st_mtime,
 		    (u_long) statp->st_atime);
 		(void) atomicio(write, remout, path, strlen(path));
-		if (response() < 0) {
+		if (!pipeline && response() < 0) {
 			closedir(dirp);
 			return;
 		}
@@ -607,7 +677,7 @@ rsource(name, statp)
 	if (verbose_mode)
 		fprintf(stderr, "Entering directory: %s", path);
 	(void) atomicio(write, remout, path, strlen(path));
-	if (response() < 0) {
+	if (!pipeline && response() < 0) {
 		closedir(dirp);
 		return;
 	}
@@ -626,7 +696,8 @@ rsource(name, statp)
 	}
 	(void) closedir(dirp);
 	(void) atomicio(write, remout, "E\n", 2);
-	(void) response();
+	if (!pipeline)
+		(void) response();
 }
 
 void
@@ -663,17 +734,24 @@ sink(argc, argv)
 	if (targetshouldbedirectory)
 		verifydir(targ);
 
-	(void) atomicio(write, remout, "", 1);
+	if (pipeline_offer) {
+		/* announce the pipelined protocol instead of the first ack */
+		pipeline_offer = 0;
+		pipeline = 1;
+		(void) atomicio(write, remout, PIPELINE_HELLO,
+		    sizeof(PIPELINE_HELLO) - 1);
+	} else if (!pipeline)
+		(void) atomicio(write, remout, "", 1);
 	if (stat(targ, &stb) == 0 && S_ISDIR(stb.st_mode))
 		targisdir = 1;
 	for (first = 1;; first = 0) {
 		cp = buf;
-		if (atomicio(read, remin, cp, 1) <= 0)
+		if (remread_full(cp, 1) <= 0)
 			return;
 		if (*cp++ == '\n')
 			SCREWUP("unexpected <newline>");
 		do {
-			if (atomicio(read, remin, &ch, sizeof(ch)) != sizeof(ch))
+			if (remread_full(&ch, sizeof(ch)) != sizeof(ch))
 				SCREWUP("lost connection");
 			*cp++ = ch;
 		} while (cp < &buf[sizeof(buf) - 1] && ch != '\n');
@@ -689,12 +767,26 @@ sink(argc, argv)
 			continue;
 		}
 		if (buf[0] == 'E') {
-			(void) atomicio(write, remout, "", 1);
+			if (!pipeline)
+				(void) atomicio(write, remout, "", 1);
 			return;
 		}
 		if (ch == '\n')
 			*--cp = 0;
 
+		if (buf[0] == 'P' && pipeline_want) {
+			if (strcmp(buf, "P1") != 0)
+				SCREWUP("unknown pipelined protocol");
+			pipeline_want = 0;
+			pipeline = 1;
+			continue;
+		}
+		if (buf[0] == 'Q' && pipeline) {
+			/* all errors have been sent */
+			(void) atomicio(write, remout, "", 1);
+			return;
+		}
+
 		cp = buf;
 		if (*cp == 'T') {
 			setimes++;
@@ -711,7 +803,8 @@ sink(argc, argv)
 			atime.tv_usec = strtol(cp, &cp, 10);
 			if (!cp || *cp++ != '\0')
 				SCREWUP("atime.usec not delimited");
-			(void) atomicio(write, remout, "", 1);
+			if (!pipeline)
+				(void) atomicio(write, remout, "", 1);
 			continue;
 		}
 		if (*cp != 'C' && *cp != 'D') {
@@ -741,6 +834,8 @@ sink(argc, argv)
 			size = size * 10 + (*cp++ - '0');
 		if (*cp++ != ' ')
 			SCREWUP("size not delimited");
+		if (buf[0] == 'C')
+			pipeline_index++;
 		if (targisdir) {
 			static char *namebuf;
 			static int cursize;
@@ -794,28 +889,40 @@ sink(argc, argv)
 		mode |= S_IWRITE;
 		if ((ofd = open(np, O_WRONLY|O_CREAT, mode)) < 0) {
 bad:			run_err("%s: %s", np, strerror(errno));
+			/* the sender did not wait; drop what it sent */
+			if (pipeline)
+				sink_skip(buf[0] == 'D' ? -1 : size);
 			continue;
 		}
-		(void) atomicio(write, remout, "", 1);
-		if ((bp = allocbuf(&buffer, ofd, 4096)) == NULL) {
+		if (!pipeline)
+			(void) atomicio(write, remout, "", 1);
+		if ((bp = allocbuf(&buffer, ofd, COPY_BUFLEN)) == NULL) {
 			(void) close(ofd);
+			if (pipeline)
+				sink_skip(size);
 			continue;
 		}
 		cp = bp->buf;
 		wrerr = NO;
+#ifdef HAVE_POSIX_FALLOCATE
+		/* reserve the space up front, to keep the file contiguous */
+		if (size > 0 && fstat(ofd, &stb) == 0 &&
+		    S_ISREG(stb.st_mode) && stb.st_size < size)
+			(void) posix_fallocate(ofd, 0, size);
+#endif
 
 		if (showprogress) {
 			totalbytes = size;
 			progressmeter(-1);
 		}
 		statbytes = 0;
-		for (count = i = 0; i < size; i += 4096) {
-			amt = 4096;
+		for (count = i = 0; i < size; i += bp->cnt) {
+			amt = bp->cnt;
 			if (i + amt > size)
 				amt = size - i;
 			count += amt;
 			do {
-				j = read(remin, cp, amt);
+				j = remread(cp, amt);
 				if (j == -1 && (errno == EINTR ||
 				    errno == EAGAIN)) {
 					continue;
@@ -881,7 +988,8 @@ bad:			run_err("%s: %s", np, strerror(errno));
 			run_err("%s: %s", np, strerror(wrerrno));
 			break;
 		case NO:
-			(void) atomicio(write, remout, "", 1);
+			if (!pipeline)
+				(void) atomicio(write, remout, "", 1);
 			break;
 		case DISPLAYED:
 			break;
@@ -892,12 +1000,165 @@ screwup:
 	exit(1);
 }
 
+/*
+ * Pipelined mode: the sender does not wait for our verdict, so the data
+ * of a file we could not create (size >= 0), or all records of such a
+ * directory (size < 0), are read and dropped.
+ */
+void
+sink_skip(off_t size)
+{
+	char ch, *cp, buf[2048];
+	int depth;
+	ssize_t n;
+
+	if (size >= 0) {
+		while (size > 0) {
+			n = remread_full(buf, MIN(size, (off_t)sizeof(buf)));
+			if (n <= 0)
+				lostconn(0);
+			size -= n;
+		}
+		(void) response();
+		return;
+	}
+	for (depth = 1; depth > 0;) {
+		cp = buf;
+		do {
+			if (remread_full(&ch, sizeof(ch)) != sizeof(ch))
+				lostconn(0);
+			*cp++ = ch;
+		} while (cp < &buf[sizeof(buf) - 1] && ch != '\n');
+		*cp = 0;
+		switch (buf[0]) {
+		case '\01':
+		case '\02':
+			if (iamremote == 0)
+				(void) atomicio(write, STDERR_FILENO,
+				    buf + 1, strlen(buf + 1));
+			if (buf[0] == '\02')
+				exit(1);
+			++errs;
+			break;
+		case 'D':
+			depth++;
+			break;
+		case 'E':
+			depth--;
+			break;
+		case 'C':
+			pipeline_index++;
+			if ((cp = strchr(buf, ' ')) == NULL)
+				goto bad;
+			sink_skip(strtoll(cp + 1, NULL, 10));
+			break;
+		case 'T':
+			break;
+		default:
+bad:			run_err("protocol error: expected control record");
+			exit(1);
+		}
+	}
+}
+
+/*
+ * Read a buffered chunk of input from the peer.  Requests larger than
+ * the buffer bypass it once it is empty.
+ */
+ssize_t
+remread(void *buf, size_t len)
+{
+	ssize_t n;
+
+	if (remipos == remilen) {
+		if (len >= sizeof(remibuf))
+			return (read(remin, buf, len));
+		if ((n = read(remin, remibuf, sizeof(remibuf))) <= 0)
+			return (n);
+		remipos = 0;
+		remilen = n;
+	}
+	n = MIN(len, remilen - remipos);
+	memcpy(buf, remibuf + remipos, n);
+	remipos += n;
+	return (n);
+}
+
+/* Like atomicio(read, remin, ...), through the input buffer. */
+ssize_t
+remread_full(void *buf, size_t len)
+{
+	char *s = buf;
+	ssize_t res, pos = 0;
+
+	while (len > pos) {
+		res = remread(s + pos, len - pos);
+		switch (res) {
+		case -1:
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+		case 0:
+			return (res);
+		default:
+			pos += res;
+		}
+	}
+	return (pos);
+}
+
+/*
+ * The first answer of a sink: the classic ack, or the hello of a peer
+ * that speaks the pipelined protocol.
+ */
+int
+response_hello(void)
+{
+	char ch;
+
+	if (remipos == remilen) {
+		if (remread_full(&ch, 1) != 1)
+			lostconn(0);
+		remipos--;	/* unread it */
+	}
+	if (!pipeline_request || remibuf[remipos] != 'P')
+		return (response());
+	do {
+		if (remread_full(&ch, 1) != 1)
+			lostconn(0);
+	} while (ch != '\n');
+	if (verbose_mode)
+		fprintf(stderr, "Using the pipelined protocol\n");
+	pipeline = 1;
+	return (0);
+}
+
+/* Pipelined mode: collect the errors the receiver has reported so far. */
+void
+pipeline_poll(void)
+{
+	struct pollfd pfd;
+
+	pfd.fd = remin;
+	pfd.events = POLLIN;
+	while (remipos < remilen || poll(&pfd, 1, 0) > 0)
+		(void) response();
+}
+
+/* Pipelined mode: end the transfer and wait for the remaining errors. */
+void
+pipeline_finish(void)
+{
+	(void) atomicio(write, remout, "Q\n", 2);
+	while (response() != 0)
+		;
+}
+
 int
 response(void)
 {
 	char ch, *cp, resp, rbuf[2048];
 
-	if (atomicio(read, remin, &resp, sizeof(resp)) != sizeof(resp))
+	if (remread_full(&resp, sizeof(resp)) != sizeof(resp))
 		lostconn(0);
 
 	cp = rbuf;
@@ -910,7 +1171,7 @@ response(void)
 	case 1:		/* error, followed by error msg */
 	case 2:		/* fatal error, "" */
 		do {
-			if (atomicio(read, remin, &ch, sizeof(ch)) != sizeof(ch))
+			if (remread_full(&ch, sizeof(ch)) != sizeof(ch))
 				lostconn(0);
 			*cp++ = ch;
 		} while (cp < &rbuf[sizeof(rbuf) - 1] && ch != '\n');
@@ -929,7 +1190,7 @@ void
 usage(void)
 {
 	(void) fprintf(stderr,
-	    "usage: scp [-pqrvBC46] [-F config] [-S program] [-P port]\n"
+	    "usage: scp [-pqrvzBC46] [-F config] [-S program] [-P port]\n"
 	    "           [-c cipher] [-i identity] [-o option]\n"
 	    "           [[user@]host1:]file1 [...] [[user@]host2:]file2\n");
 	exit(1);
@@ -945,7 +1206,10 @@ run_err(const char *fmt,...)
 	if (fp == NULL && !(fp = fdopen(remout, "w")))
 		return;
 	(void) fprintf(fp, "%c", 0x01);
-	(void) fprintf(fp, "scp: ");
+	if (pipeline && pipeline_index > 0)
+		(void) fprintf(fp, "scp: file %d: ", pipeline_index);
+	else
+		(void) fprintf(fp, "scp: ");
 	va_start(ap, fmt);
 	(void) vfprintf(fp, fmt, ap);
 	va_end(ap);
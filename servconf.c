@@ -30,9 +30,15 @@ RCSID("$OpenBSD: servconf.c,v 1.111 2002/06/20 23:05:55 markus Exp $");
 #include "cipher.h"
 #include "kex.h"
 #include "mac.h"
+#include "channels.h"
 
 static void add_listen_addr(ServerOptions *, char *, u_short);
 static void add_one_listen_addr(ServerOptions *, char *, u_short);
+static u_int64_t parse_size(const char *);
+
+#ifndef UINT64_MAX
+#define UINT64_MAX	((u_int64_t)-1)
+#endif
 
 /* AF_UNSPEC or AF_INET or AF_INET6 */
 extern int IPv4or6;
@@ -102,6 +108,12 @@ initialize_server_options(ServerOptions *options)
 	options->max_startups_begin = -1;
 	options->max_startups_rate = -1;
 	options->max_startups = -1;
+	options->prefork_children = -1;
+	options->accept_workers = -1;
+	options->listen_backlog = -1;
+	options->channel_window_max = -1;
+	options->rekey_limit = 0;
+	options->rekey_interval = -1;
 	options->banner = NULL;
 	options->verify_reverse_mapping = -1;
 	options->client_alive_interval = -1;
@@ -218,6 +230,19 @@ fill_default_server_options(ServerOptions *options)
 		options->max_startups_rate = 100;		/* 100% */
 	if (options->max_startups_begin == -1)
 		options->max_startups_begin = options->max_startups;
+	if (options->prefork_children == -1)
+		options->prefork_children = 0;
+	if (options->accept_workers == -1)
+		options->accept_workers = 0;
+	if (options->listen_backlog == -1)
+		options->listen_backlog = SOMAXCONN;
+	if (options->channel_window_max == -1)
+		options->channel_window_max = CHAN_WINDOW_MAX_DEFAULT;
+	if (options->rekey_interval == -1)
+		options->rekey_interval = 0;
+	/* more idle children than unauthenticated connections are of no use */
+	if (options->prefork_children > options->max_startups)
+		options->prefork_children = options->max_startups;
 	if (options->verify_reverse_mapping == -1)
 		options->verify_reverse_mapping = 0;
 	if (options->client_alive_interval == -1)
@@ -263,6 +288,8 @@ typedef enum {
 	sAllowUsers, sDenyUsers, sAllowGroups, sDenyGroups,
 	sIgnoreUserKnownHosts, sCiphers, sMacs, sProtocol, sPidFile,
 	sGatewayPorts, sPubkeyAuthentication, sXAuthLocation, sSubsystem, sMaxStartups,
+	sPreforkChildren, sAcceptWorkers, sListenBacklog,
+	sChannelWindowMax, sRekeyLimit,
 	sBanner, sVerifyReverseMapping, sHostbasedAuthentication,
 	sHostbasedUsesNameFromPacketOnly, sClientAliveInterval,
 	sClientAliveCountMax, sAuthorizedKeysFile, sAuthorizedKeysFile2,
@@ -333,6 +360,11 @@ static struct {
 	{ "gatewayports", sGatewayPorts },
 	{ "subsystem", sSubsystem },
 	{ "maxstartups", sMaxStartups },
+	{ "preforkchildren", sPreforkChildren },
+	{ "acceptworkers", sAcceptWorkers },
+	{ "listenbacklog", sListenBacklog },
+	{ "channelwindowmax", sChannelWindowMax },
+	{ "rekeylimit", sRekeyLimit },
 	{ "banner", sBanner },
 	{ "verifyreversemapping", sVerifyReverseMapping },
 	{ "reversemappingcheck", sVerifyReverseMapping },
@@ -399,12 +431,51 @@ add_one_listen_addr(ServerOptions *options, char *addr, u_short port)
 	options->listen_addrs = aitop;
 }
 
+/*
+ * Parses a byte count with an optional K, M or G suffix.  Returns 0 on
+ * error.
+ */
+static u_int64_t
+parse_size(const char *s)
+{
+	unsigned long long val;
+	char *end;
+	int shift;
+
+	if (*s < '0' || *s > '9')
+		return 0;
+	errno = 0;
+	val = strtoull(s, &end, 10);
+	if (errno == ERANGE)
+		return 0;
+	switch (*end) {
+	case 'G': case 'g':
+		shift = 30;
+		break;
+	case 'M': case 'm':
+		shift = 20;
+		break;
+	case 'K': case 'k':
+		shift = 10;
+		break;
+	default:
+		shift = 0;
+		break;
+	}
+	if (shift != 0)
+		end++;
+	if (*end != '\0' || val > (UINT64_MAX >> shift))
+		return 0;
+	return val << shift;
+}
+
 int
 process_server_config_line(ServerOptions *options, char *line,
     const char *filename, int linenum)
 {
 	char *cp, **charptr, *arg, *p;
 	int *intptr, value;
+	u_int64_t val64;
 	ServerOpCodes opcode;
 	int i, n;
 
@@ -858,6 +929,72 @@ parse_flag:
 		intptr = &options->client_alive_count_max;
 		goto parse_int;
 
+	case sPreforkChildren:
+		intptr = &options->prefork_children;
+		goto parse_int;
+
+	case sAcceptWorkers:
+		intptr = &options->accept_workers;
+		goto parse_int;
+
+	case sListenBacklog:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing integer value.",
+			    filename, linenum);
+		value = atoi(arg);
+		if (value <= 0)
+			fatal("%s line %d: ListenBacklog must be positive.",
+			    filename, linenum);
+		if (options->listen_backlog == -1)
+			options->listen_backlog = value;
+		break;
+
+	case sChannelWindowMax:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing integer value.",
+			    filename, linenum);
+		value = atoi(arg);
+		if (value < CHAN_SES_WINDOW_DEFAULT ||
+		    value > CHAN_WINDOW_MAX_LIMIT)
+			fatal("%s line %d: ChannelWindowMax must be between "
+			    "%d and %d.", filename, linenum,
+			    CHAN_SES_WINDOW_DEFAULT, CHAN_WINDOW_MAX_LIMIT);
+		if (options->channel_window_max == -1)
+			options->channel_window_max = value;
+		break;
+
+	/*
+	 * RekeyLimit size [time], e.g. "RekeyLimit 1G 1h".  The size takes
+	 * K, M or G suffixes, "default" leaves it to the cipher; the
+	 * time is optional, "none" disables time based rekeying.
+	 */
+	case sRekeyLimit:
+		arg = strdelim(&cp);
+		if (!arg || *arg == '\0')
+			fatal("%s line %d: missing size value.",
+			    filename, linenum);
+		if (strcmp(arg, "default") == 0)
+			val64 = 0;
+		else if ((val64 = parse_size(arg)) == 0)
+			fatal("%s line %d: invalid size value.",
+			    filename, linenum);
+		else if (val64 < 16 * 1024)
+			fatal("%s line %d: RekeyLimit too small.",
+			    filename, linenum);
+		value = 0;
+		arg = strdelim(&cp);
+		if (arg && *arg != '\0' && strcmp(arg, "none") != 0 &&
+		    (value = convtime(arg)) == -1)
+			fatal("%s line %d: invalid time value.",
+			    filename, linenum);
+		if (options->rekey_interval == -1) {
+			options->rekey_limit = val64;
+			options->rekey_interval = value;
+		}
+		break;
+
 	case sDeprecated:
 		log("%s line %d: Deprecated option %s",
 		    filename, linenum, arg);
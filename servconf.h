@@ -116,6 +116,12 @@ typedef struct {
 	int	max_startups_begin;
 	int	max_startups_rate;
 	int	max_startups;
+	int	prefork_children;	/* idle children kept ready */
+	int	accept_workers;		/* SO_REUSEPORT listener processes */
+	int	listen_backlog;
+	int	channel_window_max;	/* ceiling for channel windows */
+	u_int64_t rekey_limit;		/* bytes per set of keys, 0: default */
+	int	rekey_interval;		/* seconds per set of keys, 0: none */
 	char   *banner;			/* SSH-2 banner message */
 	int	verify_reverse_mapping;	/* cross-check ip and dns */
 	int	client_alive_interval;	/*
@@ -54,6 +54,7 @@ RCSID("$OpenBSD: serverloop.c,v 1.102 2002/06/11 05:46:20 mpech Exp $");
 #include "serverloop.h"
 #include "misc.h"
 #include "kex.h"
+#include "histogram.h"
 
 extern ServerOptions options;
 
@@ -88,6 +89,10 @@ static int client_alive_timeouts = 0;
  */
 
 static volatile sig_atomic_t child_terminated = 0;	/* The child has terminated. */
+static volatile sig_atomic_t received_sigusr1 = 0;	/* Report statistics. */
+
+/* time from the wakeup that read packets until they were dispatched */
+static Histogram dispatch_latency;
 
 /* prototypes */
 static void server_init_dispatch(void);
@@ -128,13 +133,73 @@ notify_prepare(fd_set *readset)
 		FD_SET(notify_pipe[0], readset);
 }
 static void
-notify_done(fd_set *readset)
+notify_drain(void)
 {
 	char c;
 
+	while (read(notify_pipe[0], &c, 1) != -1)
+		debug2("notify_done: reading");
+}
+static void
+notify_done(fd_set *readset)
+{
 	if (notify_pipe[0] != -1 && FD_ISSET(notify_pipe[0], readset))
-		while (read(notify_pipe[0], &c, 1) != -1)
-			debug2("notify_done: reading");
+		notify_drain();
+}
+
+/* SIGUSR1 makes the connection log its transport statistics. */
+static void
+sigusr1_handler(int sig)
+{
+	int save_errno = errno;
+
+	received_sigusr1 = 1;
+	signal(SIGUSR1, sigusr1_handler);
+	notify_parent();
+	errno = save_errno;
+}
+
+static void
+server_stats_report(hist_out_fn *out)
+{
+	packet_stats_report(out);
+	hist_report(&dispatch_latency, "wakeup to dispatch", "usec", out);
+}
+
+/* Collects the report for the client, one line at a time. */
+static Buffer stats_reply;
+
+static void
+server_stats_line(const char *fmt, ...)
+{
+	char buf[1024];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, args);
+	va_end(args);
+	if (buffer_len(&stats_reply) > 0)
+		buffer_append(&stats_reply, "\n", 1);
+	buffer_append(&stats_reply, buf, strlen(buf));
+}
+
+/*
+ * Send the report to the client as a single debug message.  Unlike
+ * packet_send_debug() this does not wait for the output to drain.
+ */
+static void
+server_stats_send(void)
+{
+	if (datafellows & SSH_BUG_DEBUG)
+		return;
+	buffer_init(&stats_reply);
+	server_stats_report(server_stats_line);
+	packet_start(SSH2_MSG_DEBUG);
+	packet_put_char(0);	/* bool: always display */
+	packet_put_string(buffer_ptr(&stats_reply), buffer_len(&stats_reply));
+	packet_put_cstring("");
+	packet_send();
+	buffer_free(&stats_reply);
 }
 
 static void
@@ -243,7 +308,7 @@ wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
     int *nallocp, u_int max_time_milliseconds)
 {
 	struct timeval tv, *tvp;
-	int ret;
+	int ret, channel_timeout;
 	int client_alive_scheduled = 0;
 
 	/*
@@ -262,6 +327,7 @@ wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
 
 	/* Allocate and update select() masks for channel descriptors. */
 	channel_prepare_select(readsetp, writesetp, maxfdp, nallocp, 0);
+	channel_timeout = channel_poll_timeout();
 
 	if (compat20) {
 #if 0
@@ -311,6 +377,13 @@ wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
 		if (max_time_milliseconds == 0 || client_alive_scheduled)
 			max_time_milliseconds = 100;
 
+	/* a channel timer, e.g. a connection attempt to be raced */
+	if (channel_timeout != -1 && (max_time_milliseconds == 0 ||
+	    (u_int)channel_timeout < max_time_milliseconds)) {
+		max_time_milliseconds = MAX(channel_timeout, 1);
+		client_alive_scheduled = 0;
+	}
+
 	if (max_time_milliseconds == 0)
 		tvp = NULL;
 	else {
@@ -333,35 +406,111 @@ wait_until_can_do_something(fd_set **readsetp, fd_set **writesetp, int *maxfdp,
 	notify_done(*readsetp);
 }
 
+/*
+ * SSH2 version of wait_until_can_do_something().  The descriptors stay
+ * registered with the readiness backend between calls, so only changes
+ * in interest cost a system call, and only ready descriptors are
+ * reported back.
+ */
+static void
+wait_until_can_do_something2(Sshpoll *sp, int rekeying)
+{
+	u_int max_time_milliseconds = 0, events;
+	int ret, channel_timeout, rekey_timeout, client_alive_scheduled = 0;
+
+	if (options.client_alive_interval) {
+		client_alive_scheduled = 1;
+		max_time_milliseconds = options.client_alive_interval * 1000;
+	}
+
+	/* Update the interest of the channel descriptors. */
+	channel_prepare_poll(sp, rekeying);
+	channel_timeout = channel_poll_timeout();
+
+	events = SSHPOLL_IN;
+	if (connection_out == connection_in) {
+		if (packet_have_data_to_write())
+			events |= SSHPOLL_OUT;
+	} else {
+		sshpoll_set(sp, connection_out,
+		    packet_have_data_to_write() ? SSHPOLL_OUT : 0, -1);
+	}
+	sshpoll_set(sp, connection_in, events, -1);
+	if (notify_pipe[0] != -1)
+		sshpoll_set(sp, notify_pipe[0], SSHPOLL_IN, -1);
+
+	if (child_terminated && packet_not_very_much_data_to_write())
+		if (max_time_milliseconds == 0 || client_alive_scheduled)
+			max_time_milliseconds = 100;
+
+	/* a channel timer, e.g. a connection attempt to be raced */
+	if (channel_timeout != -1 && (max_time_milliseconds == 0 ||
+	    (u_int)channel_timeout < max_time_milliseconds)) {
+		max_time_milliseconds = MAX(channel_timeout, 1);
+		client_alive_scheduled = 0;
+	}
+
+	/* wake up when time based rekeying is due */
+	rekey_timeout = rekeying ? -1 : packet_rekey_timeout();
+	if (rekey_timeout != -1) {
+		rekey_timeout = MIN(rekey_timeout, 24 * 60 * 60) * 1000;
+		if (max_time_milliseconds == 0 ||
+		    (u_int)rekey_timeout < max_time_milliseconds) {
+			max_time_milliseconds = MAX(rekey_timeout, 1);
+			client_alive_scheduled = 0;
+		}
+	}
+
+	/* Wait for something to happen, or the timeout to expire. */
+	ret = sshpoll_wait(sp, max_time_milliseconds == 0 ?
+	    -1 : (int)max_time_milliseconds);
+
+	if (ret == -1) {
+		if (errno != EINTR)
+			error("%s: %.100s", sshpoll_backend(sp),
+			    strerror(errno));
+	} else if (ret == 0 && client_alive_scheduled)
+		client_alive_check();
+
+	if (notify_pipe[0] != -1 &&
+	    (sshpoll_revents(sp, notify_pipe[0]) & SSHPOLL_IN))
+		notify_drain();
+}
+
 /*
  * Processes input from the client and the program.  Input data is stored
  * in buffers and processed later.
  */
 static void
-process_input(fd_set * readset)
+process_connection_input(void)
 {
 	int len;
-	char buf[16384];
 
-	/* Read and buffer any input data from the client. */
-	if (FD_ISSET(connection_in, readset)) {
-		len = read(connection_in, buf, sizeof(buf));
-		if (len == 0) {
-			verbose("Connection closed by remote host.");
-			connection_closed = 1;
-			if (compat20)
-				return;
+	/* as many packets as the read returned are dispatched in one go */
+	len = packet_read_input();
+	if (len == 0) {
+		verbose("Connection closed by remote host.");
+		connection_closed = 1;
+		if (compat20)
+			return;
+		fatal_cleanup();
+	} else if (len < 0) {
+		if (errno != EINTR && errno != EAGAIN) {
+			verbose("Read error from remote host: %.100s", strerror(errno));
 			fatal_cleanup();
-		} else if (len < 0) {
-			if (errno != EINTR && errno != EAGAIN) {
-				verbose("Read error from remote host: %.100s", strerror(errno));
-				fatal_cleanup();
-			}
-		} else {
-			/* Buffer any received data. */
-			packet_process_incoming(buf, len);
 		}
 	}
+}
+
+static void
+process_input(fd_set * readset)
+{
+	int len;
+	char buf[16384];
+
+	/* Read and buffer any input data from the client. */
+	if (FD_ISSET(connection_in, readset))
+		process_connection_input();
 	if (compat20)
 		return;
 
@@ -735,20 +884,23 @@ collect_children(void)
 void
 server_loop2(Authctxt *authctxt)
 {
-	fd_set *readset = NULL, *writeset = NULL;
-	int rekeying = 0, max_fd, nalloc = 0;
+	Sshpoll *sp;
+	struct timeval wakeup, now;
+	int rekeying = 0, dispatch_pending = 0;
 
 	debug("Entering interactive session for SSH2.");
 
 	signal(SIGCHLD, sigchld_handler);
+	signal(SIGUSR1, sigusr1_handler);
 	child_terminated = 0;
 	connection_in = packet_get_connection_in();
 	connection_out = packet_get_connection_out();
+	channel_set_window_max(options.channel_window_max);
+	packet_set_rekey_limits(options.rekey_limit, options.rekey_interval);
 
 	notify_setup();
 
-	max_fd = MAX(connection_in, connection_out);
-	max_fd = MAX(max_fd, notify_pipe[0]);
+	sp = sshpoll_new();
 
 	xxx_authctxt = authctxt;
 
@@ -756,31 +908,56 @@ server_loop2(Authctxt *authctxt)
 
 	for (;;) {
 		process_buffered_input_packets();
+		if (dispatch_pending) {
+			gettimeofday(&now, NULL);
+			timersub(&now, &wakeup, &now);
+			hist_add(&dispatch_latency,
+			    now.tv_sec * 1000000 + now.tv_usec);
+			dispatch_pending = 0;
+		}
+		if (received_sigusr1) {
+			received_sigusr1 = 0;
+			server_stats_report(log);
+		}
 
 		rekeying = (xxx_kex != NULL && !xxx_kex->done);
+		if (!rekeying && xxx_kex != NULL && packet_need_rekeying()) {
+			debug("need rekeying");
+			xxx_kex->done = 0;
+			kex_send_kexinit(xxx_kex);
+			rekeying = 1;
+		}
 
+		/*
+		 * While rekeying, the channels keep reading and writing,
+		 * but their data stays buffered until the new keys are in
+		 * use; control messages are queued by the packet layer.
+		 */
 		if (!rekeying && packet_not_very_much_data_to_write())
 			channel_output_poll();
-		wait_until_can_do_something(&readset, &writeset, &max_fd,
-		    &nalloc, 0);
+		packet_stats_sample();
+		wait_until_can_do_something2(sp, rekeying);
+		gettimeofday(&wakeup, NULL);
 
 		collect_children();
-		if (!rekeying)
-			channel_after_select(readset, writeset);
-		process_input(readset);
+		channel_after_poll(sp);
+		if (sshpoll_revents(sp, connection_in) & SSHPOLL_IN) {
+			process_connection_input();
+			dispatch_pending = 1;
+		}
 		if (connection_closed)
 			break;
-		process_output(writeset);
+		/* Send any buffered packet data to the client. */
+		if (sshpoll_revents(sp, connection_out) & SSHPOLL_OUT)
+			packet_write_poll();
 	}
 	collect_children();
-
-	if (readset)
-		xfree(readset);
-	if (writeset)
-		xfree(writeset);
+	signal(SIGUSR1, SIG_IGN);
+	server_stats_report(debug);
 
 	/* free all channels, no more reads and writes */
 	channel_free_all();
+	sshpoll_free(sp);
 
 	/* free remaining sessions, e.g. remove wtmp entries */
 	session_destroy_all(NULL);
@@ -847,7 +1024,6 @@ static Channel *
 server_request_direct_tcpip(char *ctype)
 {
 	Channel *c;
-	int sock;
 	char *target, *originator;
 	int target_port, originator_port;
 
@@ -861,14 +1037,11 @@ server_request_direct_tcpip(char *ctype)
 	   originator, originator_port, target, target_port);
 
 	/* XXX check permission */
-	sock = channel_connect_to(target, target_port);
+	c = channel_connect_start(target, target_port, ctype,
+	    CHAN_TCP_WINDOW_DEFAULT, CHAN_TCP_PACKET_DEFAULT,
+	    xstrdup("direct-tcpip"));
 	xfree(target);
 	xfree(originator);
-	if (sock < 0)
-		return NULL;
-	c = channel_new(ctype, SSH_CHANNEL_CONNECTING,
-	    sock, sock, -1, CHAN_TCP_WINDOW_DEFAULT,
-	    CHAN_TCP_PACKET_DEFAULT, 0, xstrdup("direct-tcpip"), 1);
 	return c;
 }
 
@@ -984,6 +1157,10 @@ server_input_global_request(int type, u_int32_t seq, void *ctxt)
 			    listen_address, listen_port, options.gateway_ports);
 		}
 		xfree(listen_address);
+	} else if (strcmp(rtype, "transport-stats@openssh.com") == 0) {
+		/* the client's own connection */
+		server_stats_send();
+		success = 1;
 	}
 	if (want_reply) {
 		packet_start(success ?
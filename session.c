@@ -85,6 +85,7 @@ extern int log_stderr;
 extern int debug_flag;
 extern u_int utmp_len;
 extern int startup_pipe;
+extern int worker_pipe;
 extern void destroy_sensitive_data(void);
 
 /* original command from peer. */
@@ -197,6 +198,10 @@ do_authenticated(Authctxt *authctxt)
 		close(startup_pipe);
 		startup_pipe = -1;
 	}
+	if (worker_pipe != -1) {
+		close(worker_pipe);
+		worker_pipe = -1;
+	}
 	/* setup the channel layer */
 	if (!no_port_forwarding_flag && options.allow_tcp_forwarding)
 		channel_permit_all_opens();
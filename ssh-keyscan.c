@@ -18,17 +18,18 @@ RCSID("$OpenBSD: ssh-keyscan.c,v 1.36 2002/06/16 21:30:58 itojun Exp $");
 #include "xmalloc.h"
 #include "ssh.h"
 #include "ssh1.h"
+#include "ssh2.h"
 #include "key.h"
 #include "kex.h"
+#include "dh.h"
 #include "compat.h"
 #include "myproposal.h"
-#include "packet.h"
-#include "dispatch.h"
 #include "buffer.h"
 #include "bufaux.h"
 #include "log.h"
 #include "atomicio.h"
 #include "misc.h"
+#include "sshpoll.h"
 
 /* Flag indicating whether IPv4 or IPv6.  This can be set on the command line.
    Default value is AF_UNSPEC means both IPv4 and IPv6. */
@@ -42,7 +43,7 @@ int ssh_port = SSH_DEFAULT_PORT;
 
 int get_keytypes = KT_RSA1;	/* Get only RSA1 keys by default */
 
-#define MAXMAXFD 256
+#define MAXMAXFD 8192
 
 /* The number of seconds after which to give up on a TCP connection */
 int timeout = 5;
@@ -51,12 +52,25 @@ int maxfd;
 #define MAXCON (maxfd - 10)
 
 extern char *__progname;
-fd_set *read_wait;
-size_t read_wait_size;
+Sshpoll *poller;
 int ncon;
 int nonfatal_fatal = 0;
 jmp_buf kexjmp;
-Key *kexjmp_key;
+
+/* Output format */
+#define OF_TEXT 0		/* "host key" lines */
+#define OF_JSON 1		/* one JSON object per host and key type */
+#define OF_CSV 2
+int output_format = OF_TEXT;
+
+/* Checkpoint of the hosts already scanned, see ckpt_load() */
+FILE *ckpt_file;
+
+/* DH value sent to all servers; we never compute the shared secret */
+DH *kexdh;
+
+/* Largest SSH2 packet accepted during key exchange */
+#define KEX_MAX_PACKET (256 * 1024)
 
 /*
  * Keep a connection structure for each file descriptor.  The state
@@ -73,17 +87,33 @@ typedef struct Connection {
 	int c_len;		/* Total bytes which must be read. */
 	int c_off;		/* Length of data read so far. */
 	int c_keytype;		/* Only one of KT_RSA1, KT_DSA, or KT_RSA */
+	u_char c_kexstate;	/* Progress of the ssh2 key exchange */
+#define KS_KEXINIT 1		/* Waiting for the server's KEXINIT */
+#define KS_KEXDH 2		/* Waiting for KEXDH_REPLY */
 	char *c_namebase;	/* Address to free for c_name and c_namelist */
 	char *c_name;		/* Hostname of connection for errors */
 	char *c_namelist;	/* Pointer to other possible addresses */
 	char *c_output_name;	/* Hostname of connection for output */
 	char *c_data;		/* Data read from this fd */
-	Kex *c_kex;		/* The key-exchange struct for ssh2 */
+	struct timeval c_tstart;	/* Time connect() was called */
+	struct timeval c_tconn;	/* Time the connection was established */
+	struct timeval c_tgreet;	/* Time the greeting was received */
 	struct timeval c_tv;	/* Time at which connection gets aborted */
-	TAILQ_ENTRY(Connection) c_link;	/* List of connections in timeout order. */
+	TAILQ_ENTRY(Connection) c_link;	/* List of connections in a wheel slot. */
 } con;
 
-TAILQ_HEAD(conlist, Connection) tq;	/* Timeout Queue */
+/*
+ * Connection timeouts are kept in a hashed timing wheel: slot i holds
+ * the connections expiring in a tick congruent to i, so adding or
+ * removing a timeout is O(1) and each pass only looks at the slots of
+ * the ticks that have passed.  Connections of a later round of the
+ * wheel are skipped when their slot comes up.
+ */
+#define WHEEL_SLOTS 256
+#define WHEEL_TICK 100		/* milliseconds */
+TAILQ_HEAD(conlist, Connection) wheel[WHEEL_SLOTS];
+u_int wheel_tick;		/* Next tick to expire */
+time_t wheel_base;		/* Tick 0 */
 con *fdcon;
 
 /*
@@ -296,13 +326,6 @@ keygrab_ssh1(con *c)
 	return (rsa);
 }
 
-static int
-hostjump(Key *hostkey)
-{
-	kexjmp_key = hostkey;
-	longjmp(kexjmp, 1);
-}
-
 static int
 ssh2_capable(int remote_major, int remote_minor)
 {
@@ -319,41 +342,409 @@ ssh2_capable(int remote_major, int remote_minor)
 	return 0;
 }
 
-static Key *
-keygrab_ssh2(con *c)
+static const char *
+ssh2_hostkey_alg(con *c)
 {
-	int j;
+	return (c->c_keytype == KT_DSA ? "ssh-dss" : "ssh-rsa");
+}
 
-	packet_set_connection(c->c_fd, c->c_fd);
-	enable_compat20();
-	myproposal[PROPOSAL_SERVER_HOST_KEY_ALGS] = c->c_keytype == KT_DSA?
-	    "ssh-dss": "ssh-rsa";
-	c->c_kex = kex_setup(myproposal);
-	c->c_kex->verify_host_key = hostjump;
+/* Returns 1 if the comma separated list contains name. */
+static int
+namelist_has(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+	const char *cp;
+
+	for (cp = list; cp != NULL; cp = strchr(cp, ',')) {
+		if (*cp == ',')
+			cp++;
+		if (strncmp(cp, name, len) == 0 &&
+		    (cp[len] == ',' || cp[len] == '\0'))
+			return 1;
+	}
+	return 0;
+}
 
-	if (!(j = setjmp(kexjmp))) {
-		nonfatal_fatal = 1;
-		dispatch_run(DISPATCH_BLOCK, &c->c_kex->done, c->c_kex);
-		fprintf(stderr, "Impossible! dispatch_run() returned!\n");
-		exit(1);
+/*
+ * Send an unencrypted ssh2 packet.  Key exchange packets are small, so
+ * they fit in the socket buffer of a fresh connection.
+ */
+static int
+ssh2_send(con *c, Buffer *payload)
+{
+	Buffer b;
+	u_int padlen, i;
+	int len, ret = 0;
+
+	padlen = 8 - (buffer_len(payload) + 5) % 8;
+	if (padlen < 4)
+		padlen += 8;
+	buffer_init(&b);
+	buffer_put_int(&b, buffer_len(payload) + padlen + 1);
+	buffer_put_char(&b, padlen);
+	buffer_append(&b, buffer_ptr(payload), buffer_len(payload));
+	for (i = 0; i < padlen; i++)
+		buffer_put_char(&b, 0);
+	len = buffer_len(&b);
+	if (atomicio(write, c->c_fd, buffer_ptr(&b), len) != len) {
+		error("write (%s): %s", c->c_name, strerror(errno));
+		ret = -1;
+	}
+	buffer_free(&b);
+	return ret;
+}
+
+/*
+ * Offer only diffie-hellman-group1-sha1 and the host key type we are
+ * after, so that the server's KEXDH_REPLY carries that key.
+ */
+static int
+ssh2_send_kexinit(con *c)
+{
+	Buffer b;
+	const char *name;
+	int i, ret;
+
+	buffer_init(&b);
+	buffer_put_char(&b, SSH2_MSG_KEXINIT);
+	for (i = 0; i < 16; i++)
+		buffer_put_char(&b, arc4random() & 0xff);	/* cookie */
+	for (i = 0; i < PROPOSAL_MAX; i++) {
+		if (i == PROPOSAL_KEX_ALGS)
+			name = KEX_DH1;
+		else if (i == PROPOSAL_SERVER_HOST_KEY_ALGS)
+			name = ssh2_hostkey_alg(c);
+		else
+			name = myproposal[i];
+		buffer_put_cstring(&b, name);
+	}
+	buffer_put_char(&b, 0);		/* first_kex_packet_follows */
+	buffer_put_int(&b, 0);		/* reserved */
+	ret = ssh2_send(c, &b);
+	buffer_free(&b);
+	return ret;
+}
+
+static int
+ssh2_send_kexdh_init(con *c)
+{
+	Buffer b;
+	int ret;
+
+	if (kexdh == NULL) {
+		kexdh = dh_new_group1();
+		dh_gen_key(kexdh, 256);
+	}
+	buffer_init(&b);
+	buffer_put_char(&b, SSH2_MSG_KEXDH_INIT);
+	buffer_put_bignum2(&b, kexdh->pub_key);
+	ret = ssh2_send(c, &b);
+	buffer_free(&b);
+	return ret;
+}
+
+/*
+ * Process one ssh2 key exchange packet, held in c->c_data.  Returns 1
+ * and sets *keyp once the server has sent its host key, 0 if more
+ * packets are needed and -1 on failure.  All state lives in the con,
+ * so any number of key exchanges can be in progress at once.
+ */
+static int
+keygrab_ssh2(con *c, Key **keyp)
+{
+	static Buffer msg;
+	static int initialized;
+	char *cp, *kexalgs, *hostkeyalgs;
+	u_char *blob;
+	u_int padlen, bloblen;
+	int type, ok;
+
+	if (!initialized) {
+		buffer_init(&msg);
+		initialized = 1;
+	}
+	buffer_append(&msg, c->c_data, c->c_plen);
+	if (setjmp(kexjmp)) {
+		/* fatal() from a malformed packet */
+		nonfatal_fatal = 0;
+		buffer_clear(&msg);
+		return -1;
+	}
+	nonfatal_fatal = 1;
+	padlen = buffer_get_char(&msg);
+	if (padlen >= buffer_len(&msg))
+		fatal("%s: bad padding length %u", c->c_name, padlen);
+	buffer_consume_end(&msg, padlen);
+	type = buffer_get_char(&msg);
+
+	switch (type) {
+	case SSH2_MSG_IGNORE:
+	case SSH2_MSG_DEBUG:
+		break;
+	case SSH2_MSG_KEXINIT:
+		if (c->c_kexstate != KS_KEXINIT)
+			fatal("%s: unexpected KEXINIT", c->c_name);
+		buffer_consume(&msg, 16);	/* cookie */
+		/* free each list before the next read can longjmp away */
+		kexalgs = buffer_get_string(&msg, NULL);
+		ok = namelist_has(kexalgs, KEX_DH1);
+		xfree(kexalgs);
+		hostkeyalgs = buffer_get_string(&msg, NULL);
+		ok = ok && namelist_has(hostkeyalgs, ssh2_hostkey_alg(c));
+		xfree(hostkeyalgs);
+		nonfatal_fatal = 0;
+		buffer_clear(&msg);
+		if (!ok) {
+			debug("%s doesn't support %s with %s", c->c_name,
+			    KEX_DH1, ssh2_hostkey_alg(c));
+			return -1;
+		}
+		if (ssh2_send_kexdh_init(c) < 0)
+			return -1;
+		c->c_kexstate = KS_KEXDH;
+		return 0;
+	case SSH2_MSG_KEXDH_REPLY:
+		if (c->c_kexstate != KS_KEXDH)
+			fatal("%s: unexpected KEXDH_REPLY", c->c_name);
+		blob = buffer_get_string(&msg, &bloblen);
+		*keyp = key_from_blob(blob, bloblen);
+		xfree(blob);
+		nonfatal_fatal = 0;
+		buffer_clear(&msg);
+		if (*keyp == NULL) {
+			error("%s: bad host key", c->c_name);
+			return -1;
+		}
+		return 1;
+	case SSH2_MSG_DISCONNECT:
+		(void) buffer_get_int(&msg);
+		cp = buffer_get_string(&msg, NULL);
+		error("%s: disconnected: %.400s", c->c_name, cp);
+		xfree(cp);
+		nonfatal_fatal = 0;
+		buffer_clear(&msg);
+		return -1;
+	default:
+		fatal("%s: unexpected packet type %d", c->c_name, type);
 	}
 	nonfatal_fatal = 0;
-	xfree(c->c_kex);
-	c->c_kex = NULL;
-	packet_close();
+	buffer_clear(&msg);
+	return 0;
+}
+
+static const char *
+keytype_name(int keytype)
+{
+	switch (keytype) {
+	case KT_RSA1:
+		return "rsa1";
+	case KT_DSA:
+		return "dsa";
+	case KT_RSA:
+		return "rsa";
+	}
+	return "unknown";
+}
+
+/* Microseconds from a to b, or -1 if either is unset. */
+static long
+tvdiff(struct timeval *a, struct timeval *b)
+{
+	if (!timerisset(a) || !timerisset(b))
+		return (-1);
+	return ((b->tv_sec - a->tv_sec) * 1000000L +
+	    (b->tv_usec - a->tv_usec));
+}
+
+static void
+json_puts(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			printf("\\%c", *s);
+		else if ((u_char)*s < 0x20)
+			printf("\\u%04x", (u_char)*s);
+		else
+			putchar(*s);
+	}
+	putchar('"');
+}
+
+static void
+csv_puts(const char *s)
+{
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"')
+			putchar('"');
+		putchar(*s);
+	}
+	putchar('"');
+}
 
-	return j < 0? NULL : kexjmp_key;
+static void
+latency_put(const char *name, long usec)
+{
+	if (output_format == OF_JSON) {
+		printf(",\"%s\":", name);
+		if (usec < 0)
+			printf("null");
+		else
+			printf("%ld", usec);
+	} else {
+		putchar(',');
+		if (usec >= 0)
+			printf("%ld", usec);
+	}
 }
 
+/*
+ * One record per host and key type: the key or fingerprint on success,
+ * the reason otherwise.
+ */
 static void
-keyprint(con *c, Key *key)
+keyrecord(con *c, Key *key, const char *reason)
 {
-	if (!key)
+	struct timeval now;
+	char *fp = NULL;
+
+	gettimeofday(&now, NULL);
+	if (key != NULL)
+		fp = key_fingerprint(key, SSH_FP_MD5, SSH_FP_HEX);
+
+	if (output_format == OF_JSON) {
+		printf("{\"host\":");
+		json_puts(c->c_output_name ? c->c_output_name : c->c_name);
+		printf(",\"address\":");
+		json_puts(c->c_name);
+		printf(",\"keytype\":\"%s\",\"status\":",
+		    keytype_name(c->c_keytype));
+		json_puts(reason != NULL ? reason : "ok");
+		printf(",\"fingerprint\":");
+		if (fp != NULL)
+			json_puts(fp);
+		else
+			printf("null");
+	} else {
+		csv_puts(c->c_output_name ? c->c_output_name : c->c_name);
+		putchar(',');
+		csv_puts(c->c_name);
+		printf(",%s,", keytype_name(c->c_keytype));
+		csv_puts(reason != NULL ? reason : "ok");
+		putchar(',');
+		if (fp != NULL)
+			csv_puts(fp);
+	}
+	latency_put("connect_us", tvdiff(&c->c_tstart, &c->c_tconn));
+	latency_put("greet_us", tvdiff(&c->c_tconn, &c->c_tgreet));
+	latency_put("kex_us", key != NULL ? tvdiff(&c->c_tgreet, &now) : -1);
+	if (output_format == OF_JSON)
+		putchar('}');
+	putchar('\n');
+	fflush(stdout);
+	if (fp != NULL)
+		xfree(fp);
+}
+
+/*
+ * Checkpoint: a line "keytype host" is appended to the checkpoint file
+ * for every host and key type that is done, successfully or not.  When
+ * the scan is restarted with the same file, those are skipped.
+ */
+#define CKPT_HASHSIZE 4096
+
+struct ckpt {
+	struct ckpt *next;
+	int keytype;
+	char name[1];
+};
+struct ckpt *ckpt_hash[CKPT_HASHSIZE];
+
+static u_int
+ckpt_hashval(const char *name)
+{
+	u_int h = 5381;
+
+	while (*name != '\0')
+		h = h * 33 + (u_char)*name++;
+	return (h % CKPT_HASHSIZE);
+}
+
+static int
+ckpt_lookup(const char *name, int keytype)
+{
+	struct ckpt *ck;
+
+	for (ck = ckpt_hash[ckpt_hashval(name)]; ck != NULL; ck = ck->next)
+		if (ck->keytype == keytype && strcmp(ck->name, name) == 0)
+			return (1);
+	return (0);
+}
+
+static void
+ckpt_add(const char *name, int keytype)
+{
+	struct ckpt *ck;
+	u_int h;
+
+	if (ckpt_lookup(name, keytype))
+		return;
+	h = ckpt_hashval(name);
+	ck = xmalloc(sizeof(*ck) + strlen(name));
+	ck->keytype = keytype;
+	strlcpy(ck->name, name, strlen(name) + 1);
+	ck->next = ckpt_hash[h];
+	ckpt_hash[h] = ck;
+}
+
+static void
+ckpt_load(const char *filename)
+{
+	Linebuf *lb;
+	char *line, *name;
+	int keytype, n = 0;
+
+	if ((ckpt_file = fopen(filename, "a+")) == NULL)
+		fatal("%s: %s", filename, strerror(errno));
+	if ((lb = Linebuf_alloc(filename, error)) == NULL)
+		fatal("%s: cannot read checkpoint", filename);
+	while ((line = Linebuf_getline(lb)) != NULL) {
+		keytype = atoi(line);
+		if ((name = strchr(line, ' ')) == NULL || keytype == 0)
+			continue;
+		ckpt_add(name + 1, keytype);
+		n++;
+	}
+	Linebuf_free(lb);
+	debug("%s: %d hosts already scanned", filename, n);
+}
+
+static void
+ckpt_done(con *c)
+{
+	const char *name = c->c_output_name ? c->c_output_name : c->c_name;
+
+	if (ckpt_file == NULL)
 		return;
+	ckpt_add(name, c->c_keytype);
+	fprintf(ckpt_file, "%d %s\n", c->c_keytype, name);
+	fflush(ckpt_file);
+}
 
-	fprintf(stdout, "%s ", c->c_output_name ? c->c_output_name : c->c_name);
-	key_write(key, stdout);
-	fputs("\n", stdout);
+/* Report the outcome for a host and key type. */
+static void
+conresult(con *c, Key *key, const char *reason)
+{
+	if (output_format != OF_TEXT)
+		keyrecord(c, key, reason);
+	else if (key != NULL) {
+		fprintf(stdout, "%s ", c->c_output_name ? c->c_output_name :
+		    c->c_name);
+		key_write(key, stdout);
+		fputs("\n", stdout);
+	}
+	ckpt_done(c);
 }
 
 static int
@@ -367,8 +758,10 @@ tcpconnect(char *host)
 	memset(&hints, 0, sizeof(hints));
 	hints.ai_family = IPv4or6;
 	hints.ai_socktype = SOCK_STREAM;
-	if ((gaierr = getaddrinfo(host, strport, &hints, &aitop)) != 0)
-		fatal("getaddrinfo %s: %s", host, gai_strerror(gaierr));
+	if ((gaierr = getaddrinfo(host, strport, &hints, &aitop)) != 0) {
+		error("getaddrinfo %s: %s", host, gai_strerror(gaierr));
+		return -1;
+	}
 	for (ai = aitop; ai; ai = ai->ai_next) {
 		s = socket(ai->ai_family, SOCK_STREAM, 0);
 		if (s < 0) {
@@ -389,6 +782,51 @@ tcpconnect(char *host)
 	return s;
 }
 
+static u_int
+tv2ms(struct timeval *tv)
+{
+	return ((tv->tv_sec - wheel_base) * 1000 + tv->tv_usec / 1000);
+}
+
+static struct conlist *
+wheel_slot(con *c)
+{
+	return (&wheel[tv2ms(&c->c_tv) / WHEEL_TICK % WHEEL_SLOTS]);
+}
+
+/* Set the timeout of c and put it in its slot. */
+static void
+wheel_add(con *c)
+{
+	gettimeofday(&c->c_tv, NULL);
+	c->c_tv.tv_sec += timeout;
+	TAILQ_INSERT_TAIL(wheel_slot(c), c, c_link);
+}
+
+static void
+wheel_remove(con *c)
+{
+	TAILQ_REMOVE(wheel_slot(c), c, c_link);
+}
+
+/*
+ * Returns the number of milliseconds until the first occupied slot is
+ * due, or -1 if there are no connections.
+ */
+static int
+wheel_next(u_int now)
+{
+	u_int i, ms;
+
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		if (!TAILQ_EMPTY(&wheel[(wheel_tick + i) % WHEEL_SLOTS]))
+			break;
+	if (i == WHEEL_SLOTS)
+		return (-1);
+	ms = (wheel_tick + i + 1) * WHEEL_TICK;
+	return (ms > now ? ms - now : 0);
+}
+
 static int
 conalloc(char *iname, char *oname, int keytype)
 {
@@ -420,10 +858,13 @@ conalloc(char *iname, char *oname, int keytype)
 	fdcon[s].c_len = 4;
 	fdcon[s].c_off = 0;
 	fdcon[s].c_keytype = keytype;
-	gettimeofday(&fdcon[s].c_tv, NULL);
-	fdcon[s].c_tv.tv_sec += timeout;
-	TAILQ_INSERT_TAIL(&tq, &fdcon[s], c_link);
-	FD_SET(s, read_wait);
+	fdcon[s].c_kexstate = 0;
+	gettimeofday(&fdcon[s].c_tstart, NULL);
+	timerclear(&fdcon[s].c_tconn);
+	timerclear(&fdcon[s].c_tgreet);
+	wheel_add(&fdcon[s]);
+	/* writable once connect() has completed */
+	sshpoll_set(poller, s, SSHPOLL_IN|SSHPOLL_OUT, s);
 	ncon++;
 	return (s);
 }
@@ -433,6 +874,7 @@ confree(int s)
 {
 	if (s >= maxfd || fdcon[s].c_status == CS_UNUSED)
 		fatal("confree: attempt to free bad fdno %d", s);
+	sshpoll_set(poller, s, 0, -1);
 	close(s);
 	xfree(fdcon[s].c_namebase);
 	xfree(fdcon[s].c_output_name);
@@ -440,31 +882,58 @@ confree(int s)
 		xfree(fdcon[s].c_data);
 	fdcon[s].c_status = CS_UNUSED;
 	fdcon[s].c_keytype = 0;
-	TAILQ_REMOVE(&tq, &fdcon[s], c_link);
-	FD_CLR(s, read_wait);
+	wheel_remove(&fdcon[s]);
 	ncon--;
 }
 
 static void
 contouch(int s)
 {
-	TAILQ_REMOVE(&tq, &fdcon[s], c_link);
-	gettimeofday(&fdcon[s].c_tv, NULL);
-	fdcon[s].c_tv.tv_sec += timeout;
-	TAILQ_INSERT_TAIL(&tq, &fdcon[s], c_link);
+	wheel_remove(&fdcon[s]);
+	wheel_add(&fdcon[s]);
 }
 
+/* Give up on this address and try the next one, if any. */
 static int
-conrecycle(int s)
+conrecycle(int s, const char *reason)
 {
 	int ret;
 	con *c = &fdcon[s];
 
 	ret = conalloc(c->c_namelist, c->c_output_name, c->c_keytype);
+	if (ret == -1)
+		conresult(c, NULL, reason);
 	confree(s);
 	return (ret);
 }
 
+static void
+conerror(int s, const char *reason)
+{
+	conresult(&fdcon[s], NULL, reason);
+	confree(s);
+}
+
+/* The descriptor became writable: connect() has finished. */
+static void
+conconnect(int s)
+{
+	int err;
+	socklen_t len = sizeof(err);
+
+	if (getsockopt(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err != 0) {
+		if (err != ECONNREFUSED)
+			error("connect (%s): %s", fdcon[s].c_name,
+			    strerror(err));
+		conrecycle(s, err == ECONNREFUSED ? "refused" : "error");
+		return;
+	}
+	gettimeofday(&fdcon[s].c_tconn, NULL);
+	sshpoll_set(poller, s, SSHPOLL_IN, s);
+}
+
 static void
 congreet(int s)
 {
@@ -484,19 +953,22 @@ congreet(int s)
 	if (n < 0) {
 		if (errno != ECONNREFUSED)
 			error("read (%s): %s", c->c_name, strerror(errno));
-		conrecycle(s);
+		conrecycle(s, errno == ECONNREFUSED ? "refused" : "error");
 		return;
 	}
 	if (n == 0) {
 		error("%s: Connection closed by remote host", c->c_name);
-		conrecycle(s);
+		conrecycle(s, "closed");
 		return;
 	}
 	if (*cp != '\n' && *cp != '\r') {
 		error("%s: bad greeting", c->c_name);
-		confree(s);
+		conerror(s, "bad greeting");
 		return;
 	}
+	gettimeofday(&c->c_tgreet, NULL);
+	if (!timerisset(&c->c_tconn))
+		c->c_tconn = c->c_tgreet;
 	*cp = '\0';
 	if (sscanf(buf, "SSH-%d.%d-%[^\n]\n",
 	    &remote_major, &remote_minor, remote_version) == 3)
@@ -506,12 +978,12 @@ congreet(int s)
 	if (c->c_keytype != KT_RSA1) {
 		if (!ssh2_capable(remote_major, remote_minor)) {
 			debug("%s doesn't support ssh2", c->c_name);
-			confree(s);
+			conerror(s, "protocol");
 			return;
 		}
 	} else if (remote_major != 1) {
 		debug("%s doesn't support ssh1", c->c_name);
-		confree(s);
+		conerror(s, "protocol");
 		return;
 	}
 	fprintf(stderr, "# %s %s\n", c->c_name, chop(buf));
@@ -520,13 +992,15 @@ congreet(int s)
 	    c->c_keytype == KT_RSA1? PROTOCOL_MINOR_1 : PROTOCOL_MINOR_2);
 	if (atomicio(write, s, buf, n) != n) {
 		error("write (%s): %s", c->c_name, strerror(errno));
-		confree(s);
+		conerror(s, "error");
 		return;
 	}
 	if (c->c_keytype != KT_RSA1) {
-		keyprint(c, keygrab_ssh2(c));
-		confree(s);
-		return;
+		if (ssh2_send_kexinit(c) < 0) {
+			conerror(s, "error");
+			return;
+		}
+		c->c_kexstate = KS_KEXINIT;
 	}
 	c->c_status = CS_SIZE;
 	contouch(s);
@@ -537,6 +1011,7 @@ conread(int s)
 {
 	int n;
 	con *c = &fdcon[s];
+	Key *key;
 
 	if (c->c_status == CS_CON) {
 		congreet(s);
@@ -544,8 +1019,15 @@ conread(int s)
 	}
 	n = read(s, c->c_data + c->c_off, c->c_len - c->c_off);
 	if (n < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
 		error("read (%s): %s", c->c_name, strerror(errno));
-		confree(s);
+		conerror(s, "error");
+		return;
+	}
+	if (n == 0) {
+		error("%s: Connection closed by remote host", c->c_name);
+		conerror(s, "closed");
 		return;
 	}
 	c->c_off += n;
@@ -554,15 +1036,40 @@ conread(int s)
 		switch (c->c_status) {
 		case CS_SIZE:
 			c->c_plen = htonl(c->c_plen);
-			c->c_len = c->c_plen + 8 - (c->c_plen & 7);
+			if (c->c_keytype == KT_RSA1)
+				c->c_len = c->c_plen + 8 - (c->c_plen & 7);
+			else if (c->c_plen < 5 || c->c_plen > KEX_MAX_PACKET) {
+				error("%s: bad packet length %d", c->c_name,
+				    c->c_plen);
+				conerror(s, "kex");
+				return;
+			} else
+				c->c_len = c->c_plen;
 			c->c_off = 0;
 			c->c_data = xmalloc(c->c_len);
 			c->c_status = CS_KEYS;
 			break;
 		case CS_KEYS:
-			keyprint(c, keygrab_ssh1(c));
-			confree(s);
-			return;
+			if (c->c_keytype == KT_RSA1) {
+				key = keygrab_ssh1(c);
+				conresult(c, key, key == NULL ? "kex" : NULL);
+				confree(s);
+				return;
+			}
+			key = NULL;
+			if ((n = keygrab_ssh2(c, &key)) != 0) {
+				conresult(c, key, key == NULL ? "kex" : NULL);
+				if (key != NULL)
+					key_free(key);
+				confree(s);
+				return;
+			}
+			/* wait for the next packet */
+			xfree(c->c_data);
+			c->c_data = (char *) &c->c_plen;
+			c->c_len = 4;
+			c->c_off = 0;
+			c->c_status = CS_SIZE;
 			break;
 		default:
 			fatal("conread: invalid status %d", c->c_status);
@@ -575,52 +1082,42 @@ conread(int s)
 static void
 conloop(void)
 {
-	fd_set *r, *e;
-	struct timeval seltime, now;
-	int i;
-	con *c;
+	struct timeval now;
+	struct conlist *slot;
+	u_int revents, ms;
+	int i, fd, tag;
+	con *c, *next;
 
 	gettimeofday(&now, NULL);
-	c = TAILQ_FIRST(&tq);
-
-	if (c && (c->c_tv.tv_sec > now.tv_sec ||
-	    (c->c_tv.tv_sec == now.tv_sec && c->c_tv.tv_usec > now.tv_usec))) {
-		seltime = c->c_tv;
-		seltime.tv_sec -= now.tv_sec;
-		seltime.tv_usec -= now.tv_usec;
-		if (seltime.tv_usec < 0) {
-			seltime.tv_usec += 1000000;
-			seltime.tv_sec--;
-		}
-	} else
-		seltime.tv_sec = seltime.tv_usec = 0;
-
-	r = xmalloc(read_wait_size);
-	memcpy(r, read_wait, read_wait_size);
-	e = xmalloc(read_wait_size);
-	memcpy(e, read_wait, read_wait_size);
-
-	while (select(maxfd, r, NULL, e, &seltime) == -1 &&
+	while (sshpoll_wait(poller, wheel_next(tv2ms(&now))) == -1 &&
 	    (errno == EAGAIN || errno == EINTR))
 		;
 
-	for (i = 0; i < maxfd; i++) {
-		if (FD_ISSET(i, e)) {
-			error("%s: exception!", fdcon[i].c_name);
-			confree(i);
-		} else if (FD_ISSET(i, r))
-			conread(i);
+	for (i = 0; i < sshpoll_nready(poller); i++) {
+		/* skip descriptors recycled by an earlier conread() */
+		if (sshpoll_ready(poller, i, &fd, &revents, &tag) == -1 ||
+		    revents == 0)
+			continue;
+		if (revents & SSHPOLL_OUT) {
+			conconnect(fd);
+			revents = sshpoll_revents(poller, fd);
+		}
+		if (revents & SSHPOLL_IN)
+			conread(fd);
 	}
-	xfree(r);
-	xfree(e);
-
-	c = TAILQ_FIRST(&tq);
-	while (c && (c->c_tv.tv_sec < now.tv_sec ||
-	    (c->c_tv.tv_sec == now.tv_sec && c->c_tv.tv_usec < now.tv_usec))) {
-		int s = c->c_fd;
 
-		c = TAILQ_NEXT(c, c_link);
-		conrecycle(s);
+	/* expire the connections of the ticks that have passed */
+	gettimeofday(&now, NULL);
+	ms = tv2ms(&now);
+	if (ms / WHEEL_TICK - wheel_tick > WHEEL_SLOTS)
+		wheel_tick = ms / WHEEL_TICK - WHEEL_SLOTS;
+	for (; wheel_tick < ms / WHEEL_TICK; wheel_tick++) {
+		slot = &wheel[wheel_tick % WHEEL_SLOTS];
+		for (c = TAILQ_FIRST(slot); c != NULL; c = next) {
+			next = TAILQ_NEXT(c, c_link);
+			if (tv2ms(&c->c_tv) < ms)
+				conrecycle(c->c_fd, "timeout");
+		}
 	}
 }
 
@@ -628,15 +1125,27 @@ static void
 do_host(char *host)
 {
 	char *name = strnnsep(&host, " \t\n");
+	char *oname;
+	con c;
 	int j;
 
 	if (name == NULL)
 		return;
+	oname = *host ? host : name;
 	for (j = KT_RSA1; j <= KT_RSA; j *= 2) {
 		if (get_keytypes & j) {
+			if (ckpt_file != NULL && ckpt_lookup(oname, j))
+				continue;
 			while (ncon >= MAXCON)
 				conloop();
-			conalloc(name, *host ? host : name, j);
+			if (conalloc(name, oname, j) == -1) {
+				/* no address could be connected to */
+				memset(&c, 0, sizeof(c));
+				c.c_name = name;
+				c.c_output_name = oname;
+				c.c_keytype = j;
+				conresult(&c, NULL, "connect");
+			}
 		}
 	}
 }
@@ -667,6 +1176,8 @@ usage(void)
 	fprintf(stderr, "  -v          Verbose; display verbose debugging messages.\n");
 	fprintf(stderr, "  -4          Use IPv4 only.\n");
 	fprintf(stderr, "  -6          Use IPv6 only.\n");
+	fprintf(stderr, "  -O format   Output one json or csv record per host and key type.\n");
+	fprintf(stderr, "  -c file     Skip hosts listed in, and add scanned hosts to, checkpoint file.\n");
 	exit(1);
 }
 
@@ -674,18 +1185,21 @@ int
 main(int argc, char **argv)
 {
 	int debug_flag = 0, log_level = SYSLOG_LEVEL_INFO;
-	int opt, fopt_count = 0;
-	char *tname;
+	int opt, fopt_count = 0, i;
+	char *tname, *ckpt_name = NULL;
 
 	extern int optind;
 	extern char *optarg;
 
-	TAILQ_INIT(&tq);
+	for (i = 0; i < WHEEL_SLOTS; i++)
+		TAILQ_INIT(&wheel[i]);
+	wheel_base = time(NULL);
+	wheel_tick = 0;
 
 	if (argc <= 1)
 		usage();
 
-	while ((opt = getopt(argc, argv, "v46p:T:t:f:")) != -1) {
+	while ((opt = getopt(argc, argv, "v46p:T:t:f:O:c:")) != -1) {
 		switch (opt) {
 		case 'p':
 			ssh_port = a2port(optarg);
@@ -735,6 +1249,17 @@ main(int argc, char **argv)
 				tname = strtok(NULL, ",");
 			}
 			break;
+		case 'O':
+			if (strcmp(optarg, "json") == 0)
+				output_format = OF_JSON;
+			else if (strcmp(optarg, "csv") == 0)
+				output_format = OF_CSV;
+			else
+				usage();
+			break;
+		case 'c':
+			ckpt_name = optarg;
+			break;
 		case '4':
 			IPv4or6 = AF_INET;
 			break;
@@ -751,6 +1276,12 @@ main(int argc, char **argv)
 
 	log_init("ssh-keyscan", log_level, SYSLOG_FACILITY_USER, 1);
 
+	if (ckpt_name != NULL)
+		ckpt_load(ckpt_name);
+	if (output_format == OF_CSV)
+		printf("host,address,keytype,status,fingerprint,"
+		    "connect_us,greet_us,kex_us\n");
+
 	maxfd = fdlim_get(1);
 	if (maxfd < 0)
 		fatal("%s: fdlim_get: bad value", __progname);
@@ -763,9 +1294,7 @@ main(int argc, char **argv)
 	fdcon = xmalloc(maxfd * sizeof(con));
 	memset(fdcon, 0, maxfd * sizeof(con));
 
-	read_wait_size = howmany(maxfd, NFDBITS) * sizeof(fd_mask);
-	read_wait = xmalloc(read_wait_size);
-	memset(read_wait, 0, read_wait_size);
+	poller = sshpoll_new();
 
 	if (fopt_count) {
 		Linebuf *lb;
@@ -68,6 +68,7 @@ RCSID("$OpenBSD: ssh.c,v 1.179 2002/06/12 01:09:52 markus Exp $");
 #include "kex.h"
 #include "mac.h"
 #include "sshtty.h"
+#include "mux.h"
 
 #ifdef SMARTCARD
 #include "scard.h"
@@ -103,6 +104,13 @@ int stdin_null_flag = 0;
  */
 int fork_after_authentication_flag = 0;
 
+/*
+ * Control socket for connection multiplexing.  A master listens on it;
+ * otherwise a running master is used instead of a new connection.
+ */
+char *control_path = NULL;
+int control_master_flag = 0;
+
 /*
  * General data structure for command line options and options configurable
  * in configuration files.  See readconf.h.
@@ -181,6 +189,8 @@ usage(void)
 	fprintf(stderr, "  -D port     Enable dynamic application-level port forwarding.\n");
 	fprintf(stderr, "  -C          Enable compression.\n");
 	fprintf(stderr, "  -N          Do not execute a shell or command.\n");
+	fprintf(stderr, "  -M          Act as master for connection multiplexing.\n");
+	fprintf(stderr, "  -S path     Control socket for connection multiplexing.\n");
 	fprintf(stderr, "  -g          Allow remote hosts to connect to forwarded ports.\n");
 	fprintf(stderr, "  -1          Force protocol version 1.\n");
 	fprintf(stderr, "  -2          Force protocol version 2.\n");
@@ -260,7 +270,7 @@ main(int ac, char **av)
 
 again:
 	while ((opt = getopt(ac, av,
-	    "1246ab:c:e:fgi:kl:m:no:p:qstvxACD:F:I:L:NPR:TVX")) != -1) {
+	    "1246ab:c:e:fgi:kl:m:no:p:qstvxACD:F:I:L:MNPR:S:TVX")) != -1) {
 		switch (opt) {
 		case '1':
 			options.protocol = SSH_PROTO_1;
@@ -471,6 +481,12 @@ again:
 		case 'F':
 			config = optarg;
 			break;
+		case 'M':
+			control_master_flag = 1;
+			break;
+		case 'S':
+			control_path = optarg;
+			break;
 		default:
 			usage();
 		}
@@ -591,6 +607,12 @@ again:
 		    "originating port will not be trusted.");
 		options.rhosts_authentication = 0;
 	}
+	/* Reuse the connection of a running master, if there is one. */
+	if (control_master_flag && control_path == NULL)
+		fatal("A control master needs a control socket (-S).");
+	if (control_path != NULL && !control_master_flag)
+		muxclient(control_path);
+
 	/* Open a connection to the remote host. */
 
 	if (ssh_connect(host, &hostaddr, options.port, IPv4or6,
@@ -812,6 +834,9 @@ ssh_session(void)
 	struct winsize ws;
 	char *cp;
 
+	if (control_master_flag)
+		log("Connection multiplexing needs protocol version 2.");
+
 	/* Enable compression if requested. */
 	if (options.compression) {
 		debug("Requesting compression at level %d.", options.compression_level);
@@ -1101,11 +1126,14 @@ ssh_session2_open(void)
 static int
 ssh_session2(void)
 {
-	int id = -1;
+	int id = -1, ret;
 
 	/* XXX should be pre-session */
 	ssh_init_forwarding();
 
+	if (control_master_flag)
+		muxserver_listen(control_path);
+
 	if (!no_shell_flag || (datafellows & SSH_BUG_DUMMYCHAN))
 		id = ssh_session2_open();
 
@@ -1114,8 +1142,10 @@ ssh_session2(void)
 		if (daemon(1, 1) < 0)
 			fatal("daemon() failed: %.200s", strerror(errno));
 
-	return client_loop(tty_flag, tty_flag ?
+	ret = client_loop(tty_flag, tty_flag ?
 	    options.escape_char : SSH_ESCAPECHAR_NONE, id);
+	muxserver_close();
+	return ret;
 }
 
 static void
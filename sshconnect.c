@@ -17,6 +17,8 @@ RCSID("$OpenBSD: sshconnect.c,v 1.125 2002/06/19 00:27:55 deraadt Exp $");
 
 #include <openssl/bn.h>
 
+#include <poll.h>
+
 #include "ssh.h"
 #include "xmalloc.h"
 #include "rsa.h"
@@ -32,6 +34,7 @@ RCSID("$OpenBSD: sshconnect.c,v 1.125 2002/06/19 00:27:55 deraadt Exp $");
 #include "atomicio.h"
 #include "misc.h"
 #include "readpass.h"
+#include "addrorder.h"
 
 char *client_version_string = NULL;
 char *server_version_string = NULL;
@@ -207,6 +210,145 @@ ssh_create_socket(int privileged, int family)
 	return sock;
 }
 
+/* delay before starting the next connection attempt, ms (RFC 8305) */
+#define CONNECT_ATTEMPT_DELAY	250
+
+/*
+ * Start connecting to ai without blocking.  Returns the socket, or -1 if
+ * the attempt failed right away.  *donep is set if it already succeeded.
+ */
+static int
+ssh_connect_start(const char *host, struct addrinfo *ai, int needpriv,
+    int *donep, int *full_failure)
+{
+	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
+	int sock;
+
+	*donep = 0;
+	if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+	    ntop, sizeof(ntop), strport, sizeof(strport),
+	    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+		error("ssh_connect: getnameinfo failed");
+		return -1;
+	}
+	debug("Connecting to %.200s [%.100s] port %s.",
+		host, ntop, strport);
+
+	/* Create a socket for connecting. */
+	sock = ssh_create_socket(needpriv, ai->ai_family);
+	if (sock < 0)
+		/* Any error is already output */
+		return -1;
+	if (fcntl(sock, F_SETFL, O_NONBLOCK) < 0)
+		fatal("ssh_connect: F_SETFL: %s", strerror(errno));
+	if (connect(sock, ai->ai_addr, ai->ai_addrlen) >= 0) {
+		*donep = 1;
+		return sock;
+	}
+	if (errno == EINPROGRESS)
+		return sock;
+	if (errno == ECONNREFUSED)
+		*full_failure = 0;
+	log("ssh: connect to address %s port %s: %s", ntop, strport,
+	    strerror(errno));
+	close(sock);
+	return -1;
+}
+
+/*
+ * Connect to the addresses of aitop in the manner of RFC 8305: the
+ * address families alternate, and a new attempt is started whenever the
+ * previous one failed or has not completed within CONNECT_ATTEMPT_DELAY,
+ * while the earlier attempts continue.  The first connection to complete
+ * wins.  Returns its socket in blocking mode, or -1.
+ */
+static int
+ssh_connect_race(const char *host, u_short port, struct addrinfo *aitop,
+    int needpriv, struct sockaddr_storage *hostaddr, int *full_failure)
+{
+	struct addrinfo *ai, **addrs;
+	struct pollfd *pfd;
+	int *which, i, n, next, npending, done, sock = -1, err, win = -1;
+	socklen_t sz;
+
+	for (n = 0, ai = aitop; ai; ai = ai->ai_next)
+		n++;
+	if (n == 0)
+		return -1;
+	addrs = xmalloc(n * sizeof(*addrs));
+	pfd = xmalloc(n * sizeof(*pfd));
+	which = xmalloc(n * sizeof(*which));
+
+	/* interleave the families, starting with the preferred one */
+	n = addrinfo_interleave(aitop, addrs, n);
+
+	for (next = npending = 0; win == -1;) {
+		/* start the next attempt */
+		while (next < n) {
+			sock = ssh_connect_start(host, addrs[next], needpriv,
+			    &done, full_failure);
+			if (sock == -1) {
+				next++;
+				continue;
+			}
+			if (done) {
+				win = next++;
+				break;
+			}
+			pfd[npending].fd = sock;
+			pfd[npending].events = POLLOUT;
+			which[npending++] = next++;
+			break;
+		}
+		if (win != -1 || npending == 0)
+			break;
+
+		i = poll(pfd, npending, next < n ? CONNECT_ATTEMPT_DELAY : -1);
+		if (i == -1 && errno != EINTR)
+			fatal("ssh_connect: poll: %.100s", strerror(errno));
+		if (i <= 0)
+			continue;
+		for (i = 0; i < npending && win == -1; i++) {
+			if (pfd[i].revents == 0)
+				continue;
+			sz = sizeof(err);
+			if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR,
+			    &err, &sz) < 0)
+				err = errno;
+			if (err == 0) {
+				sock = pfd[i].fd;
+				win = which[i];
+				pfd[i] = pfd[--npending];
+				which[i] = which[npending];
+				break;
+			}
+			if (err == ECONNREFUSED)
+				*full_failure = 0;
+			ai = addrs[which[i]];
+			log("ssh: connect to address %s port %u: %s",
+			    sockaddr_ntop(ai->ai_addr, ai->ai_addrlen),
+			    port, strerror(err));
+			close(pfd[i].fd);
+			pfd[i] = pfd[--npending];
+			which[i] = which[npending];
+			i--;
+		}
+	}
+	/* the losers */
+	for (i = 0; i < npending; i++)
+		close(pfd[i].fd);
+	if (win != -1) {
+		memcpy(hostaddr, addrs[win]->ai_addr, addrs[win]->ai_addrlen);
+		if (fcntl(sock, F_SETFL, 0) < 0)
+			fatal("ssh_connect: F_SETFL: %s", strerror(errno));
+	} else
+		sock = -1;
+	xfree(addrs);
+	xfree(pfd);
+	xfree(which);
+	return sock;
+}
+
 /*
  * Opens a TCP/IP connection to the remote server on the given host.
  * The address of the remote host will be returned in hostaddr.
@@ -232,8 +374,8 @@ ssh_connect(const char *host, struct sockaddr_storage * hostaddr,
 	int gaierr;
 	int on = 1;
 	int sock = -1, attempt;
-	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
-	struct addrinfo hints, *ai, *aitop;
+	char strport[NI_MAXSERV];
+	struct addrinfo hints, *aitop;
 	struct linger linger;
 	struct servent *sp;
 	/*
@@ -276,46 +418,10 @@ ssh_connect(const char *host, struct sockaddr_storage * hostaddr,
 		if (attempt > 0)
 			debug("Trying again...");
 
-		/* Loop through addresses for this host, and try each one in
-		   sequence until the connection succeeds. */
-		for (ai = aitop; ai; ai = ai->ai_next) {
-			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
-				continue;
-			if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
-			    ntop, sizeof(ntop), strport, sizeof(strport),
-			    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-				error("ssh_connect: getnameinfo failed");
-				continue;
-			}
-			debug("Connecting to %.200s [%.100s] port %s.",
-				host, ntop, strport);
-
-			/* Create a socket for connecting. */
-			sock = ssh_create_socket(needpriv, ai->ai_family);
-			if (sock < 0)
-				/* Any error is already output */
-				continue;
-
-			if (connect(sock, ai->ai_addr, ai->ai_addrlen) >= 0) {
-				/* Successful connection. */
-				memcpy(hostaddr, ai->ai_addr, ai->ai_addrlen);
-				break;
-			} else {
-				if (errno == ECONNREFUSED)
-					full_failure = 0;
-				log("ssh: connect to address %s port %s: %s",
-				    sockaddr_ntop(ai->ai_addr, ai->ai_addrlen),
-				    strport, strerror(errno));
-				/*
-				 * Close the failed socket; there appear to
-				 * be some problems when reusing a socket for
-				 * which connect() has already returned an
-				 * error.
-				 */
-				close(sock);
-			}
-		}
-		if (ai)
+		/* Race the addresses of this host against each other. */
+		sock = ssh_connect_race(host, port, aitop, needpriv, hostaddr,
+		    &full_failure);
+		if (sock != -1)
 			break;	/* Successful connection. */
 
 		attempt++;
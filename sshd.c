@@ -44,6 +44,9 @@
 #include "includes.h"
 RCSID("$OpenBSD: sshd.c,v 1.246 2002/06/20 23:05:56 markus Exp $");
 
+#include <sys/mman.h>
+#include <poll.h>
+
 #include <openssl/dh.h>
 #include <openssl/bn.h>
 #include <openssl/md5.h>
@@ -173,6 +176,7 @@ static volatile sig_atomic_t key_do_regen = 0;
 /* This is set to true when a signal is received. */
 static volatile sig_atomic_t received_sighup = 0;
 static volatile sig_atomic_t received_sigterm = 0;
+static volatile sig_atomic_t received_sigusr1 = 0;
 
 /* session identifier, used by RSA-auth */
 u_char session_id[16];
@@ -187,6 +191,58 @@ u_int utmp_len = MAXHOSTNAMELEN;
 /* options.max_startup sized array of fd ints */
 int *startup_pipes = NULL;
 int startup_pipe;		/* in child */
+int worker_pipe = -1;		/* in child, see accept_worker_orphan() */
+
+/* time the connection was accepted, for the startup latency report */
+static struct timeval accept_tv;
+
+/*
+ * Idle children forked ahead of time, each waiting for a connection on
+ * its end of a socket pair.  options.prefork_children sized.
+ */
+struct prefork_child {
+	pid_t	pid;
+	int	fd;		/* our end of the socket pair, or -1 */
+};
+static struct prefork_child *prefork = NULL;
+static int prefork_idle = 0;
+
+/*
+ * With AcceptWorkers, each worker process accepts on its own SO_REUSEPORT
+ * listen sockets and the master only supervises them.  The number of
+ * unauthenticated connections is kept per worker in shared memory, so
+ * that MaxStartups still applies to the daemon as a whole.
+ */
+static int accept_worker = -1;		/* our index, -1 if not a worker */
+static pid_t *worker_pids = NULL;
+static time_t *worker_started = NULL;
+static volatile int *worker_startups = NULL;
+
+/*
+ * Each generation of a worker gets a pipe; the worker and its children
+ * hold the write end until they are authenticated, the master keeps the
+ * read end in worker_gen.  When a worker dies its unauthenticated
+ * children stay counted in its slot until EOF on that pipe.
+ */
+struct worker_orphans {
+	int	slot;
+	int	fd;
+	int	count;
+};
+static int *worker_gen = NULL;
+static struct worker_orphans *worker_orphans = NULL;
+static int worker_norphans = 0;
+
+/* accept to banner latency, in microseconds, as reported by the children */
+#define STARTUP_HIST	6	/* <1ms <10ms <100ms <1s <10s >=10s */
+static struct {
+	u_int	handoffs;	/* connections given to a pre-forked child */
+	u_int	forks;		/* connections that needed a fork */
+	u_int	reports;
+	u_int64_t usec_total;
+	u_int32_t usec_max;
+	u_int	hist[STARTUP_HIST];
+} startup_stats;
 
 /* variables used for privilege separation */
 extern struct monitor *pmonitor;
@@ -198,6 +254,7 @@ void demote_sensitive_data(void);
 
 static void do_ssh1_kex(void);
 static void do_ssh2_kex(void);
+static void startup_report_latency(void);
 
 /*
  * Close all listening sockets
@@ -221,6 +278,29 @@ close_startup_pipes(void)
 				close(startup_pipes[i]);
 }
 
+/*
+ * Close our ends of the pre-forked children's socket pairs.  The idle
+ * children exit once they see the connection go away; the master asks
+ * them to do so right away.
+ */
+static void
+close_prefork_socks(int kill_idle)
+{
+	int i;
+
+	if (prefork == NULL)
+		return;
+	for (i = 0; i < options.prefork_children; i++) {
+		if (prefork[i].fd == -1)
+			continue;
+		if (kill_idle)
+			kill(prefork[i].pid, SIGTERM);
+		close(prefork[i].fd);
+		prefork[i].fd = -1;
+	}
+	prefork_idle = 0;
+}
+
 /*
  * Signal handler for SIGHUP.  Sshd execs itself when it receives SIGHUP;
  * the effect is to reread the configuration file (and to regenerate
@@ -246,6 +326,7 @@ sighup_restart(void)
 	log("Received SIGHUP; restarting.");
 	close_listen_socks();
 	close_startup_pipes();
+	close_prefork_socks(1);
 	execv(saved_argv[0], saved_argv);
 	log("RESTART FAILED: av[0]='%.100s', error: %.100s.", saved_argv[0], strerror(errno));
 	exit(1);
@@ -260,6 +341,32 @@ sigterm_handler(int sig)
 	received_sigterm = sig;
 }
 
+/*
+ * SIGCHLD handler of the accept worker master, which reaps its children
+ * itself.  It only needs to interrupt sigsuspend().
+ */
+static void
+master_sigchld_handler(int sig)
+{
+	int save_errno = errno;
+
+	signal(SIGCHLD, master_sigchld_handler);
+	errno = save_errno;
+}
+
+/*
+ * SIGUSR1 makes the master daemon log its connection startup statistics.
+ */
+static void
+sigusr1_handler(int sig)
+{
+	int save_errno = errno;
+
+	received_sigusr1 = 1;
+	signal(SIGUSR1, sigusr1_handler);
+	errno = save_errno;
+}
+
 /*
  * SIGCHLD handler.  This is called whenever a child dies.  This will then
  * reap any zombies left by exited children.
@@ -364,6 +471,7 @@ sshd_exchange_identification(int sock_in, int sock_out)
 			log("Could not write ident string to %s", get_remote_ipaddr());
 			fatal_cleanup();
 		}
+		startup_report_latency();
 
 		/* Read other sides version identification. */
 		memset(buf, 0, sizeof(buf));
@@ -609,6 +717,10 @@ privsep_postauth(Authctxt *authctxt)
 		close(startup_pipe);
 		startup_pipe = -1;
 	}
+	if (worker_pipe != -1) {
+		close(worker_pipe);
+		worker_pipe = -1;
+	}
 
 	/* New socket pair */
 	monitor_reinit(pmonitor);
@@ -726,6 +838,534 @@ drop_connection(int startups)
 	return (r < p) ? 1 : 0;
 }
 
+/*
+ * Publish our number of unauthenticated connections; called whenever it
+ * changes so that the other workers never see a stale count.  Each
+ * worker only writes its own slot.
+ */
+static void
+startups_publish(int startups)
+{
+	if (worker_startups != NULL)
+		worker_startups[accept_worker] = startups;
+}
+
+/* Return the number of unauthenticated connections of the whole daemon. */
+static int
+startups_total(int startups)
+{
+	int i, total;
+
+	if (worker_startups == NULL)
+		return (startups);
+	for (total = 0, i = 0; i < options.accept_workers; i++)
+		total += worker_startups[i];
+	return (total);
+}
+
+/*
+ * Create the listen sockets for options.listen_addrs.  Accept workers
+ * bind the same addresses, so SO_REUSEPORT lets the kernel spread the
+ * incoming connections over them.
+ */
+static void
+server_listen(void)
+{
+	struct addrinfo *ai;
+	struct linger linger;
+	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
+	int listen_sock, on = 1;
+
+	for (ai = options.listen_addrs; ai; ai = ai->ai_next) {
+		if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+			continue;
+		if (num_listen_socks >= MAX_LISTEN_SOCKS)
+			fatal("Too many listen sockets. "
+			    "Enlarge MAX_LISTEN_SOCKS");
+		if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
+		    ntop, sizeof(ntop), strport, sizeof(strport),
+		    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
+			error("getnameinfo failed");
+			continue;
+		}
+		/* Create socket for listening. */
+		listen_sock = socket(ai->ai_family, SOCK_STREAM, 0);
+		if (listen_sock < 0) {
+			/* kernel may not support ipv6 */
+			verbose("socket: %.100s", strerror(errno));
+			continue;
+		}
+		if (fcntl(listen_sock, F_SETFL, O_NONBLOCK) < 0) {
+			error("listen_sock O_NONBLOCK: %s", strerror(errno));
+			close(listen_sock);
+			continue;
+		}
+		/*
+		 * Set socket options.  We try to make the port
+		 * reusable and have it close as fast as possible
+		 * without waiting in unnecessary wait states on
+		 * close.
+		 */
+		setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
+		    &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		if (options.accept_workers > 0 &&
+		    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT,
+		    &on, sizeof(on)) < 0)
+			error("setsockopt SO_REUSEPORT: %.100s",
+			    strerror(errno));
+#endif
+		linger.l_onoff = 1;
+		linger.l_linger = 5;
+		setsockopt(listen_sock, SOL_SOCKET, SO_LINGER,
+		    &linger, sizeof(linger));
+
+		debug("Bind to port %s on %s.", strport, ntop);
+
+		/* Bind the socket to the desired port. */
+		if (bind(listen_sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+			error("Bind to port %s on %s failed: %.200s.",
+			    strport, ntop, strerror(errno));
+			close(listen_sock);
+			continue;
+		}
+		listen_socks[num_listen_socks] = listen_sock;
+		num_listen_socks++;
+
+		/* Start listening on the port. */
+		log("Server listening on %s port %s.", ntop, strport);
+		if (listen(listen_sock, options.listen_backlog) < 0)
+			fatal("listen: %.100s", strerror(errno));
+	}
+	if (!num_listen_socks)
+		fatal("Cannot bind any address.");
+}
+
+static void
+accept_workers_kill(int sig)
+{
+	int i;
+
+	for (i = 0; i < options.accept_workers; i++)
+		if (worker_pids[i] > 0)
+			kill(worker_pids[i], sig);
+}
+
+/*
+ * Fork accept worker idx.  Returns 1 in the worker, 0 in the master.
+ * The first worker takes over the master's listen sockets, the others
+ * bind their own.
+ */
+static int
+accept_worker_spawn(int idx, sigset_t *omask)
+{
+	pid_t pid;
+	int i, gen[2];
+
+	if (pipe(gen) == -1) {
+		error("pipe: %.100s", strerror(errno));
+		worker_pids[idx] = -1;
+		return (0);
+	}
+	if ((pid = fork()) == -1) {
+		error("fork: %.100s", strerror(errno));
+		close(gen[0]);
+		close(gen[1]);
+		worker_pids[idx] = -1;
+		return (0);
+	}
+	if (pid != 0) {
+		debug("Forked accept worker %d, pid %ld.", idx, (long)pid);
+		close(gen[1]);
+		worker_gen[idx] = gen[0];
+		worker_pids[idx] = pid;
+		worker_started[idx] = time(NULL);
+		arc4random_stir();
+		return (0);
+	}
+	accept_worker = idx;
+	close(gen[0]);
+	worker_pipe = gen[1];
+	for (i = 0; i < options.accept_workers; i++)
+		if (worker_gen[i] != -1)
+			close(worker_gen[i]);
+	xfree(worker_gen);
+	xfree(worker_pids);
+	xfree(worker_started);
+	worker_gen = NULL;
+	worker_pids = NULL;
+	worker_started = NULL;
+	log_init(__progname, options.log_level, options.log_facility,
+	    log_stderr);
+	/* the master takes care of SIGHUP */
+	signal(SIGHUP, SIG_IGN);
+	signal(SIGCHLD, main_sigchld_handler);
+	sigprocmask(SIG_SETMASK, omask, NULL);
+	if (idx != 0)
+		close_listen_socks();
+	if (num_listen_socks < 0) {
+		num_listen_socks = 0;
+		server_listen();
+	}
+	if (options.protocol & SSH_PROTO_1)
+		generate_ephemeral_server_key();
+	return (1);
+}
+
+/*
+ * Accept worker idx has died.  Its unauthenticated children live on, so
+ * their count stays in the slot, along with the read end of the pipe of
+ * that generation, until they have all reported in.  Older generations
+ * of the slot that are done by now are dropped.
+ */
+static void
+accept_worker_orphan(int idx)
+{
+	struct pollfd pfd;
+	int i, count, older = 0;
+
+	for (i = 0; i < worker_norphans; i++) {
+		if (worker_orphans[i].slot != idx)
+			continue;
+		/* nobody writes to the pipe, so readable means EOF */
+		pfd.fd = worker_orphans[i].fd;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) != 1) {
+			older += worker_orphans[i].count;
+			continue;
+		}
+		close(worker_orphans[i].fd);
+		worker_orphans[i--] = worker_orphans[--worker_norphans];
+	}
+	count = worker_startups[idx] - older;
+	if (count > 0) {
+		worker_orphans = xrealloc(worker_orphans,
+		    (worker_norphans + 1) * sizeof(struct worker_orphans));
+		worker_orphans[worker_norphans].slot = idx;
+		worker_orphans[worker_norphans].fd = worker_gen[idx];
+		worker_orphans[worker_norphans].count = count;
+		worker_norphans++;
+		older += count;
+	} else
+		close(worker_gen[idx]);
+	worker_gen[idx] = -1;
+	worker_startups[idx] = older;
+	if (older > 0)
+		log("Accept worker %d left %d unauthenticated connections.",
+		    idx, older);
+}
+
+/*
+ * In a new worker, take over the orphans of our slot: every one of them
+ * occupies a startup pipe slot, a duplicate of the read end of its
+ * generation pipe.  Returns the number of slots taken.
+ */
+static int
+accept_worker_adopt(int *maxfdp)
+{
+	int i, j, fd, n = 0;
+
+	for (i = 0; i < worker_norphans; i++) {
+		for (j = 0; worker_orphans[i].slot == accept_worker &&
+		    j < worker_orphans[i].count && n < options.max_startups;
+		    j++) {
+			if ((fd = dup(worker_orphans[i].fd)) == -1) {
+				error("dup: %.100s", strerror(errno));
+				break;
+			}
+			startup_pipes[n++] = fd;
+			if (fd > *maxfdp)
+				*maxfdp = fd;
+		}
+		close(worker_orphans[i].fd);
+	}
+	if (worker_orphans != NULL)
+		xfree(worker_orphans);
+	worker_orphans = NULL;
+	worker_norphans = 0;
+	startups_publish(n);
+	return (n);
+}
+
+/*
+ * Start the accept workers and supervise them, restarting the ones that
+ * die.  Only returns in the workers.
+ */
+static void
+accept_workers_start(void)
+{
+	sigset_t nmask, omask;
+	pid_t pid;
+	int i, status;
+
+	worker_startups = mmap(NULL, options.accept_workers * sizeof(int),
+	    PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED, -1, 0);
+	if (worker_startups == MAP_FAILED)
+		fatal("mmap(%lu): %.100s",
+		    (u_long)(options.accept_workers * sizeof(int)),
+		    strerror(errno));
+	worker_pids = xmalloc(options.accept_workers * sizeof(pid_t));
+	worker_started = xmalloc(options.accept_workers * sizeof(time_t));
+	worker_gen = xmalloc(options.accept_workers * sizeof(int));
+	for (i = 0; i < options.accept_workers; i++)
+		worker_gen[i] = -1;
+
+	signal(SIGCHLD, master_sigchld_handler);
+	sigemptyset(&nmask);
+	sigaddset(&nmask, SIGCHLD);
+	sigaddset(&nmask, SIGHUP);
+	sigaddset(&nmask, SIGTERM);
+	sigaddset(&nmask, SIGQUIT);
+	sigaddset(&nmask, SIGUSR1);
+	sigprocmask(SIG_BLOCK, &nmask, &omask);
+
+	for (i = 0; i < options.accept_workers; i++)
+		if (accept_worker_spawn(i, &omask))
+			return;
+	/* the first worker owns our listen sockets now */
+	close_listen_socks();
+
+	for (;;) {
+		while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+			for (i = 0; i < options.accept_workers; i++)
+				if (worker_pids[i] == pid)
+					break;
+			if (i == options.accept_workers)
+				continue;
+			worker_pids[i] = -1;
+			accept_worker_orphan(i);
+			if (time(NULL) - worker_started[i] < 2) {
+				error("Accept worker %d exited right after "
+				    "start; terminating.", i);
+				received_sigterm = SIGTERM;
+				break;
+			}
+			log("Accept worker %d (pid %ld) exited; restarting.",
+			    i, (long)pid);
+			if (accept_worker_spawn(i, &omask))
+				return;
+		}
+		if (received_sighup) {
+			accept_workers_kill(SIGTERM);
+			sigprocmask(SIG_SETMASK, &omask, NULL);
+			sighup_restart();
+		}
+		if (received_sigterm) {
+			log("Received signal %d; terminating.",
+			    (int) received_sigterm);
+			accept_workers_kill(SIGTERM);
+			unlink(options.pid_file);
+			exit(255);
+		}
+		if (received_sigusr1) {
+			received_sigusr1 = 0;
+			accept_workers_kill(SIGUSR1);
+		}
+		sigsuspend(&omask);
+	}
+}
+
+/*
+ * Pass an accepted connection, along with the time it was accepted, to
+ * an idle pre-forked child.  Unlike mm_send_fd() this does not abort,
+ * since the child may have died in the meantime.
+ */
+static int
+prefork_send(int fd, int sock, struct timeval *tv)
+{
+	struct msghdr msg;
+	struct iovec vec;
+	struct cmsghdr *cmsg;
+	char tmp[CMSG_SPACE(sizeof(int))];
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = (caddr_t)tmp;
+	msg.msg_controllen = sizeof(tmp);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	*(int *)CMSG_DATA(cmsg) = sock;
+
+	vec.iov_base = (void *)tv;
+	vec.iov_len = sizeof(*tv);
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+
+	if ((n = sendmsg(fd, &msg, 0)) != sizeof(*tv)) {
+		error("prefork_send: sendmsg(%d): %.100s", fd,
+		    n == -1 ? strerror(errno) : "short write");
+		return (-1);
+	}
+	return (0);
+}
+
+/* Wait for a connection from the master.  Returns -1 if it went away. */
+static int
+prefork_recv(int fd, struct timeval *tv)
+{
+	struct msghdr msg;
+	struct iovec vec;
+	struct cmsghdr *cmsg;
+	char tmp[CMSG_SPACE(sizeof(int))];
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	vec.iov_base = (void *)tv;
+	vec.iov_len = sizeof(*tv);
+	msg.msg_iov = &vec;
+	msg.msg_iovlen = 1;
+	msg.msg_control = tmp;
+	msg.msg_controllen = sizeof(tmp);
+
+	while ((n = recvmsg(fd, &msg, 0)) == -1 && errno == EINTR)
+		;
+	if (n == 0 || (n == -1 && errno == ECONNRESET))
+		return (-1);
+	if (n != sizeof(*tv))
+		fatal("prefork_recv: recvmsg: %.100s",
+		    n == -1 ? strerror(errno) : "short read");
+	if ((cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+	    cmsg->cmsg_type != SCM_RIGHTS)
+		fatal("prefork_recv: no descriptor passed");
+	return (*(int *)CMSG_DATA(cmsg));
+}
+
+/*
+ * Fork idle children until there are options.prefork_children of them,
+ * leaving room for the connections already in progress.  Returns 1 in a
+ * child once it has been handed a connection, 0 in the master.
+ */
+static int
+prefork_fill(int startups, int *maxfdp, int *sockp)
+{
+	int i, want, sv[2];
+	pid_t pid;
+
+	want = MIN(options.prefork_children, options.max_startups - startups);
+	for (i = 0; i < options.prefork_children && prefork_idle < want; i++) {
+		if (prefork[i].fd != -1)
+			continue;
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+			error("socketpair: %.100s", strerror(errno));
+			return (0);
+		}
+		if ((pid = fork()) == -1) {
+			error("fork: %.100s", strerror(errno));
+			close(sv[0]);
+			close(sv[1]);
+			return (0);
+		}
+		if (pid == 0) {
+			/*
+			 * Child.  Drop everything belonging to the master
+			 * and wait for a connection.  The socket pair then
+			 * serves as our startup pipe.
+			 */
+			close(sv[0]);
+			close_startup_pipes();
+			close_listen_socks();
+			close_prefork_socks(0);
+			signal(SIGHUP, SIG_DFL);
+			signal(SIGTERM, SIG_DFL);
+			signal(SIGQUIT, SIG_DFL);
+			signal(SIGUSR1, SIG_IGN);
+			log_init(__progname, options.log_level,
+			    options.log_facility, log_stderr);
+			if ((*sockp = prefork_recv(sv[1], &accept_tv)) == -1)
+				exit(0);
+			startup_pipe = sv[1];
+			return (1);
+		}
+		close(sv[1]);
+		if (fcntl(sv[0], F_SETFD, 1) == -1)
+			error("fcntl F_SETFD: %.100s", strerror(errno));
+		prefork[i].pid = pid;
+		prefork[i].fd = sv[0];
+		prefork_idle++;
+		if (*maxfdp < sv[0])
+			*maxfdp = sv[0];
+		debug("Forked idle child %ld.", (long)pid);
+		arc4random_stir();
+	}
+	return (0);
+}
+
+/* Returns the index of an idle child, or -1 if there is none. */
+static int
+prefork_get(void)
+{
+	int i;
+
+	if (prefork == NULL || prefork_idle == 0)
+		return (-1);
+	for (i = 0; i < options.prefork_children; i++)
+		if (prefork[i].fd != -1)
+			return (i);
+	return (-1);
+}
+
+static void
+startup_stats_add(u_int32_t usec)
+{
+	u_int32_t lim;
+	int i;
+
+	startup_stats.reports++;
+	startup_stats.usec_total += usec;
+	if (usec > startup_stats.usec_max)
+		startup_stats.usec_max = usec;
+	for (i = 0, lim = 1000; i < STARTUP_HIST - 1; i++, lim *= 10)
+		if (usec < lim)
+			break;
+	startup_stats.hist[i]++;
+}
+
+static void
+startup_stats_log(void)
+{
+	u_int avg;
+
+	avg = startup_stats.reports ? (u_int)(startup_stats.usec_total /
+	    startup_stats.reports) : 0;
+	log("Connections: %u to idle children, %u forked; "
+	    "accept to banner: %u samples, avg %u.%03ums, max %u.%03ums",
+	    startup_stats.handoffs, startup_stats.forks, startup_stats.reports,
+	    avg / 1000, avg % 1000,
+	    startup_stats.usec_max / 1000, startup_stats.usec_max % 1000);
+	log("Accept to banner histogram: <1ms %u, <10ms %u, <100ms %u, "
+	    "<1s %u, <10s %u, >=10s %u", startup_stats.hist[0],
+	    startup_stats.hist[1], startup_stats.hist[2],
+	    startup_stats.hist[3], startup_stats.hist[4],
+	    startup_stats.hist[5]);
+}
+
+/*
+ * Called in the child once the version banner is out.  Tells the master
+ * how long it took since accept(2) over the startup pipe.
+ */
+static void
+startup_report_latency(void)
+{
+	struct timeval now;
+	u_int32_t usec;
+
+	if (startup_pipe == -1 || accept_tv.tv_sec == 0)
+		return;
+	gettimeofday(&now, NULL);
+	if (timercmp(&now, &accept_tv, <))
+		usec = 0;
+	else if (now.tv_sec - accept_tv.tv_sec >= 4000)
+		usec = 0xffffffff;
+	else
+		usec = (now.tv_sec - accept_tv.tv_sec) * 1000000 +
+		    now.tv_usec - accept_tv.tv_usec;
+	if (write(startup_pipe, &usec, sizeof(usec)) != sizeof(usec))
+		debug("startup_report_latency: write: %.100s",
+		    strerror(errno));
+}
+
 static void
 usage(void)
 {
@@ -759,7 +1399,7 @@ main(int ac, char **av)
 {
 	extern char *optarg;
 	extern int optind;
-	int opt, sock_in = 0, sock_out = 0, newsock, j, i, fdsetsz, on = 1;
+	int opt, sock_in = 0, sock_out = 0, newsock, j, i, fdsetsz, newsz, on = 1;
 	pid_t pid;
 	socklen_t fromlen;
 	fd_set *fdset;
@@ -768,11 +1408,10 @@ main(int ac, char **av)
 	int remote_port;
 	FILE *f;
 	struct linger linger;
-	struct addrinfo *ai;
-	char ntop[NI_MAXHOST], strport[NI_MAXSERV];
-	int listen_sock, maxfd;
+	int maxfd;
 	int startup_p[2];
-	int startups = 0;
+	int startups = 0, idle, handoff;
+	u_int32_t latency;
 	Authctxt *authctxt;
 	Key *key;
 	int ret, key_used = 0;
@@ -1045,67 +1684,24 @@ main(int ac, char **av)
 		if (options.protocol & SSH_PROTO_1)
 			generate_ephemeral_server_key();
 	} else {
-		for (ai = options.listen_addrs; ai; ai = ai->ai_next) {
-			if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
-				continue;
-			if (num_listen_socks >= MAX_LISTEN_SOCKS)
-				fatal("Too many listen sockets. "
-				    "Enlarge MAX_LISTEN_SOCKS");
-			if (getnameinfo(ai->ai_addr, ai->ai_addrlen,
-			    ntop, sizeof(ntop), strport, sizeof(strport),
-			    NI_NUMERICHOST|NI_NUMERICSERV) != 0) {
-				error("getnameinfo failed");
-				continue;
-			}
-			/* Create socket for listening. */
-			listen_sock = socket(ai->ai_family, SOCK_STREAM, 0);
-			if (listen_sock < 0) {
-				/* kernel may not support ipv6 */
-				verbose("socket: %.100s", strerror(errno));
-				continue;
-			}
-			if (fcntl(listen_sock, F_SETFL, O_NONBLOCK) < 0) {
-				error("listen_sock O_NONBLOCK: %s", strerror(errno));
-				close(listen_sock);
-				continue;
-			}
-			/*
-			 * Set socket options.  We try to make the port
-			 * reusable and have it close as fast as possible
-			 * without waiting in unnecessary wait states on
-			 * close.
-			 */
-			setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
-			    &on, sizeof(on));
-			linger.l_onoff = 1;
-			linger.l_linger = 5;
-			setsockopt(listen_sock, SOL_SOCKET, SO_LINGER,
-			    &linger, sizeof(linger));
-
-			debug("Bind to port %s on %s.", strport, ntop);
-
-			/* Bind the socket to the desired port. */
-			if (bind(listen_sock, ai->ai_addr, ai->ai_addrlen) < 0) {
-				error("Bind to port %s on %s failed: %.200s.",
-				    strport, ntop, strerror(errno));
-				close(listen_sock);
-				continue;
-			}
-			listen_socks[num_listen_socks] = listen_sock;
-			num_listen_socks++;
-
-			/* Start listening on the port. */
-			log("Server listening on %s port %s.", ntop, strport);
-			if (listen(listen_sock, 5) < 0)
-				fatal("listen: %.100s", strerror(errno));
-
+		if (debug_flag && options.accept_workers > 0) {
+			debug("Not using accept workers in debugging mode.");
+			options.accept_workers = 0;
 		}
-		freeaddrinfo(options.listen_addrs);
-
-		if (!num_listen_socks)
-			fatal("Cannot bind any address.");
-
-		if (options.protocol & SSH_PROTO_1)
+#ifndef SO_REUSEPORT
+		if (options.accept_workers > 0) {
+			log("AcceptWorkers needs SO_REUSEPORT; ignored.");
+			options.accept_workers = 0;
+		}
+#endif
+		server_listen();
+		/* accept workers bind the addresses again */
+		if (options.accept_workers == 0)
+			freeaddrinfo(options.listen_addrs);
+
+		/* each accept worker makes its own key */
+		if ((options.protocol & SSH_PROTO_1) &&
+		    options.accept_workers == 0)
 			generate_ephemeral_server_key();
 
 		/*
@@ -1120,6 +1716,8 @@ main(int ac, char **av)
 		/* Arrange SIGCHLD to be caught. */
 		signal(SIGCHLD, main_sigchld_handler);
 
+		signal(SIGUSR1, sigusr1_handler);
+
 		/* Write out the pid file after the sigterm handler is setup */
 		if (!debug_flag) {
 			/*
@@ -1136,8 +1734,12 @@ main(int ac, char **av)
 			}
 		}
 
+		if (options.accept_workers > 0)
+			accept_workers_start();
+
 		/* setup fd set for listen */
 		fdset = NULL;
+		fdsetsz = 0;
 		maxfd = 0;
 		for (i = 0; i < num_listen_socks; i++)
 			if (listen_socks[i] > maxfd)
@@ -1146,6 +1748,16 @@ main(int ac, char **av)
 		startup_pipes = xmalloc(options.max_startups * sizeof(int));
 		for (i = 0; i < options.max_startups; i++)
 			startup_pipes[i] = -1;
+		/* children left behind by the previous worker of our slot */
+		if (accept_worker != -1)
+			startups = accept_worker_adopt(&maxfd);
+		/* children waiting for a connection */
+		if (options.prefork_children > 0 && !debug_flag) {
+			prefork = xmalloc(options.prefork_children *
+			    sizeof(struct prefork_child));
+			for (i = 0; i < options.prefork_children; i++)
+				prefork[i].fd = -1;
+		}
 
 		/*
 		 * Stay listening for connections until the system crashes or
@@ -1154,10 +1766,20 @@ main(int ac, char **av)
 		for (;;) {
 			if (received_sighup)
 				sighup_restart();
-			if (fdset != NULL)
-				xfree(fdset);
-			fdsetsz = howmany(maxfd+1, NFDBITS) * sizeof(fd_mask);
-			fdset = (fd_set *)xmalloc(fdsetsz);
+			if (prefork != NULL &&
+			    prefork_fill(startups_total(startups), &maxfd,
+			    &newsock)) {
+				/* Child.  Handle the connection we were given. */
+				sock_in = newsock;
+				sock_out = newsock;
+				break;
+			}
+			/* only reallocate when maxfd has outgrown the set */
+			newsz = howmany(maxfd+1, NFDBITS) * sizeof(fd_mask);
+			if (newsz > fdsetsz) {
+				fdset = (fd_set *)xrealloc(fdset, newsz);
+				fdsetsz = newsz;
+			}
 			memset(fdset, 0, fdsetsz);
 
 			for (i = 0; i < num_listen_socks; i++)
@@ -1165,6 +1787,10 @@ main(int ac, char **av)
 			for (i = 0; i < options.max_startups; i++)
 				if (startup_pipes[i] != -1)
 					FD_SET(startup_pipes[i], fdset);
+			for (i = 0; prefork != NULL &&
+			    i < options.prefork_children; i++)
+				if (prefork[i].fd != -1)
+					FD_SET(prefork[i].fd, fdset);
 
 			/* Wait in select until there is a connection. */
 			ret = select(maxfd+1, fdset, NULL, NULL, NULL);
@@ -1174,13 +1800,22 @@ main(int ac, char **av)
 				log("Received signal %d; terminating.",
 				    (int) received_sigterm);
 				close_listen_socks();
-				unlink(options.pid_file);
+				close_prefork_socks(1);
+				startup_stats_log();
+				if (accept_worker == -1)
+					unlink(options.pid_file);
 				exit(255);
 			}
+			if (received_sigusr1) {
+				received_sigusr1 = 0;
+				startup_stats_log();
+			}
 			if (key_used && key_do_regen) {
 				generate_ephemeral_server_key();
 				key_used = 0;
 				key_do_regen = 0;
+				/* idle children hold the old key */
+				close_prefork_socks(1);
 			}
 			if (ret < 0)
 				continue;
@@ -1190,13 +1825,31 @@ main(int ac, char **av)
 				    FD_ISSET(startup_pipes[i], fdset)) {
 					/*
 					 * the read end of the pipe is ready
-					 * if the child has closed the pipe
-					 * after successful authentication
-					 * or if the child has died
+					 * if the child reports its startup
+					 * latency, if the child has closed
+					 * the pipe after successful
+					 * authentication or if the child
+					 * has died
 					 */
+					if (read(startup_pipes[i], &latency,
+					    sizeof(latency)) == sizeof(latency)) {
+						startup_stats_add(latency);
+						continue;
+					}
 					close(startup_pipes[i]);
 					startup_pipes[i] = -1;
-					startups--;
+					startups_publish(--startups);
+				}
+			for (i = 0; prefork != NULL &&
+			    i < options.prefork_children; i++)
+				if (prefork[i].fd != -1 &&
+				    FD_ISSET(prefork[i].fd, fdset)) {
+					/* an idle child has died */
+					debug("Idle child %ld exited.",
+					    (long)prefork[i].pid);
+					close(prefork[i].fd);
+					prefork[i].fd = -1;
+					prefork_idle--;
 				}
 			for (i = 0; i < num_listen_socks; i++) {
 				if (!FD_ISSET(listen_socks[i], fdset))
@@ -1214,12 +1867,38 @@ main(int ac, char **av)
 					close(newsock);
 					continue;
 				}
-				if (drop_connection(startups) == 1) {
-					debug("drop connection #%d", startups);
+				if (drop_connection(startups_total(startups)) == 1) {
+					debug("drop connection #%d",
+					    startups_total(startups));
 					close(newsock);
 					continue;
 				}
-				if (pipe(startup_p) == -1) {
+				gettimeofday(&accept_tv, NULL);
+
+				/*
+				 * Give the connection to an idle child if
+				 * there is one; its end of the socket pair
+				 * becomes the startup pipe.
+				 */
+				handoff = 0;
+				while ((idle = prefork_get()) != -1) {
+					if (prefork_send(prefork[idle].fd,
+					    newsock, &accept_tv) == 0)
+						handoff = 1;
+					else
+						kill(prefork[idle].pid, SIGTERM);
+					startup_p[0] = prefork[idle].fd;
+					prefork[idle].fd = -1;
+					prefork_idle--;
+					if (handoff)
+						break;
+					close(startup_p[0]);
+				}
+				if (handoff) {
+					startup_stats.handoffs++;
+					debug("Connection given to child %ld.",
+					    (long)prefork[idle].pid);
+				} else if (pipe(startup_p) == -1) {
 					close(newsock);
 					continue;
 				}
@@ -1229,7 +1908,7 @@ main(int ac, char **av)
 						startup_pipes[j] = startup_p[0];
 						if (maxfd < startup_p[0])
 							maxfd = startup_p[0];
-						startups++;
+						startups_publish(++startups);
 						break;
 					}
 
@@ -1250,7 +1929,7 @@ main(int ac, char **av)
 					startup_pipe = -1;
 					pid = getpid();
 					break;
-				} else {
+				} else if (!handoff) {
 					/*
 					 * Normal production daemon.  Fork, and have
 					 * the child process the connection. The
@@ -1267,6 +1946,7 @@ main(int ac, char **av)
 						startup_pipe = startup_p[1];
 						close_startup_pipes();
 						close_listen_socks();
+						close_prefork_socks(0);
 						sock_in = newsock;
 						sock_out = newsock;
 						log_init(__progname, options.log_level, options.log_facility, log_stderr);
@@ -1275,12 +1955,17 @@ main(int ac, char **av)
 				}
 
 				/* Parent.  Stay in the loop. */
-				if (pid < 0)
+				if (handoff)
+					;
+				else if (pid < 0)
 					error("fork: %.100s", strerror(errno));
-				else
+				else {
+					startup_stats.forks++;
 					debug("Forked child %ld.", (long)pid);
+				}
 
-				close(startup_p[1]);
+				if (!handoff)
+					close(startup_p[1]);
 
 				/* Mark that the key has been used (it was "given" to the child). */
 				if ((options.protocol & SSH_PROTO_1) &&
@@ -1323,6 +2008,14 @@ main(int ac, char **av)
 	signal(SIGTERM, SIG_DFL);
 	signal(SIGQUIT, SIG_DFL);
 	signal(SIGCHLD, SIG_DFL);
+	signal(SIGUSR1, SIG_IGN);
+
+	/* only the accept workers update the startup counts */
+	if (worker_startups != NULL) {
+		munmap((void *)worker_startups,
+		    options.accept_workers * sizeof(int));
+		worker_startups = NULL;
+	}
 
 	/*
 	 * Set socket options for the connection.  We want the socket to
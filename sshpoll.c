@@ -0,0 +1,348 @@
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "includes.h"
+RCSID("$OpenBSD$");
+
+#include <poll.h>
+#if defined(HAVE_EPOLL) || defined(__linux__)
+# define USE_EPOLL
+# include <sys/epoll.h>
+#endif
+
+#include "xmalloc.h"
+#include "log.h"
+#include "sshpoll.h"
+
+#define SSHPOLL_BACKEND_POLL	1
+#define SSHPOLL_BACKEND_EPOLL	2
+
+struct pollent {
+	u_int	want;		/* interest registered with the kernel */
+	u_int	revents;	/* readiness reported by the last wait */
+	int	tag;		/* caller supplied cookie */
+	int	slot;		/* index into pfd[] (poll backend) */
+};
+
+struct Sshpoll {
+	int	 backend;
+	int	 epfd;
+	struct pollent *ent;	/* indexed by file descriptor */
+	int	 nent;
+	int	 nwant;		/* number of registered descriptors */
+	struct pollfd *pfd;	/* poll backend: registered descriptors */
+	int	 pfdalloc;
+#ifdef USE_EPOLL
+	struct epoll_event *evs;
+	int	 evalloc;
+#endif
+	int	*ready;		/* descriptors reported by the last wait */
+	int	 nready;
+	int	 readyalloc;
+};
+
+Sshpoll *
+sshpoll_new(void)
+{
+	Sshpoll *sp;
+
+	sp = xmalloc(sizeof(*sp));
+	memset(sp, 0, sizeof(*sp));
+	sp->epfd = -1;
+	sp->backend = SSHPOLL_BACKEND_POLL;
+#ifdef USE_EPOLL
+	if ((sp->epfd = epoll_create(64)) == -1) {
+		debug("sshpoll_new: epoll_create: %.100s; using poll",
+		    strerror(errno));
+	} else {
+		if (fcntl(sp->epfd, F_SETFD, 1) == -1)
+			error("sshpoll_new: fcntl F_SETFD: %.100s",
+			    strerror(errno));
+		sp->backend = SSHPOLL_BACKEND_EPOLL;
+	}
+#endif
+	debug2("sshpoll_new: using %s", sshpoll_backend(sp));
+	return sp;
+}
+
+void
+sshpoll_free(Sshpoll *sp)
+{
+	if (sp->epfd != -1)
+		close(sp->epfd);
+	if (sp->ent != NULL)
+		xfree(sp->ent);
+	if (sp->pfd != NULL)
+		xfree(sp->pfd);
+#ifdef USE_EPOLL
+	if (sp->evs != NULL)
+		xfree(sp->evs);
+#endif
+	if (sp->ready != NULL)
+		xfree(sp->ready);
+	memset(sp, 0, sizeof(*sp));
+	xfree(sp);
+}
+
+const char *
+sshpoll_backend(Sshpoll *sp)
+{
+	return (sp->backend == SSHPOLL_BACKEND_EPOLL ? "epoll" : "poll");
+}
+
+static struct pollent *
+sshpoll_entry(Sshpoll *sp, int fd)
+{
+	int i, n;
+
+	if (fd >= sp->nent) {
+		n = MAX(sp->nent * 2, 64);
+		while (n <= fd)
+			n *= 2;
+		sp->ent = xrealloc(sp->ent, n * sizeof(struct pollent));
+		for (i = sp->nent; i < n; i++) {
+			sp->ent[i].want = 0;
+			sp->ent[i].revents = 0;
+			sp->ent[i].tag = -1;
+			sp->ent[i].slot = -1;
+		}
+		sp->nent = n;
+	}
+	return &sp->ent[fd];
+}
+
+#ifdef USE_EPOLL
+static void
+sshpoll_epoll_ctl(Sshpoll *sp, int fd, u_int old, u_int events)
+{
+	struct epoll_event ev;
+	int op;
+
+	memset(&ev, 0, sizeof(ev));
+	if (events & SSHPOLL_IN)
+		ev.events |= EPOLLIN;
+	if (events & SSHPOLL_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = fd;
+
+	op = old == 0 ? EPOLL_CTL_ADD :
+	    (events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD);
+	if (epoll_ctl(sp->epfd, op, fd, &ev) == 0)
+		return;
+	/*
+	 * The kernel drops closed descriptors on its own, so our idea of
+	 * what is registered may be stale.  Retry with the other operation.
+	 */
+	if (op == EPOLL_CTL_ADD && errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (op == EPOLL_CTL_MOD && errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else if (op == EPOLL_CTL_DEL)
+		return;
+	else
+		goto fail;
+	if (epoll_ctl(sp->epfd, op, fd, &ev) == 0)
+		return;
+ fail:
+	error("sshpoll_set: epoll_ctl fd %d: %.100s", fd, strerror(errno));
+}
+#endif
+
+static void
+sshpoll_poll_ctl(Sshpoll *sp, struct pollent *e, int fd, u_int events)
+{
+	int last;
+
+	if (events == 0) {
+		/* swap the last registered descriptor into the hole */
+		last = sp->nwant - 1;
+		if (e->slot != last) {
+			sp->pfd[e->slot] = sp->pfd[last];
+			sp->ent[sp->pfd[last].fd].slot = e->slot;
+		}
+		e->slot = -1;
+		return;
+	}
+	if (e->slot == -1) {
+		if (sp->nwant >= sp->pfdalloc) {
+			sp->pfdalloc = MAX(sp->pfdalloc * 2, 64);
+			sp->pfd = xrealloc(sp->pfd,
+			    sp->pfdalloc * sizeof(struct pollfd));
+		}
+		e->slot = sp->nwant;
+		sp->pfd[e->slot].fd = fd;
+	}
+	sp->pfd[e->slot].events = 0;
+	if (events & SSHPOLL_IN)
+		sp->pfd[e->slot].events |= POLLIN;
+	if (events & SSHPOLL_OUT)
+		sp->pfd[e->slot].events |= POLLOUT;
+}
+
+/*
+ * Register interest in 'events' (SSHPOLL_IN|SSHPOLL_OUT) for fd.  An
+ * empty set removes the descriptor.  Only changes reach the kernel.
+ */
+void
+sshpoll_set(Sshpoll *sp, int fd, u_int events, int tag)
+{
+	struct pollent *e;
+
+	if (fd < 0)
+		return;
+	if (fd >= sp->nent && events == 0)
+		return;
+	e = sshpoll_entry(sp, fd);
+	e->tag = tag;
+	if (e->want == events)
+		return;
+#ifdef USE_EPOLL
+	if (sp->backend == SSHPOLL_BACKEND_EPOLL)
+		sshpoll_epoll_ctl(sp, fd, e->want, events);
+	else
+#endif
+		sshpoll_poll_ctl(sp, e, fd, events);
+	if (e->want == 0)
+		sp->nwant++;
+	else if (events == 0)
+		sp->nwant--;
+	e->want = events;
+	e->revents &= events;
+}
+
+u_int
+sshpoll_get(Sshpoll *sp, int fd)
+{
+	if (fd < 0 || fd >= sp->nent)
+		return 0;
+	return sp->ent[fd].want;
+}
+
+static void
+sshpoll_add_ready(Sshpoll *sp, int fd, u_int revents)
+{
+	struct pollent *e = &sp->ent[fd];
+
+	if (revents == 0)
+		return;
+	if (sp->nready >= sp->readyalloc) {
+		sp->readyalloc = MAX(sp->readyalloc * 2, 64);
+		sp->ready = xrealloc(sp->ready, sp->readyalloc * sizeof(int));
+	}
+	e->revents = revents;
+	sp->ready[sp->nready++] = fd;
+}
+
+/*
+ * Wait up to timeout milliseconds (-1 means forever) for any registered
+ * descriptor to become ready.  Returns the number of ready descriptors,
+ * or -1 with errno set.
+ */
+int
+sshpoll_wait(Sshpoll *sp, int timeout)
+{
+	u_int revents;
+	int i, n, fd;
+
+	for (i = 0; i < sp->nready; i++)
+		sp->ent[sp->ready[i]].revents = 0;
+	sp->nready = 0;
+
+#ifdef USE_EPOLL
+	if (sp->backend == SSHPOLL_BACKEND_EPOLL) {
+		if (sp->evalloc < sp->nwant || sp->evs == NULL) {
+			sp->evalloc = MAX(sp->nwant, 64);
+			sp->evs = xrealloc(sp->evs,
+			    sp->evalloc * sizeof(struct epoll_event));
+		}
+		n = epoll_wait(sp->epfd, sp->evs, sp->evalloc, timeout);
+		if (n == -1)
+			return -1;
+		for (i = 0; i < n; i++) {
+			fd = sp->evs[i].data.fd;
+			if (fd < 0 || fd >= sp->nent)
+				continue;
+			revents = 0;
+			if (sp->evs[i].events & EPOLLIN)
+				revents |= SSHPOLL_IN;
+			if (sp->evs[i].events & EPOLLOUT)
+				revents |= SSHPOLL_OUT;
+			/* like select(), report errors as ready */
+			if (sp->evs[i].events & (EPOLLHUP|EPOLLERR))
+				revents |= sp->ent[fd].want;
+			sshpoll_add_ready(sp, fd, revents & sp->ent[fd].want);
+		}
+		return sp->nready;
+	}
+#endif
+	n = poll(sp->pfd, sp->nwant, timeout);
+	if (n == -1)
+		return -1;
+	for (i = 0; i < sp->nwant && sp->nready < n; i++) {
+		if (sp->pfd[i].revents == 0)
+			continue;
+		fd = sp->pfd[i].fd;
+		revents = 0;
+		if (sp->pfd[i].revents & POLLIN)
+			revents |= SSHPOLL_IN;
+		if (sp->pfd[i].revents & POLLOUT)
+			revents |= SSHPOLL_OUT;
+		if (sp->pfd[i].revents & (POLLHUP|POLLERR|POLLNVAL))
+			revents |= sp->ent[fd].want;
+		sshpoll_add_ready(sp, fd, revents & sp->ent[fd].want);
+	}
+	return sp->nready;
+}
+
+int
+sshpoll_nready(Sshpoll *sp)
+{
+	return sp->nready;
+}
+
+/*
+ * Returns the idx'th descriptor reported by the last sshpoll_wait(),
+ * with its events and tag.  Events are cleared if the descriptor was
+ * unregistered in the meantime.
+ */
+int
+sshpoll_ready(Sshpoll *sp, int idx, int *fdp, u_int *reventsp, int *tagp)
+{
+	int fd;
+
+	if (idx < 0 || idx >= sp->nready)
+		return -1;
+	fd = sp->ready[idx];
+	*fdp = fd;
+	*reventsp = sp->ent[fd].revents;
+	*tagp = sp->ent[fd].tag;
+	return 0;
+}
+
+u_int
+sshpoll_revents(Sshpoll *sp, int fd)
+{
+	if (fd < 0 || fd >= sp->nent)
+		return 0;
+	return sp->ent[fd].revents;
+}
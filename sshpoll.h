@@ -0,0 +1,52 @@
+/*	$OpenBSD$	*/
+
+/*
+ * Copyright (c) 2002 The OpenSSH Project.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SSHPOLL_H
+#define SSHPOLL_H
+
+/*
+ * Descriptor readiness notification.  Interest is registered per
+ * descriptor and kept across calls to sshpoll_wait(), so callers only
+ * pay for changes.  Uses epoll(2) where available and poll(2) otherwise.
+ */
+
+#define SSHPOLL_IN	0x01
+#define SSHPOLL_OUT	0x02
+
+typedef struct Sshpoll Sshpoll;
+
+Sshpoll	*sshpoll_new(void);
+void	 sshpoll_free(Sshpoll *);
+const char *sshpoll_backend(Sshpoll *);
+
+void	 sshpoll_set(Sshpoll *, int, u_int, int);
+u_int	 sshpoll_get(Sshpoll *, int);
+int	 sshpoll_wait(Sshpoll *, int);
+int	 sshpoll_nready(Sshpoll *);
+int	 sshpoll_ready(Sshpoll *, int, int *, u_int *, int *);
+u_int	 sshpoll_revents(Sshpoll *, int);
+
+#endif